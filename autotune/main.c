@@ -0,0 +1,467 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <complex.h>
+#include <math.h>
+
+#include <libdill.h>
+
+#include "logging.h"
+#include "link.h"
+#include "runtime.h"
+#include "profile.h"
+#include "fm_source.h"
+
+#include "resampler.h"
+#include "wbfm_demod.h"
+
+// same rates as wbfm_demod
+#define RATE (1000000UL)
+#define RRATE (192000UL)
+#define DECIM (4UL)
+#define AUDIO_RATE (RRATE / DECIM)
+#define SYNTH_SAMPLES (1UL << 18)
+#define DEFAULT_DURATION_MS (2000UL)
+#define THROUGHPUT_SAMPLES (1UL << 23)
+// a setting has to keep up with this many times the SDR rate
+#define MIN_HEADROOM (2.0)
+
+// SDR block sizes resampling to whole audio blocks, ring depths in blocks
+static const size_t block_sizes[] = {2500, 5000, 10000, 20000, 40000};
+static const size_t depths[] = {2, 4, 8};
+#define NUM_BLOCK_SIZES (sizeof(block_sizes) / sizeof(block_sizes[0]))
+#define NUM_DEPTHS (sizeof(depths) / sizeof(depths[0]))
+
+typedef struct
+{
+    size_t block_size;
+    size_t depth;
+    double msps;
+    double latency_ms;
+    double max_latency_ms;
+    size_t underruns;
+} tune_result_t;
+
+static size_t num_workers = 0;
+static size_t duration_ms = DEFAULT_DURATION_MS;
+static const char *input_file = NULL;
+static const char *output_file = PROFILE_FILE_NAME;
+static complex float *input;
+static size_t input_len;
+
+static const char help_msg[] =
+    "autotune, sweeps the SDR block size and the ring depths of the wbfm_demod chain\n"
+    "and writes the setting with the lowest latency that keeps up without underruns\n\n"
+    "Use:\tautotune [-i <file>] [-d <ms>] [-o <profile>] [-j <threads>]\n"
+    "\t-i raw complex float samples at 1 MHz instead of a synthetic station\n"
+    "\t-d duration of each real time run\n"
+    "\t-o profile to write, " PROFILE_FILE_NAME " by default\n"
+    "\t-j run the blocks on a pool of worker threads\n";
+
+static bool parse_args(int argc, char *argv[])
+{
+    int opt;
+    bool ret = true;
+
+    while (ret && (opt = getopt(argc, argv, "i:d:o:j:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            input_file = optarg;
+            break;
+
+        case 'd':
+            duration_ms = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'o':
+            output_file = optarg;
+            break;
+
+        case 'j':
+            num_workers = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'h':
+            fprintf(stderr, help_msg);
+            ret = false;
+            break;
+
+        default:
+            fprintf(stderr, "\n");
+            fprintf(stderr, help_msg);
+            ret = false;
+            break;
+        }
+    }
+
+    return ret;
+}
+
+static void generate_input(void)
+{
+    input_len = SYNTH_SAMPLES;
+    input = (complex float *)malloc(input_len * sizeof(complex float));
+    log_assert(input);
+    fm_source_fill(input, input_len, RATE);
+}
+
+static bool load_input(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        LOG(ERROR, "Failed to open %s", path);
+        return false;
+    }
+
+    int ret = fseek(file, 0, SEEK_END);
+    log_assert(ret == 0);
+    long size = ftell(file);
+    rewind(file);
+
+    input_len = size / sizeof(complex float);
+    if (input_len == 0)
+    {
+        LOG(ERROR, "No samples in %s", path);
+        fclose(file);
+        return false;
+    }
+    input = (complex float *)malloc(input_len * sizeof(complex float));
+    log_assert(input);
+    size_t n = fread(input, sizeof(complex float), input_len, file);
+    log_assert(n == input_len);
+    fclose(file);
+
+    LOG(INFO, "Loaded %lu samples from %s", input_len, path);
+    return true;
+}
+
+// Copies 'n' samples starting at 'pos', looping over the input
+static void copy_input(complex float *dest, size_t pos, size_t n)
+{
+    while (n > 0)
+    {
+        size_t off = pos % input_len;
+        size_t m = ((input_len - off) < n) ? (input_len - off) : n;
+        memcpy(dest, &input[off], m * sizeof(complex float));
+        dest += m;
+        pos += m;
+        n -= m;
+    }
+}
+
+// Stamps every block with the time its last sample would come out of the
+// SDR, in real time mode it is also held back until then
+static coroutine void source(link_t *out, bool paced, int64_t start_ns)
+{
+    size_t bs = out->out_bs;
+    link_msg_t msg = {
+        .len = bs,
+        .id = 0,
+        .flags = LINK_MSG_HAS_TIME};
+
+    for (size_t k = 0; true; k++)
+    {
+        msg.time_ns = start_ns + (int64_t)(((k + 1) * bs * 1000000000ULL) / RATE);
+        if (paced)
+        {
+            int64_t wait = msg.time_ns - latency_now_ns();
+            if ((wait > 0) && (msleep(now() + ((wait + 999999) / 1000000)) != 0))
+            {
+                break;
+            }
+        }
+        if (link_wait_send(out, bs, -1) != 0)
+        {
+            break;
+        }
+        copy_input((complex float *)ring_get_write_ptr(out->out_buf), k * bs, bs);
+        ring_bump_head(out->out_buf, bs);
+        if (link_send(out, &msg) != 0)
+        {
+            break;
+        }
+    }
+}
+
+// Takes the output as fast as it comes
+static coroutine void sink(link_t *in, size_t blocks, int done_ch)
+{
+    link_msg_t msg;
+
+    while (blocks > 0)
+    {
+        if (link_recv(in, &msg, -1) != 0)
+        {
+            return;
+        }
+        size_t n = link_consume(in, NULL, msg.len);
+        blocks -= n / in->in_bs;
+    }
+
+    link_close(in);
+    int ret = chsend(done_ch, NULL, 0, -1);
+    log_assert(ret == 0);
+}
+
+// Plays one block per audio period like the audio callback does, a period
+// without a whole block queued is an underrun. The latency of a block is the
+// time from its last sample leaving the SDR to it being played.
+static coroutine void audio_sink(link_t *in, size_t blocks, tune_result_t *res, int done_ch)
+{
+    link_msg_t msg;
+    size_t cap = in->in_nb + 1;
+    size_t head = 0, count = 0;
+    size_t played = 0, periods = 0;
+    int64_t play_start = 0;
+    int64_t period_ns = (in->in_bs * 1000000000LL) / AUDIO_RATE;
+    double latency_sum = 0.0;
+
+    int64_t *times = (int64_t *)malloc(cap * sizeof(int64_t));
+    log_assert(times);
+
+    while (played < blocks)
+    {
+        while (link_recv(in, &msg, 0) == 0)
+        {
+            log_assert(count < cap);
+            times[(head + count) % cap] = msg.time_ns;
+            count++;
+        }
+        if (errno != ETIMEDOUT)
+        {
+            free(times);
+            return;
+        }
+
+        int64_t t = latency_now_ns();
+        // underruns only count once the first block is there
+        if ((play_start == 0) && (count > 0))
+        {
+            play_start = t;
+        }
+        if (play_start)
+        {
+            size_t due = ((t - play_start) / period_ns) + 1;
+            for (; (periods < due) && (played < blocks); periods++)
+            {
+                if (count == 0)
+                {
+                    res->underruns++;
+                    continue;
+                }
+                double latency = (t - times[head]) / 1e6;
+                latency_sum += latency;
+                if (latency > res->max_latency_ms)
+                {
+                    res->max_latency_ms = latency;
+                }
+                head = (head + 1) % cap;
+                count--;
+                link_consume(in, NULL, in->in_bs);
+                played++;
+            }
+        }
+
+        if (msleep(now() + 1) != 0)
+        {
+            free(times);
+            return;
+        }
+    }
+    res->latency_ms = latency_sum / played;
+    free(times);
+
+    link_close(in);
+    int ret = chsend(done_ch, NULL, 0, -1);
+    log_assert(ret == 0);
+}
+
+// Runs the chain once, unpaced for the throughput or in real time for the
+// latency and the underruns
+static void run(tune_result_t *res, bool paced)
+{
+    int ret;
+    int done[2];
+    int h[2];
+    size_t bs = res->block_size;
+    runtime_t *rt = NULL;
+
+    // tasks are never given back to a runtime, each run gets its own
+    if (num_workers > 0)
+    {
+        rt = runtime_create(num_workers);
+        log_assert(rt);
+        link_set_runtime(rt);
+    }
+
+    // the blocks pick their ring depths up from the profile
+    profile_set("resampler.in_nb", res->depth);
+    profile_set("wbfm_demod.in_nb", res->depth);
+
+    ret = chmake(done);
+    log_assert(ret == 0);
+
+    link_t *src = link_connect("source", NULL, 0, bs, sizeof(complex float),
+                               bs, sizeof(complex float));
+    log_assert(src);
+    link_set_format(src, LINK_FMT_CF32);
+    resampler_t *resamp = resampler_create(RATE, RRATE, 0, src);
+    log_assert(resamp);
+    wbfm_demod_t *demod = wbfm_demod_create(RRATE, DECIM, resampler_get_output(resamp));
+    log_assert(demod);
+    link_t *out = wbfm_demod_get_output(demod);
+
+    size_t in_nb = paced ? profile_get("audio_sink.in_nb", 50) : 2;
+    link_t *snk = link_connect("sink", out, in_nb, out->out_bs, sizeof(float), out->out_bs, sizeof(float));
+    log_assert(snk);
+
+    size_t blocks;
+    int64_t start = latency_now_ns();
+    if (paced)
+    {
+        blocks = (duration_ms * AUDIO_RATE) / (1000 * out->out_bs);
+        h[0] = go(audio_sink(snk, blocks ? blocks : 1, res, done[0]));
+    }
+    else
+    {
+        // one output block per input block
+        blocks = THROUGHPUT_SAMPLES / bs;
+        h[0] = go(sink(snk, blocks, done[0]));
+    }
+    log_assert(h[0] >= 0);
+    h[1] = go(source(src, paced, start));
+    log_assert(h[1] >= 0);
+
+    ret = chrecv(done[1], NULL, 0, -1);
+    log_assert(ret == 0);
+
+    if (!paced)
+    {
+        res->msps = (blocks * bs) / ((latency_now_ns() - start) / 1e3);
+    }
+
+    // the stages may still run on the workers, the sink closes its input
+    link_stop_tasks();
+    for (int i = 1; i >= 0; i--)
+    {
+        ret = hclose(h[i]);
+        log_assert(ret == 0);
+    }
+    wbfm_demod_destroy(&demod);
+    resampler_destroy(&resamp);
+    link_close(src);
+    ret = hclose(done[0]);
+    log_assert(ret == 0);
+    ret = hclose(done[1]);
+    log_assert(ret == 0);
+
+    if (rt)
+    {
+        link_set_runtime(NULL);
+        runtime_destroy(&rt);
+    }
+}
+
+// Lowest worst case latency of the settings keeping up without underruns,
+// the fewest underruns when none does
+static const tune_result_t *pick(const tune_result_t *results, size_t n)
+{
+    const tune_result_t *best = NULL;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        const tune_result_t *r = &results[i];
+        bool ok = (r->underruns == 0) && (r->msps >= MIN_HEADROOM * RATE / 1e6);
+        if (ok && (!best || (r->max_latency_ms < best->max_latency_ms)))
+        {
+            best = r;
+        }
+    }
+    if (best)
+    {
+        return best;
+    }
+
+    LOG(WARN, "No setting keeps up in real time, taking the one with the fewest underruns");
+    for (size_t i = 0; i < n; i++)
+    {
+        const tune_result_t *r = &results[i];
+        if (!best || (r->underruns < best->underruns) ||
+            ((r->underruns == best->underruns) && (r->msps > best->msps)))
+        {
+            best = r;
+        }
+    }
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    tune_result_t results[NUM_BLOCK_SIZES * NUM_DEPTHS];
+    size_t n = 0;
+
+    logging_init();
+
+    if (!parse_args(argc, argv))
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // settings tuned by hand survive the calibration
+    profile_load(output_file);
+
+    if (input_file)
+    {
+        if (!load_input(input_file))
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+    else
+    {
+        generate_input();
+    }
+
+    printf("%10s %6s %12s %14s %14s %10s\n", "sdr block", "depth", "Msamples/s",
+           "latency (ms)", "worst (ms)", "underruns");
+    for (size_t i = 0; i < NUM_BLOCK_SIZES; i++)
+    {
+        for (size_t j = 0; j < NUM_DEPTHS; j++)
+        {
+            tune_result_t *r = &results[n++];
+            memset(r, 0, sizeof(*r));
+            r->block_size = block_sizes[i];
+            r->depth = depths[j];
+
+            run(r, false);
+            run(r, true);
+            printf("%10lu %6lu %12.2f %14.2f %14.2f %10lu\n", r->block_size, r->depth, r->msps,
+                   r->latency_ms, r->max_latency_ms, r->underruns);
+        }
+    }
+
+    const tune_result_t *best = pick(results, n);
+    printf("picked sdr block %lu, depth %lu\n", best->block_size, best->depth);
+
+    profile_set("wbfm_demod.sdr_block", best->block_size);
+    profile_set("resampler.in_nb", best->depth);
+    profile_set("wbfm_demod.in_nb", best->depth);
+    profile_set("fms_demod.in_nb", best->depth);
+    bool saved = profile_save(output_file);
+    if (saved)
+    {
+        printf("written to %s\n", output_file);
+    }
+
+    free(input);
+
+    exit(saved ? EXIT_SUCCESS : EXIT_FAILURE);
+}
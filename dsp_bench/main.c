@@ -0,0 +1,579 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <complex.h>
+#include <math.h>
+
+#include "logging.h"
+#include "link.h"
+#include "fm_source.h"
+
+#include "resampler.h"
+#include "wbfm_demod.h"
+#include "fms_demod.h"
+#include "flex_encoder.h"
+#include "flex_decoder.h"
+#include "mel_spectrum.h"
+#include "tflite_runner.h"
+#include "lpc.h"
+#include "17_keywords.h"
+
+// same rates and block sizes as the applications
+#define SDR_RATE (1000000UL)
+#define SDR_BS (10 * 1000UL)
+#define FM_RATE (192000UL)
+#define FM_DECIM (4UL)
+#define FM_BS ((SDR_BS * FM_RATE) / SDR_RATE)
+#define FLEX_BS (2000UL)
+#define FLEX_PAYLOAD (100UL)
+#define MEL_RATE (16000UL)
+#define MEL_FRAME_LEN (1024UL)
+#define MEL_FRAME_STEP (256UL)
+#define MEL_SLICE_SIZE (80UL)
+#define MEL_SLICES (((MEL_RATE - MEL_FRAME_LEN) / MEL_FRAME_STEP) + 1)
+#define TF_INPUT_SIZE (MEL_SLICES * MEL_SLICE_SIZE)
+
+#define DEFAULT_MIN_MS (500UL)
+#define DEFAULT_THRESHOLD (5.0)
+#define MAX_BENCHES (16)
+#define MAX_NAME (32)
+
+// One block driven in isolation: 'run' makes one call and returns the number
+// of samples it covered, 'per' says what a sample is
+typedef struct
+{
+    const char *name;
+    const char *per;
+    void (*setup)(void);
+    size_t (*run)(void);
+    void (*teardown)(void);
+} bench_t;
+
+typedef struct
+{
+    char name[MAX_NAME];
+    size_t samples;
+    double ns_per_sample;
+    double msamples_per_s;
+    double cycles_per_sample;
+} bench_result_t;
+
+static size_t min_ms = DEFAULT_MIN_MS;
+static const char *filter = NULL;
+static const char *baseline_file = NULL;
+static const char *output_file = NULL;
+static double threshold = DEFAULT_THRESHOLD;
+
+static const char help_msg[] =
+    "dsp_bench, drives the handler of each block with synthetic input\n\n"
+    "Use:\tdsp_bench [-m <ms>] [-f <name>] [-o <file>] [-b <baseline>] [-t <percent>]\n"
+    "\t-m minimum run time of each benchmark\n"
+    "\t-f only run the benchmarks with <name> in their name\n"
+    "\t-o write the JSON results to <file> instead of stdout\n"
+    "\t-b compare against the JSON results in <baseline>\n"
+    "\t-t slowdown in percent that counts as a regression (default 5)\n";
+
+static bool parse_args(int argc, char *argv[])
+{
+    int opt;
+    bool ret = true;
+
+    while (ret && (opt = getopt(argc, argv, "m:f:o:b:t:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm':
+            min_ms = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'f':
+            filter = optarg;
+            break;
+
+        case 'o':
+            output_file = optarg;
+            break;
+
+        case 'b':
+            baseline_file = optarg;
+            break;
+
+        case 't':
+            threshold = strtod(optarg, NULL);
+            break;
+
+        case 'h':
+            fprintf(stderr, help_msg);
+            ret = false;
+            break;
+
+        default:
+            fprintf(stderr, "\n");
+            fprintf(stderr, help_msg);
+            ret = false;
+            break;
+        }
+    }
+
+    return ret;
+}
+
+// Time stamp counter where there is one
+static bool has_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return true;
+#else
+    return false;
+#endif
+}
+
+static uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static complex float *iq_in;
+static void *out_buf;
+
+// resampler: SDR samples in
+static resampler_t *resamp;
+
+static void resampler_setup(void)
+{
+    iq_in = (complex float *)malloc(SDR_BS * sizeof(complex float));
+    log_assert(iq_in);
+    fm_source_fill(iq_in, SDR_BS, SDR_RATE);
+    out_buf = malloc(2 * FM_BS * sizeof(complex float));
+    log_assert(out_buf);
+    resamp = resampler_create_stage(SDR_RATE, FM_RATE, 0, LINK_FMT_CF32, SDR_BS);
+    log_assert(resamp);
+}
+
+static size_t resampler_run(void)
+{
+    link_msg_t in_msg = {.len = SDR_BS};
+    link_msg_t out_msg = {0};
+
+    resampler_handler(resamp, iq_in, &in_msg, out_buf, &out_msg);
+    return SDR_BS;
+}
+
+static void resampler_teardown(void)
+{
+    resampler_destroy(&resamp);
+    free(out_buf);
+    free(iq_in);
+}
+
+// wbfm_demod and fms_demod: resampled samples in
+static wbfm_demod_t *wbfm;
+static fms_demod_t *fms;
+
+static void fm_setup(void)
+{
+    iq_in = (complex float *)malloc(FM_BS * sizeof(complex float));
+    log_assert(iq_in);
+    fm_source_fill(iq_in, FM_BS, FM_RATE);
+    out_buf = malloc(2 * (FM_BS / FM_DECIM) * sizeof(float));
+    log_assert(out_buf);
+}
+
+static void wbfm_setup(void)
+{
+    fm_setup();
+    wbfm = wbfm_demod_create_stage(FM_RATE, FM_DECIM, FM_BS);
+    log_assert(wbfm);
+}
+
+static size_t wbfm_run(void)
+{
+    link_msg_t in_msg = {.len = FM_BS};
+    link_msg_t out_msg = {0};
+
+    wbfm_demod_handler(wbfm, iq_in, &in_msg, out_buf, &out_msg);
+    return FM_BS;
+}
+
+static void wbfm_teardown(void)
+{
+    wbfm_demod_destroy(&wbfm);
+    free(out_buf);
+    free(iq_in);
+}
+
+static void fms_setup(void)
+{
+    fm_setup();
+    fms = fms_demod_create_stage(FM_RATE, FM_DECIM, FM_BS);
+    log_assert(fms);
+}
+
+static size_t fms_run(void)
+{
+    link_msg_t in_msg = {.len = FM_BS};
+    link_msg_t out_msg = {0};
+
+    fms_demod_handle(fms, iq_in, &in_msg, out_buf, &out_msg);
+    return FM_BS;
+}
+
+static void fms_teardown(void)
+{
+    fms_demod_destroy(&fms);
+    free(out_buf);
+    free(iq_in);
+}
+
+// flex_encoder: audio samples out, a new frame starts whenever one is done
+static flex_encoder_t *flex_enc;
+static uint8_t payload[FLEX_PAYLOAD];
+
+static void flex_enc_setup(void)
+{
+    for (size_t i = 0; i < FLEX_PAYLOAD; i++)
+    {
+        payload[i] = rand() & 0xff;
+    }
+    out_buf = malloc(FLEX_BS * sizeof(float));
+    log_assert(out_buf);
+    flex_enc = flex_encoder_create_stage(FLEX_BS);
+    log_assert(flex_enc);
+}
+
+static size_t flex_enc_run(void)
+{
+    link_msg_t in_msg = {.len = FLEX_PAYLOAD};
+    link_msg_t out_msg = {0};
+
+    flex_encoder_handler(flex_enc, payload, &in_msg, out_buf, &out_msg);
+    return out_msg.len;
+}
+
+static void flex_enc_teardown(void)
+{
+    flex_encoder_destroy(&flex_enc);
+    free(out_buf);
+}
+
+// flex_decoder: audio samples in, looping over a few encoded frames
+#define FLEX_FRAMES_BS (64UL)
+static flex_decoder_t *flex_dec;
+static float *flex_in;
+static size_t flex_pos;
+
+static void flex_dec_setup(void)
+{
+    flex_enc_setup();
+    flex_in = (float *)malloc(FLEX_FRAMES_BS * FLEX_BS * sizeof(float));
+    log_assert(flex_in);
+    for (size_t i = 0; i < FLEX_FRAMES_BS; i++)
+    {
+        link_msg_t in_msg = {.len = FLEX_PAYLOAD};
+        link_msg_t out_msg = {0};
+        flex_encoder_handler(flex_enc, payload, &in_msg, &flex_in[i * FLEX_BS], &out_msg);
+    }
+    flex_enc_teardown();
+
+    out_buf = malloc(FLEX_DECODER_MAX_PAYLOAD);
+    log_assert(out_buf);
+    flex_pos = 0;
+    flex_dec = flex_decoder_create_stage(FLEX_BS);
+    log_assert(flex_dec);
+}
+
+static size_t flex_dec_run(void)
+{
+    link_msg_t in_msg = {.len = FLEX_BS};
+    link_msg_t out_msg = {0};
+
+    flex_decoder_handler(flex_dec, &flex_in[flex_pos * FLEX_BS], &in_msg, out_buf, &out_msg);
+    flex_pos = (flex_pos + 1) % FLEX_FRAMES_BS;
+    return FLEX_BS;
+}
+
+static void flex_dec_teardown(void)
+{
+    flex_decoder_destroy(&flex_dec);
+    free(flex_in);
+    free(out_buf);
+}
+
+// mel_spectrum_process: one frame per hop of new audio
+static mel_spectrum_t *mel;
+static float *audio_in;
+
+static void mel_setup(void)
+{
+    audio_in = (float *)malloc(MEL_FRAME_LEN * sizeof(float));
+    log_assert(audio_in);
+    for (size_t i = 0; i < MEL_FRAME_LEN; i++)
+    {
+        audio_in[i] = 0.5f * sinf(2 * M_PI * 440.0f * i / MEL_RATE) + 0.01f * ((rand() % 200) - 100) / 100.0f;
+    }
+    out_buf = malloc(MEL_SLICE_SIZE * sizeof(float));
+    log_assert(out_buf);
+    mel = mel_spectrum_create(MEL_FRAME_LEN, MEL_SLICE_SIZE, MEL_RATE, 20.0, 7600.0);
+    log_assert(mel);
+}
+
+static size_t mel_run(void)
+{
+    mel_spectrum_process(mel, audio_in, (float *)out_buf);
+    return MEL_FRAME_STEP;
+}
+
+static void mel_teardown(void)
+{
+    mel_spectrum_destroy(&mel);
+    free(out_buf);
+    free(audio_in);
+}
+
+// tflite_runner_run: one second of audio per inference
+static tflite_runner_t *tfr;
+static float *features;
+
+static void tflite_setup(void)
+{
+    features = (float *)malloc(TF_INPUT_SIZE * sizeof(float));
+    log_assert(features);
+    for (size_t i = 0; i < TF_INPUT_SIZE; i++)
+    {
+        features[i] = (rand() % 1000) / 100.0f;
+    }
+    tfr = tflite_runner_create_from_mem(models_17_keywords_tflite, sizeof(models_17_keywords_tflite));
+    log_assert(tfr);
+}
+
+static size_t tflite_run(void)
+{
+    float score;
+
+    tflite_runner_run(tfr, features, TF_INPUT_SIZE, &score);
+    return MEL_RATE;
+}
+
+static void tflite_teardown(void)
+{
+    tflite_runner_destroy(&tfr);
+    free(features);
+}
+
+// lpc_filter_exec: one LPC frame of output samples
+static lpc_filter_t *lpc;
+static uint32_t lpc_rnd = 1;
+static volatile fix16_t lpc_sink;
+
+static void lpc_setup(void)
+{
+    const lpc_seq_t *seq = lpc_get_seq(LPC_ZEROWA);
+
+    lpc = lpc_filter_new();
+    log_assert(lpc);
+    lpc_filter_reset(lpc);
+    // a voiced frame
+    lpc_filter_update(lpc, seq->frames[5].a, seq->frames[5].g, seq->frames[5].ps);
+}
+
+static size_t lpc_run(void)
+{
+    for (size_t i = 0; i < LPC_FRAME_LEN; i++)
+    {
+        lpc_rnd = (lpc_rnd * 1103515245U) + 12345U;
+        lpc_sink = lpc_filter_exec(lpc, lpc_rnd);
+    }
+    return LPC_FRAME_LEN;
+}
+
+static void lpc_teardown(void)
+{
+}
+
+static const bench_t benches[] = {
+    {"resampler", "input sample", resampler_setup, resampler_run, resampler_teardown},
+    {"wbfm_demod", "input sample", wbfm_setup, wbfm_run, wbfm_teardown},
+    {"fms_demod", "input sample", fms_setup, fms_run, fms_teardown},
+    {"flex_encoder", "output sample", flex_enc_setup, flex_enc_run, flex_enc_teardown},
+    {"flex_decoder", "input sample", flex_dec_setup, flex_dec_run, flex_dec_teardown},
+    {"mel_spectrum", "audio sample", mel_setup, mel_run, mel_teardown},
+    {"tflite_runner", "audio sample", tflite_setup, tflite_run, tflite_teardown},
+    {"lpc_filter", "output sample", lpc_setup, lpc_run, lpc_teardown},
+};
+#define NUM_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+static void run_bench(const bench_t *b, bench_result_t *res)
+{
+    size_t samples = 0;
+
+    b->setup();
+    // warm up caches, filters and allocations
+    for (size_t i = 0; i < 8; i++)
+    {
+        b->run();
+    }
+
+    uint64_t deadline = latency_now_ns() + (min_ms * 1000000ULL);
+    uint64_t start = latency_now_ns();
+    uint64_t c = cycles();
+    do
+    {
+        samples += b->run();
+    } while (latency_now_ns() < deadline);
+    c = cycles() - c;
+    uint64_t elapsed = latency_now_ns() - start;
+    b->teardown();
+
+    strncpy(res->name, b->name, MAX_NAME - 1);
+    res->samples = samples;
+    res->ns_per_sample = (double)elapsed / samples;
+    res->msamples_per_s = (samples * 1e3) / elapsed;
+    res->cycles_per_sample = (double)c / samples;
+}
+
+static void write_json(FILE *f, const bench_result_t *results, size_t n)
+{
+    fprintf(f, "{\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < n; i++)
+    {
+        const bench_result_t *r = &results[i];
+        const bench_t *b = NULL;
+        for (size_t j = 0; j < NUM_BENCHES; j++)
+        {
+            if (strcmp(benches[j].name, r->name) == 0)
+            {
+                b = &benches[j];
+            }
+        }
+        // one benchmark per line, the baseline reader relies on it
+        fprintf(f, "    {\"name\": \"%s\", \"per\": \"%s\", \"samples\": %lu, \"ns_per_sample\": %.4f, "
+                   "\"msamples_per_s\": %.4f, ",
+                r->name, b->per, r->samples, r->ns_per_sample, r->msamples_per_s);
+        if (has_cycles())
+        {
+            fprintf(f, "\"cycles_per_sample\": %.4f}", r->cycles_per_sample);
+        }
+        else
+        {
+            fprintf(f, "\"cycles_per_sample\": null}");
+        }
+        fprintf(f, "%s\n", (i + 1 < n) ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+}
+
+// Reads back what write_json wrote
+static size_t read_baseline(const char *path, bench_result_t *results)
+{
+    char line[512];
+    size_t n = 0;
+
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        LOG(ERROR, "Failed to open baseline %s", path);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f) && (n < MAX_BENCHES))
+    {
+        char *name = strstr(line, "\"name\": \"");
+        char *ns = strstr(line, "\"ns_per_sample\": ");
+        if (name && ns &&
+            (sscanf(name, "\"name\": \"%31[^\"]\"", results[n].name) == 1) &&
+            (sscanf(ns, "\"ns_per_sample\": %lf", &results[n].ns_per_sample) == 1))
+        {
+            n++;
+        }
+    }
+    fclose(f);
+
+    return n;
+}
+
+// Prints the change of every benchmark, false when one got slower than the threshold
+static bool compare(const bench_result_t *results, size_t n, const bench_result_t *base, size_t base_n)
+{
+    bool ok = true;
+
+    fprintf(stderr, "%16s %14s %14s %10s\n", "benchmark", "baseline ns", "ns/sample", "change");
+    for (size_t i = 0; i < n; i++)
+    {
+        for (size_t j = 0; j < base_n; j++)
+        {
+            if (strcmp(results[i].name, base[j].name) != 0)
+            {
+                continue;
+            }
+            double change = 100.0 * (results[i].ns_per_sample - base[j].ns_per_sample) / base[j].ns_per_sample;
+            bool slower = change > threshold;
+            fprintf(stderr, "%16s %14.4f %14.4f %+9.1f%%%s\n", results[i].name, base[j].ns_per_sample,
+                    results[i].ns_per_sample, change, slower ? " REGRESSION" : "");
+            ok = ok && !slower;
+        }
+    }
+
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    bench_result_t results[MAX_BENCHES];
+    bench_result_t base[MAX_BENCHES];
+    size_t n = 0;
+    bool ok = true;
+
+    logging_init();
+
+    if (!parse_args(argc, argv))
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < NUM_BENCHES; i++)
+    {
+        if (filter && !strstr(benches[i].name, filter))
+        {
+            continue;
+        }
+        run_bench(&benches[i], &results[n]);
+        fprintf(stderr, "%16s %10.3f ns/sample %10.3f Msamples/s", results[n].name,
+                results[n].ns_per_sample, results[n].msamples_per_s);
+        if (has_cycles())
+        {
+            fprintf(stderr, " %10.2f cycles/sample", results[n].cycles_per_sample);
+        }
+        fprintf(stderr, " (per %s)\n", benches[i].per);
+        n++;
+    }
+
+    FILE *out = stdout;
+    if (output_file)
+    {
+        out = fopen(output_file, "w");
+        if (!out)
+        {
+            LOG(ERROR, "Failed to write %s", output_file);
+            exit(EXIT_FAILURE);
+        }
+    }
+    write_json(out, results, n);
+    if (output_file)
+    {
+        fclose(out);
+    }
+
+    if (baseline_file)
+    {
+        size_t base_n = read_baseline(baseline_file, base);
+        ok = (base_n > 0) && compare(results, n, base, base_n);
+    }
+
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,547 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <time.h>
+
+#include <complex.h>
+#include <math.h>
+
+#include <libdill.h>
+#include <liquid/liquid.h>
+
+#include "logging.h"
+#include "link.h"
+
+#include "flex_encoder.h"
+#include "flex_decoder.h"
+
+#define AUDIO_RATE (48000UL)
+#define BLOCK_SIZE (2000UL)
+// room for the samples the clock offset adds to a block
+#define CHANNEL_MARGIN (16UL)
+#define DEFAULT_FRAMES (100UL)
+#define DEFAULT_PAYLOAD (100UL)
+#define DEFAULT_GAIN (0.5f)
+#define DEFAULT_SNRS "0,3,6,9,12,15,20,30"
+#define MAX_SNRS (32)
+// frames after the last counted one, the decoder has seen all of the
+// counted ones once it got through the first of them
+#define PAD_FRAMES (2UL)
+#define SEQ_SIZE (4UL)
+// a small room at 48 kHz, delays in samples
+#define MULTIPATH_LEN (301)
+
+typedef struct
+{
+    size_t frames;
+    size_t ok;
+    double elapsed_s;
+    double tx_ns;
+    double rx_ns;
+} loop_result_t;
+
+// State shared by the blocks of one run, the handlers wrap the ones of the
+// encoder and the decoder to count samples and measure their CPU time
+typedef struct
+{
+    flex_encoder_t *enc;
+    flex_decoder_t *dec;
+    size_t frames;
+    size_t enc_frames;
+    size_t enc_samples;
+    size_t dec_samples;
+    // decoder input that covers all counted frames, 0 until known
+    size_t target;
+    bool finished;
+    int done_ch;
+    uint64_t tx_ns;
+    uint64_t rx_ns;
+
+    firfilt_rrrf multipath;
+    firhilbf fh_down;
+    firhilbf fh_up;
+    nco_crcf nco;
+    resamp_rrrf clock;
+    float *tmp;
+    complex float *tmp_c;
+    float noise_std;
+    // the decoder takes complex pairs, an odd sample out of the clock
+    // resampler waits for the next block
+    float carry;
+    bool has_carry;
+} loop_t;
+
+static size_t frames = DEFAULT_FRAMES;
+static size_t payload_len = DEFAULT_PAYLOAD;
+static const char *snr_list = DEFAULT_SNRS;
+static float gain = DEFAULT_GAIN;
+static float clock_ppm = 0.0f;
+static float offset_hz = 0.0f;
+static bool multipath = false;
+static float signal_power;
+
+static const char help_msg[] =
+    "flex_bench, flexframe loopback from flex_encoder to flex_decoder through a simulated\n"
+    "acoustic channel, prints frames/s, throughput, CPU time per frame and frame error rate\n\n"
+    "Use:\tflex_bench [-n <frames>] [-l <bytes>] [-s <dB,dB,...>] [-g <gain>] [-c <ppm>] [-f <Hz>] [-m]\n"
+    "\t-n frames sent for every SNR\n"
+    "\t-l payload size\n"
+    "\t-s SNRs to run, in the whole audio band (default " DEFAULT_SNRS ")\n"
+    "\t-g gain of the channel\n"
+    "\t-c clock offset of the receiver\n"
+    "\t-f carrier offset\n"
+    "\t-m add the echoes of a small room\n";
+
+static bool parse_args(int argc, char *argv[])
+{
+    int opt;
+    bool ret = true;
+
+    while (ret && (opt = getopt(argc, argv, "n:l:s:g:c:f:mh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            frames = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'l':
+            payload_len = strtoul(optarg, NULL, 10);
+            break;
+
+        case 's':
+            snr_list = optarg;
+            break;
+
+        case 'g':
+            gain = strtof(optarg, NULL);
+            break;
+
+        case 'c':
+            clock_ppm = strtof(optarg, NULL);
+            break;
+
+        case 'f':
+            offset_hz = strtof(optarg, NULL);
+            break;
+
+        case 'm':
+            multipath = true;
+            break;
+
+        case 'h':
+            fprintf(stderr, help_msg);
+            ret = false;
+            break;
+
+        default:
+            fprintf(stderr, "\n");
+            fprintf(stderr, help_msg);
+            ret = false;
+            break;
+        }
+    }
+
+    return ret;
+}
+
+static uint64_t cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+// Sequence number followed by bytes derived from it
+static void make_payload(uint8_t *p, uint32_t seq)
+{
+    memcpy(p, &seq, SEQ_SIZE);
+    for (size_t i = SEQ_SIZE; i < payload_len; i++)
+    {
+        p[i] = ((seq * 31) + (i * 7)) & 0xff;
+    }
+}
+
+// Sequence number of a payload that came through intact, -1 otherwise
+static int64_t check_payload(const uint8_t *p, size_t len)
+{
+    uint32_t seq;
+    uint8_t expected[FLEX_DECODER_MAX_PAYLOAD];
+
+    if (len != payload_len)
+    {
+        return -1;
+    }
+    memcpy(&seq, p, SEQ_SIZE);
+    make_payload(expected, seq);
+
+    return (memcmp(p, expected, len) == 0) ? seq : -1;
+}
+
+// Echoes at 1.5, 3.75 and 6.25 ms
+static void room_response(float *h, size_t len)
+{
+    memset(h, 0, len * sizeof(float));
+    h[0] = 1.0f;
+    h[72] = 0.3f;
+    h[180] = -0.15f;
+    h[300] = 0.07f;
+}
+
+static bool encoder_handler(void *ctx, void *in_buf, const link_msg_t *in_msg,
+                            void *out_buf, link_msg_t *out_msg)
+{
+    loop_t *loop = (loop_t *)ctx;
+
+    uint64_t start = cpu_ns();
+    bool finished = flex_encoder_handler(loop->enc, in_buf, in_msg, out_buf, out_msg);
+    loop->tx_ns += cpu_ns() - start;
+
+    loop->enc_samples += out_msg->len;
+    if (finished && (++loop->enc_frames == (loop->frames + 1)))
+    {
+        // the clock offset stretches the stream on the way
+        loop->target = loop->enc_samples * (1.0 + (clock_ppm * 1e-6));
+    }
+
+    return finished;
+}
+
+// Speaker to microphone: echoes, frequency shift, gain, the clock of the
+// receiver and its noise
+static bool channel_handler(void *ctx, void *in_buf, const link_msg_t *in_msg,
+                            void *out_buf, link_msg_t *out_msg)
+{
+    loop_t *loop = (loop_t *)ctx;
+    float *tmp = loop->tmp;
+    size_t n = in_msg->len;
+    unsigned int ny = n;
+
+    if (loop->multipath)
+    {
+        firfilt_rrrf_execute_block(loop->multipath, (float *)in_buf, n, tmp);
+    }
+    else
+    {
+        memcpy(tmp, in_buf, n * sizeof(float));
+    }
+
+    if (loop->nco)
+    {
+        // shifted as an analytic signal at half the rate
+        firhilbf_decim_execute_block(loop->fh_down, tmp, n / 2, loop->tmp_c);
+        nco_crcf_mix_block_up(loop->nco, loop->tmp_c, loop->tmp_c, n / 2);
+        firhilbf_interp_execute_block(loop->fh_up, loop->tmp_c, n / 2, tmp);
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        tmp[i] *= gain;
+    }
+
+    float *out = (float *)out_buf;
+    size_t k = loop->has_carry ? 1 : 0;
+    if (loop->clock)
+    {
+        resamp_rrrf_execute_block(loop->clock, tmp, n, &out[k], &ny);
+    }
+    else
+    {
+        memcpy(&out[k], tmp, n * sizeof(float));
+    }
+
+    for (size_t i = k; i < (k + ny); i++)
+    {
+        out[i] += loop->noise_std * randnf();
+    }
+    if (loop->has_carry)
+    {
+        out[0] = loop->carry;
+    }
+
+    size_t len = k + ny;
+    loop->has_carry = (len & 1);
+    if (loop->has_carry)
+    {
+        loop->carry = out[--len];
+    }
+    out_msg->len = len;
+
+    return true;
+}
+
+static bool decoder_handler(void *ctx, void *in_buf, const link_msg_t *in_msg,
+                            void *out_buf, link_msg_t *out_msg)
+{
+    loop_t *loop = (loop_t *)ctx;
+
+    uint64_t start = cpu_ns();
+    bool finished = flex_decoder_handler(loop->dec, in_buf, in_msg, out_buf, out_msg);
+    loop->rx_ns += cpu_ns() - start;
+
+    loop->dec_samples += in_msg->len;
+    if (!loop->finished && loop->target && (loop->dec_samples >= loop->target))
+    {
+        loop->finished = true;
+        int ret = chsend(loop->done_ch, NULL, 0, -1);
+        log_assert(ret == 0);
+    }
+
+    return finished;
+}
+
+static coroutine void source(link_t *out, size_t n)
+{
+    link_msg_t msg = {
+        .len = payload_len,
+        .id = 0};
+    uint8_t p[FLEX_DECODER_MAX_PAYLOAD];
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (link_wait_send(out, payload_len, -1) != 0)
+        {
+            return;
+        }
+        make_payload(p, i);
+        size_t m = ring_insert(out->out_buf, p, payload_len);
+        log_assert(m == payload_len);
+        if (link_send(out, &msg) != 0)
+        {
+            return;
+        }
+    }
+}
+
+// Counts every counted frame that came through intact once
+static coroutine void sink(link_t *in, uint8_t *seen, size_t *ok)
+{
+    link_msg_t msg;
+    uint8_t p[FLEX_DECODER_MAX_PAYLOAD];
+
+    while (link_recv(in, &msg, -1) == 0)
+    {
+        log_assert(msg.len <= sizeof(p));
+        link_consume(in, p, msg.len);
+        int64_t seq = check_payload(p, msg.len);
+        if ((seq >= 0) && ((size_t)seq < frames) && !seen[seq])
+        {
+            seen[seq] = 1;
+            (*ok)++;
+        }
+    }
+}
+
+// Mean power of the encoder output over one frame
+static float measure_signal_power(void)
+{
+    uint8_t p[FLEX_DECODER_MAX_PAYLOAD];
+    float *out = (float *)malloc(BLOCK_SIZE * sizeof(float));
+    log_assert(out);
+    flex_encoder_t *enc = flex_encoder_create_stage(BLOCK_SIZE);
+    log_assert(enc);
+    link_msg_t in_msg = {.len = payload_len};
+    double power = 0.0;
+    size_t n = 0;
+    bool finished = false;
+
+    make_payload(p, 0);
+    while (!finished)
+    {
+        link_msg_t out_msg = {0};
+        finished = flex_encoder_handler(enc, p, &in_msg, out, &out_msg);
+        for (size_t i = 0; i < out_msg.len; i++)
+        {
+            power += out[i] * out[i];
+        }
+        n += out_msg.len;
+    }
+
+    flex_encoder_destroy(&enc);
+    free(out);
+
+    return power / n;
+}
+
+static void run(float snr_db, loop_result_t *res)
+{
+    int ret;
+    int done[2];
+    int h[5];
+    float h_room[MULTIPATH_LEN];
+    size_t ok = 0;
+    loop_t loop = {0};
+
+    uint8_t *seen = (uint8_t *)calloc(frames, 1);
+    log_assert(seen);
+
+    ret = chmake(done);
+    log_assert(ret == 0);
+    loop.done_ch = done[0];
+    loop.frames = frames;
+
+    // noise in the whole band relative to the signal at the microphone
+    double received = signal_power * gain * gain;
+    if (multipath)
+    {
+        room_response(h_room, MULTIPATH_LEN);
+        double energy = 0.0;
+        for (size_t i = 0; i < MULTIPATH_LEN; i++)
+        {
+            energy += h_room[i] * h_room[i];
+        }
+        received *= energy;
+        loop.multipath = firfilt_rrrf_create(h_room, MULTIPATH_LEN);
+        log_assert(loop.multipath);
+    }
+    loop.noise_std = sqrtf(received / powf(10.0f, snr_db / 10.0f));
+    if (offset_hz != 0.0f)
+    {
+        loop.fh_down = firhilbf_create(5, 60.0f);
+        log_assert(loop.fh_down);
+        loop.fh_up = firhilbf_create(5, 60.0f);
+        log_assert(loop.fh_up);
+        loop.nco = nco_crcf_create(LIQUID_VCO);
+        log_assert(loop.nco);
+        nco_crcf_set_frequency(loop.nco, 2 * M_PI * offset_hz / (AUDIO_RATE / 2));
+    }
+    if (clock_ppm != 0.0f)
+    {
+        loop.clock = resamp_rrrf_create(1.0f + (clock_ppm * 1e-6f), 7, 0.45f, 60.0f, 64);
+        log_assert(loop.clock);
+    }
+    loop.tmp = (float *)malloc(BLOCK_SIZE * sizeof(float));
+    log_assert(loop.tmp);
+    loop.tmp_c = (complex float *)malloc((BLOCK_SIZE / 2) * sizeof(complex float));
+    log_assert(loop.tmp_c);
+
+    link_t *src = link_connect("source", NULL, 0, 0, sizeof(uint8_t),
+                               FLEX_DECODER_MAX_PAYLOAD, sizeof(uint8_t));
+    log_assert(src);
+
+    loop.enc = flex_encoder_create_stage(BLOCK_SIZE);
+    log_assert(loop.enc);
+    link_t *enc_out = link_connect("flex_encoder", src, 2, src->out_bs, sizeof(uint8_t),
+                                   BLOCK_SIZE, sizeof(float));
+    log_assert(enc_out);
+    enc_out->async = true;
+
+    link_t *chan_out = link_connect("channel", enc_out, 2, BLOCK_SIZE, sizeof(float),
+                                    BLOCK_SIZE + CHANNEL_MARGIN, sizeof(float));
+    log_assert(chan_out);
+
+    loop.dec = flex_decoder_create_stage(chan_out->out_bs);
+    log_assert(loop.dec);
+    link_t *dec_out = link_connect("flex_decoder", chan_out, 4, chan_out->out_bs, sizeof(float),
+                                   FLEX_DECODER_MAX_PAYLOAD, sizeof(uint8_t));
+    log_assert(dec_out);
+
+    link_t *snk = link_connect("sink", dec_out, 4, FLEX_DECODER_MAX_PAYLOAD, sizeof(uint8_t),
+                               FLEX_DECODER_MAX_PAYLOAD, sizeof(uint8_t));
+    log_assert(snk);
+
+    uint64_t start = latency_now_ns();
+    h[0] = go(sink(snk, seen, &ok));
+    log_assert(h[0] >= 0);
+    h[1] = go(link_run(dec_out, &loop, decoder_handler));
+    log_assert(h[1] >= 0);
+    h[2] = go(link_run(chan_out, &loop, channel_handler));
+    log_assert(h[2] >= 0);
+    h[3] = go(link_run(enc_out, &loop, encoder_handler));
+    log_assert(h[3] >= 0);
+    h[4] = go(source(src, frames + PAD_FRAMES));
+    log_assert(h[4] >= 0);
+
+    ret = chrecv(done[1], NULL, 0, -1);
+    log_assert(ret == 0);
+    // the sink takes what the decoder still has queued
+    ret = yield();
+    log_assert(ret == 0);
+
+    res->elapsed_s = (latency_now_ns() - start) / 1e9;
+    res->frames = loop.enc_frames;
+    res->ok = ok;
+    res->tx_ns = (double)loop.tx_ns / loop.enc_frames;
+    res->rx_ns = (double)loop.rx_ns / loop.enc_frames;
+
+    for (int i = 4; i >= 0; i--)
+    {
+        ret = hclose(h[i]);
+        log_assert(ret == 0);
+    }
+    link_close(snk);
+    link_close(src);
+    flex_decoder_destroy(&loop.dec);
+    flex_encoder_destroy(&loop.enc);
+    if (loop.clock)
+    {
+        resamp_rrrf_destroy(loop.clock);
+    }
+    if (loop.nco)
+    {
+        nco_crcf_destroy(loop.nco);
+        firhilbf_destroy(loop.fh_up);
+        firhilbf_destroy(loop.fh_down);
+    }
+    if (loop.multipath)
+    {
+        firfilt_rrrf_destroy(loop.multipath);
+    }
+    free(loop.tmp_c);
+    free(loop.tmp);
+    free(seen);
+    ret = hclose(done[0]);
+    log_assert(ret == 0);
+    ret = hclose(done[1]);
+    log_assert(ret == 0);
+}
+
+int main(int argc, char *argv[])
+{
+    float snrs[MAX_SNRS];
+    size_t num_snrs = 0;
+
+    logging_init();
+
+    if (!parse_args(argc, argv))
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    if ((payload_len < SEQ_SIZE) || (payload_len > FLEX_DECODER_MAX_PAYLOAD) || (frames == 0))
+    {
+        fprintf(stderr, "Payload of %lu to %d bytes and at least one frame\n", SEQ_SIZE, FLEX_DECODER_MAX_PAYLOAD);
+        exit(EXIT_FAILURE);
+    }
+
+    const char *p = snr_list;
+    while (*p && (num_snrs < MAX_SNRS))
+    {
+        char *end;
+        float snr = strtof(p, &end);
+        if (end == p)
+        {
+            break;
+        }
+        snrs[num_snrs++] = snr;
+        p = (*end == ',') ? end + 1 : end;
+    }
+
+    signal_power = measure_signal_power();
+
+    printf("%8s %10s %12s %14s %14s %8s\n", "SNR dB", "frames/s", "kbit/s", "tx us/frame", "rx us/frame", "FER");
+    for (size_t i = 0; i < num_snrs; i++)
+    {
+        loop_result_t res;
+        run(snrs[i], &res);
+        printf("%8.1f %10.1f %12.2f %14.1f %14.1f %8.4f\n", snrs[i],
+               res.frames / res.elapsed_s,
+               (res.ok * payload_len * 8) / (res.elapsed_s * 1e3),
+               res.tx_ns / 1e3, res.rx_ns / 1e3,
+               1.0 - ((double)res.ok / frames));
+    }
+
+    exit(EXIT_SUCCESS);
+}
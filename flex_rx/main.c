@@ -3,33 +3,97 @@
 #include <string.h>
 
 #include <signal.h>
+#include <getopt.h>
 #include <complex.h>
 
 #include "logging.h"
+#include "profile.h"
+#include "realtime.h"
 #include "util.h"
+#include "link.h"
+#include "stack_pool.h"
+#include "metrics.h"
+#include "trace.h"
 
 #include "audio_source.h"
 #include "flex_decoder.h"
 
 #define AUDIO_SAMPLERATE (48000UL)
 
+static bool realtime = false;
+static const char *realtime_cpus = NULL;
+static int metrics_port = -1;
+static const char *trace_file = NULL;
+
+static const char help_msg[] =
+    "flex_rx, receives flexframes via the microphone\n\n"
+    "Use:\tflex_rx [--realtime[=<dsp>,<audio>]] [--metrics[=<port>]]\n"
+    "\t[--trace <file>]\n"
+    "\t--realtime lock memory, real time scheduling, DSP and audio threads on\n"
+    "\t  the given cores (the last two by default)\n"
+    "\t--metrics serve Prometheus metrics on 127.0.0.1 (port 9101 by default)\n"
+    "\t--trace record the handlers and link events, written to <file> on exit\n";
+
+static bool parse_args(int argc, char *argv[])
+{
+    int opt;
+    bool ret = true;
+    static const struct option long_opts[] = {
+        {"realtime", optional_argument, NULL, 'R'},
+        {"metrics", optional_argument, NULL, 'M'},
+        {"trace", required_argument, NULL, 'T'},
+        {NULL, 0, NULL, 0}};
+
+    while (ret && (opt = getopt_long(argc, argv, "h", long_opts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'R':
+            realtime = true;
+            realtime_cpus = optarg;
+            break;
+
+        case 'M':
+            metrics_port = optarg ? atoi(optarg) : METRICS_DEFAULT_PORT;
+            break;
+
+        case 'T':
+            trace_file = optarg;
+            break;
+
+        case 'h':
+            fprintf(stderr, help_msg);
+            ret = false;
+            break;
+
+        default:
+            fprintf(stderr, "\n");
+            fprintf(stderr, help_msg);
+            ret = false;
+            break;
+        }
+    }
+
+    return ret;
+}
+
 static void coroutine out_read(link_t *output, size_t s)
 {
     int ret;
     link_msg_t msg;
 
-    uint8_t payload[s];
+    uint8_t *payload = (uint8_t *)link_alloc(s);
 
     while (true)
     {
-        ret = chrecv(output->in_ch_r, &msg, sizeof(msg), -1);
+        ret = link_recv(output, &msg, -1);
         if ((ret != 0) || (msg.id == -1))
         {
             break;
         }
 
-        log_assert(msg.len <= sizeof(payload));
-        lws_ring_consume(output->in_buf, NULL, payload, msg.len);
+        log_assert(msg.len <= s);
+        link_consume(output, payload, msg.len);
 
         fprintf(stderr, "Received flex frame:\n\t");
         for (size_t i = 0; i < msg.len; i++)
@@ -43,6 +107,7 @@ static void coroutine out_read(link_t *output, size_t s)
         fprintf(stderr, "\n");
     }
 
+    link_free(payload);
     LOG(INFO, "Exiting");
 }
 
@@ -52,10 +117,25 @@ int main(int argc, char *argv[])
 
     logging_init();
 
+    if (!parse_args(argc, argv))
+    {
+        exit(EXIT_FAILURE);
+    }
+    // before anything is mapped, so all of it gets locked
+    if (realtime)
+    {
+        realtime_init(realtime_cpus);
+    }
+    profile_load(PROFILE_FILE_NAME);
+    if (trace_file)
+    {
+        trace_start(trace_file);
+    }
+
     audio_source_t *source = audio_source_create(AUDIO_SAMPLERATE);
     flex_decoder_t *flex = flex_decoder_create(audio_source_get_output(source));
     link_t *input = flex_decoder_get_output(flex);
-    link_t *output = link_connect("print", input, 30,
+    link_t *output = link_connect("print", input, profile_get("flex_rx.in_nb", 30),
                           input->out_bs, sizeof(char),
                           input->out_bs, sizeof(char));
 
@@ -63,18 +143,27 @@ int main(int argc, char *argv[])
 
     audio_source_start(source);
 
-    int hc = go(out_read(output, input->out_bs));
+    void *stack = stack_pool_get("out_read", STACK_SIZE_RUNNER);
+    int hc = go_mem(out_read(output, input->out_bs), stack, STACK_SIZE_RUNNER);
     log_assert(hc >= 0);
+    if (metrics_port >= 0)
+    {
+        metrics_start(metrics_port);
+    }
 
     int ret = chrecv(cc, &msg, sizeof(link_msg_t), -1);
     log_assert(ret == 0);
+    metrics_stop();
 
     ret = hclose(hc);
     log_assert(ret == 0);
+    stack_pool_put(&stack);
     
     clean_sigint_handler();
     audio_source_destroy(&source);
     flex_decoder_destroy(&flex);
+    trace_stop();
+    realtime_report();
 
     LOG(INFO, "Exiting");
     exit(EXIT_SUCCESS);
@@ -6,6 +6,7 @@
 #include <complex.h>
 
 #include "logging.h"
+#include "profile.h"
 #include "util.h"
 
 #include "flex_encoder.h"
@@ -25,6 +26,7 @@ int main(int argc, char *argv[])
         .id = 0};
 
     logging_init();
+    profile_load(PROFILE_FILE_NAME);
 
     link_t *src_link = link_connect("keyboard_source", NULL, 0, 0, sizeof(char),
                                     1024, sizeof(char));
@@ -37,12 +39,17 @@ int main(int argc, char *argv[])
 
     while (true)
     {
-        n = lws_ring_insert(src_link->out_buf, TEST_MESSAGE, TEST_MESSAGE_SIZE);
+        ret = link_wait_send(src_link, TEST_MESSAGE_SIZE, -1);
+        if (ret != 0)
+        {
+            break;
+        }
+        n = ring_insert(src_link->out_buf, TEST_MESSAGE, TEST_MESSAGE_SIZE);
         log_assert(n == TEST_MESSAGE_SIZE);
         msg.len = TEST_MESSAGE_SIZE;
 
 
-        ret = chsend(src_link->out_ch_s, &msg, sizeof(link_msg_t), -1);
+        ret = link_send(src_link, &msg);
         if (ret != 0)
         {
             break;
@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <complex.h>
+#include <math.h>
+
+#include <libdill.h>
+
+#include "logging.h"
+#include "link.h"
+#include "runtime.h"
+#include "fuse.h"
+#include "fm_source.h"
+
+#include "resampler.h"
+#include "wbfm_demod.h"
+
+// same rates and block size as wbfm_demod
+#define RATE (1000000UL)
+#define RRATE (192000UL)
+#define DECIM (4UL)
+#define BLOCK_SIZE (10 * 1000UL)
+#define INPUT_BLOCKS (16UL)
+#define DEFAULT_TOTAL (1UL << 23)
+
+static size_t num_workers = 0;
+static size_t total = DEFAULT_TOTAL;
+static complex float *input;
+
+static const char help_msg[] =
+    "fuse_bench, resampler and wbfm_demod as two blocks and as one fused block\n\n"
+    "Use:\tfuse_bench [-n <samples>] [-j <threads>]\n"
+    "\t-n number of input samples pushed through each run\n"
+    "\t-j run the blocks on a pool of worker threads\n";
+
+static bool parse_args(int argc, char *argv[])
+{
+    int opt;
+    bool ret = true;
+
+    while (ret && (opt = getopt(argc, argv, "n:j:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            total = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'j':
+            num_workers = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'h':
+            fprintf(stderr, help_msg);
+            ret = false;
+            break;
+
+        default:
+            fprintf(stderr, "\n");
+            fprintf(stderr, help_msg);
+            ret = false;
+            break;
+        }
+    }
+
+    return ret;
+}
+
+// Time stamp counter where there is one, nanoseconds otherwise
+static uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return latency_now_ns();
+#endif
+}
+
+LINK_FUSE(resampler_wbfm_handler, resampler_handler, wbfm_demod_handler)
+
+static void generate_input(void)
+{
+    size_t n = INPUT_BLOCKS * BLOCK_SIZE;
+
+    input = (complex float *)malloc(n * sizeof(complex float));
+    log_assert(input);
+    fm_source_fill(input, n, RATE);
+}
+
+// Loops over the input until the sink has enough
+static coroutine void source(link_t *out)
+{
+    link_msg_t msg = {
+        .len = out->out_bs,
+        .id = 0};
+
+    for (size_t i = 0; true; i = (i + 1) % INPUT_BLOCKS)
+    {
+        if (link_wait_send(out, out->out_bs, -1) != 0)
+        {
+            break;
+        }
+        memcpy(ring_get_write_ptr(out->out_buf), &input[i * BLOCK_SIZE], BLOCK_SIZE * sizeof(complex float));
+        ring_bump_head(out->out_buf, out->out_bs);
+        if (link_send(out, &msg) != 0)
+        {
+            break;
+        }
+    }
+}
+
+// Hashes the first 'samples' output samples (FNV-1a)
+static coroutine void sink(link_t *in, size_t samples, int done_ch, uint64_t *hash)
+{
+    link_msg_t msg;
+    float v[256];
+
+    *hash = 14695981039346656037ULL;
+    while (samples > 0)
+    {
+        if (link_recv(in, &msg, -1) != 0)
+        {
+            return;
+        }
+
+        size_t n;
+        while ((samples > 0) &&
+               ((n = link_consume(in, v, (samples < 256) ? samples : 256)) > 0))
+        {
+            const uint8_t *p = (const uint8_t *)v;
+            for (size_t i = 0; i < n * sizeof(float); i++)
+            {
+                *hash = (*hash ^ p[i]) * 1099511628211ULL;
+            }
+            samples -= n;
+        }
+    }
+
+    link_close(in);
+    int ret = chsend(done_ch, NULL, 0, -1);
+    log_assert(ret == 0);
+}
+
+// Returns cycles per input sample
+static double run(bool fused, size_t out_samples, uint64_t *hash)
+{
+    int ret;
+    int done[2];
+    int h[3];
+    resampler_t *rsmp_stage = NULL;
+    wbfm_demod_t *wbfm_stage = NULL;
+    link_fused_t *fusion = NULL;
+    resampler_t *resamp = NULL;
+    wbfm_demod_t *demod = NULL;
+    link_t *out;
+    size_t mid_bs = (BLOCK_SIZE * RRATE) / RATE;
+
+    ret = chmake(done);
+    log_assert(ret == 0);
+
+    link_t *src = link_connect("source", NULL, 0, BLOCK_SIZE, sizeof(complex float),
+                               BLOCK_SIZE, sizeof(complex float));
+    log_assert(src);
+    link_set_format(src, LINK_FMT_CF32);
+
+    if (fused)
+    {
+        rsmp_stage = resampler_create_stage(RATE, RRATE, 0, LINK_FMT_CF32, BLOCK_SIZE);
+        log_assert(rsmp_stage);
+        wbfm_stage = wbfm_demod_create_stage(RRATE, DECIM, mid_bs);
+        log_assert(wbfm_stage);
+        fusion = link_fused_create(rsmp_stage, wbfm_stage, mid_bs, sizeof(complex float));
+        log_assert(fusion);
+        out = link_connect("resampler+wbfm_demod", src, 2, BLOCK_SIZE, sizeof(complex float),
+                           mid_bs / DECIM, sizeof(float));
+        log_assert(out);
+        h[0] = go(link_run(out, fusion, resampler_wbfm_handler));
+        log_assert(h[0] >= 0);
+    }
+    else
+    {
+        resamp = resampler_create(RATE, RRATE, 0, src);
+        log_assert(resamp);
+        demod = wbfm_demod_create(RRATE, DECIM, resampler_get_output(resamp));
+        log_assert(demod);
+        out = wbfm_demod_get_output(demod);
+        h[0] = -1;
+    }
+
+    link_t *snk = link_connect("sink", out, 2, out->out_bs, sizeof(float), out->out_bs, sizeof(float));
+    log_assert(snk);
+
+    uint64_t start = cycles();
+
+    h[1] = go(sink(snk, out_samples, done[0], hash));
+    log_assert(h[1] >= 0);
+    h[2] = go(source(src));
+    log_assert(h[2] >= 0);
+
+    ret = chrecv(done[1], NULL, 0, -1);
+    log_assert(ret == 0);
+
+    uint64_t elapsed = cycles() - start;
+
+    // the worker threads must be done with the blocks before they get destroyed
+    link_stop_tasks();
+    for (int i = 2; i >= 0; i--)
+    {
+        if (h[i] >= 0)
+        {
+            ret = hclose(h[i]);
+            log_assert(ret == 0);
+        }
+    }
+    if (fused)
+    {
+        link_fused_destroy(&fusion);
+        resampler_destroy(&rsmp_stage);
+        wbfm_demod_destroy(&wbfm_stage);
+    }
+    else
+    {
+        wbfm_demod_destroy(&demod);
+        resampler_destroy(&resamp);
+    }
+    link_close(src);
+    ret = hclose(done[0]);
+    log_assert(ret == 0);
+    ret = hclose(done[1]);
+    log_assert(ret == 0);
+
+    return (double)elapsed / total;
+}
+
+int main(int argc, char *argv[])
+{
+    int ret;
+    runtime_t *rt = NULL;
+    uint64_t hash_unfused, hash_fused;
+
+    logging_init();
+
+    ret = parse_args(argc, argv);
+    if (!ret)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    if (num_workers > 0)
+    {
+        rt = runtime_create(num_workers);
+        log_assert(rt);
+        link_set_runtime(rt);
+    }
+
+    if (total < (3 * BLOCK_SIZE))
+    {
+        fprintf(stderr, "At least %lu samples\n", 3 * BLOCK_SIZE);
+        exit(EXIT_FAILURE);
+    }
+
+    generate_input();
+
+    // output of 'total' input samples, leaving out what is still in the filters
+    size_t out_samples = ((total / BLOCK_SIZE) - 2) * ((BLOCK_SIZE * RRATE) / RATE / DECIM);
+
+    double unfused = run(false, out_samples, &hash_unfused);
+    double fused = run(true, out_samples, &hash_fused);
+
+#if defined(__x86_64__) || defined(__i386__)
+    const char *unit = "cycles/sample";
+#else
+    const char *unit = "ns/sample";
+#endif
+    printf("%10s %14s %18s\n", "chain", unit, "output hash");
+    printf("%10s %14.2f %18lx\n", "unfused", unfused, hash_unfused);
+    printf("%10s %14.2f %18lx\n", "fused", fused, hash_fused);
+    printf("saved %.2f %s (%.1f%%), output %s\n", unfused - fused, unit,
+           100.0 * (unfused - fused) / unfused,
+           (hash_unfused == hash_fused) ? "identical" : "DIFFERENT");
+
+    if (rt)
+    {
+        runtime_destroy(&rt);
+    }
+    free(input);
+
+    exit((hash_unfused == hash_fused) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,23 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define ARENA_ALIGN (64)
+
+// Memory for a whole pipeline, mapped and prefaulted once at startup and
+// released at once on destroy. Allocations are not thread safe, they are
+// meant to happen while the pipeline is being built.
+typedef struct _arena_t arena_t;
+
+arena_t *arena_create(size_t size, bool hugepages);
+void *arena_alloc(arena_t *self, size_t size);
+void *arena_alloc_pages(arena_t *self, size_t size, int *fd, off_t *offset);
+size_t arena_get_page_size(arena_t *self);
+size_t arena_get_used(arena_t *self);
+bool arena_contains(arena_t *self, const void *p);
+void arena_destroy(arena_t **self_p);
+
+#endif // __ARENA_H__
@@ -1,13 +1,16 @@
 #ifndef __AUDIO_SINK_H__
 #define __AUDIO_SINK_H__
 
-#include <libwebsockets.h>
 #include "link.h"
 
 typedef struct _audio_sink_t audio_sink_t;
 
 audio_sink_t *audio_sink_create(unsigned int samplerate, unsigned int num_channels,
                                 link_t *input);
+// The audio callback paces the pipeline: only a couple of blocks are queued
+// in front of it and the blocks upstream wait for it to make room
+audio_sink_t *audio_sink_create_pull(unsigned int samplerate, unsigned int num_channels,
+                                     link_t *input);
 void audio_sink_destroy(audio_sink_t **self_p);
 
 #endif // __AUDIO_SINK_H__
@@ -1,7 +1,6 @@
 #ifndef __AUDIO_SOURCE_H__
 #define __AUDIO_SOURCE_H__
 
-#include <libwebsockets.h>
 #include "link.h"
 
 typedef struct _audio_source_t audio_source_t;
@@ -8,7 +8,15 @@
 
 typedef struct _flex_decoder_t flex_decoder_t;
 
+// largest payload the decoder hands out, the size of its output blocks
+#define FLEX_DECODER_MAX_PAYLOAD (1024)
+
 flex_decoder_t *flex_decoder_create(link_t *input);
+// Block state without a link for input blocks of 'bs' samples, the output
+// buffer takes up to FLEX_DECODER_MAX_PAYLOAD bytes, for benchmarks
+flex_decoder_t *flex_decoder_create_stage(size_t bs);
+bool flex_decoder_handler(void *ctx, void *in_buf, const link_msg_t *in_msg,
+                          void *out_buf, link_msg_t *out_msg);
 link_t *flex_decoder_get_output(flex_decoder_t *self);
 void flex_decoder_destroy(flex_decoder_t **self_p);
 
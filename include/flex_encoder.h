@@ -1,12 +1,15 @@
 #ifndef __FLEX_ENCODER_H__
 #define __FLEX_ENCODER_H__
 
-#include <libwebsockets.h>
 #include "link.h"
 
 typedef struct _flex_encoder_t flex_encoder_t;
 
 flex_encoder_t *flex_encoder_create(link_t *input);
+// Block state without a link producing blocks of 'bs' samples, for benchmarks
+flex_encoder_t *flex_encoder_create_stage(size_t bs);
+bool flex_encoder_handler(void *ctx, void *in_buf, const link_msg_t *in_msg,
+                          void *out_buf, link_msg_t *out_msg);
 link_t *flex_encoder_get_output(flex_encoder_t *self);
 void flex_encoder_destroy(flex_encoder_t **self_p);
 
@@ -0,0 +1,33 @@
+#ifndef __FM_SOURCE_H__
+#define __FM_SOURCE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <complex.h>
+
+#include "link.h"
+
+typedef struct _fm_source_t fm_source_t;
+
+// Synthetic FM stereo station in complex baseband, stands in for the SDR:
+// a tone per channel, 19 kHz pilot, L-R on a 38 kHz DSB-SC subcarrier,
+// 75 kHz deviation, optional noise and carrier offset
+fm_source_t *fm_source_create(double samplerate, link_t *output);
+// A frequency of 0 leaves the channel silent
+void fm_source_set_program(fm_source_t *self, float left_hz, float right_hz, float amplitude);
+// Carrier to noise ratio over the whole sample rate, INFINITY for no noise
+void fm_source_set_noise(fm_source_t *self, float cnr_db);
+void fm_source_set_offset(fm_source_t *self, float offset_hz);
+// Holds every block back until it would have come out of an SDR,
+// otherwise blocks go out as fast as the consumers take them
+void fm_source_set_paced(fm_source_t *self, bool paced);
+// Closes the output after 'samples', 0 runs until destroyed
+void fm_source_set_length(fm_source_t *self, size_t samples);
+void fm_source_start(fm_source_t *self);
+void fm_source_destroy(fm_source_t **self_p);
+
+// Fixed test input of the benchmarks: a mono station with two tones,
+// 1 and 7 kHz, at 75 kHz deviation, no pilot and no noise
+void fm_source_fill(complex float *out, size_t n, double samplerate);
+
+#endif // __FM_SOURCE_H__
@@ -9,6 +9,10 @@
 typedef struct _fms_demod_t fms_demod_t;
 
 fms_demod_t *fms_demod_create(unsigned int rate, unsigned int decim, link_t *input);
+// Block state without a link, for benchmarks and fused chains
+fms_demod_t *fms_demod_create_stage(unsigned int rate, unsigned int decim, size_t bs);
+bool fms_demod_handle(void *ctx, void *in_buf, const link_msg_t *in_msg,
+                      void *out_buf, link_msg_t *out_msg);
 link_t *fms_demod_get_output(fms_demod_t *self);
 void fms_demod_destroy(fms_demod_t **self_p);
 
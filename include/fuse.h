@@ -0,0 +1,66 @@
+#ifndef __FUSE_H__
+#define __FUSE_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "link.h"
+#include "logging.h"
+
+// Two blocks fused into one link: the output of the first stage collects
+// in 'mid', a buffer small enough to stay in cache, and the second stage
+// gets it in blocks of 'mid_bs' elements exactly like it would from a
+// link, so fused and unfused chains compute the same output
+typedef struct
+{
+    void *first;
+    void *second;
+    uint8_t *mid;
+    size_t mid_bs;
+    size_t mid_sz;
+    size_t fill;
+    // the current input went through the first stage already
+    bool fed;
+    // flags for the next block of the second stage
+    int pending;
+} link_fused_t;
+
+link_fused_t *link_fused_create(void *first, void *second, size_t mid_bs, size_t mid_sz);
+void *link_fused_tail(link_fused_t *self);
+void link_fused_advance(link_fused_t *self, const link_msg_t *msg);
+void link_fused_shift(link_fused_t *self);
+void link_fused_destroy(link_fused_t **self_p);
+
+// Declares 'name', a link handler running the link handlers 'first' and
+// 'second' back to back on a link_fused_t context. The first stage must
+// not produce more than 'mid_bs' elements per call, the second one must
+// consume its whole input in one call
+#define LINK_FUSE(name, first_handler, second_handler)                                  \
+    static bool name(void *ctx, void *in_buf, const link_msg_t *in_msg,                \
+                     void *out_buf, link_msg_t *out_msg)                               \
+    {                                                                                  \
+        link_fused_t *fused = (link_fused_t *)ctx;                                     \
+        if (!fused->fed)                                                               \
+        {                                                                              \
+            link_msg_t mid_msg = {.len = 0, .id = 0};                                  \
+            bool done = first_handler(fused->first, in_buf, in_msg,                    \
+                                      link_fused_tail(fused), &mid_msg);               \
+            log_assert(done);                                                          \
+            mid_msg.flags = in_msg->flags;                                             \
+            link_fused_advance(fused, &mid_msg);                                       \
+        }                                                                              \
+        if (fused->fill >= fused->mid_bs)                                              \
+        {                                                                              \
+            link_msg_t mid_msg = {.len = fused->mid_bs, .id = 0, .flags = fused->pending}; \
+            fused->pending = 0;                                                        \
+            bool done = second_handler(fused->second, fused->mid, &mid_msg,            \
+                                       out_buf, out_msg);                              \
+            log_assert(done);                                                          \
+            link_fused_shift(fused);                                                   \
+        }                                                                              \
+        /* called again with the same input as long as blocks are left */             \
+        fused->fed = (fused->fill >= fused->mid_bs);                                   \
+        return !fused->fed;                                                            \
+    }
+
+#endif // __FUSE_H__
@@ -0,0 +1,36 @@
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 4 buckets per octave of microseconds, percentiles are within 25%
+#define LATENCY_BUCKETS (128)
+
+// Distribution of latencies, filled by one thread and read once it is done
+typedef struct
+{
+    size_t counts[LATENCY_BUCKETS];
+    size_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+} latency_hist_t;
+
+// Monotonic clock all the latencies and benchmarks are measured with
+uint64_t latency_now_ns(void);
+void latency_init(latency_hist_t *h);
+void latency_add(latency_hist_t *h, uint64_t ns);
+// Upper bound of the bucket holding the 'p' percentile
+uint64_t latency_percentile(const latency_hist_t *h, double p);
+// Logs p50, p90, p99, max and mean under 'what'
+void latency_log(const latency_hist_t *h, const char *what);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __LATENCY_H__
@@ -3,36 +3,203 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <libdill.h>
 
+#include "arena.h"
+#include "latency.h"
+#include "ring.h"
+#include "runtime.h"
+
+// 'index' is the position of the first element in the stream of the
+// link that sent it and jumps forward when the source lost samples,
+// GAP marks the first message after a discontinuity and HAS_TIME tells
+// that 'time_ns' holds the hardware timestamp of the source block,
+// RETUNE marks the first block from a new frequency, blocks reset their
+// filters on it. 'origin_ns' is the monotonic time (link_now_ns) the
+// source produced the newest input the block came out of, 0 if unknown
+#define LINK_MSG_GAP (1 << 0)
+#define LINK_MSG_HAS_TIME (1 << 1)
+#define LINK_MSG_RETUNE (1 << 2)
+
+typedef struct
+{
+    size_t len;
+    int id;
+    int flags;
+    uint64_t index;
+    int64_t time_ns;
+    uint64_t origin_ns;
+} link_msg_t;
+
+// A view points straight into ring memory: the input view holds the
+// received elements, the output view has room for 'out_bs' elements
+// and the handler sets 'msg.len' to the number of elements it produced
+// The input view is shared with the other consumers of a tee, handlers
+// working in place on it must not be connected to a tee'd source
 typedef struct
+{
+    void *buf;
+    link_msg_t msg;
+} link_view_t;
+
+// What happens to a consumer that cannot keep up with its source: blocking
+// consumers hold the source back, DROP_OLDEST ones lose their oldest input
+// blocks, DROP_NEWEST ones lose the blocks that find no room (the source
+// must not be tee'd), MAX_LATENCY ones drop the oldest blocks beyond a
+// bound on the queued input (link_set_max_latency)
+typedef enum
+{
+    LINK_POLICY_BLOCK = 0,
+    LINK_POLICY_DROP_OLDEST,
+    LINK_POLICY_DROP_NEWEST,
+    LINK_POLICY_MAX_LATENCY
+} link_policy_e;
+
+// Sample format of the elements a link produces, RAW leaves it to the
+// blocks to agree on what 'out_sz' bytes mean
+typedef enum
+{
+    LINK_FMT_RAW = 0,
+    LINK_FMT_F32,
+    LINK_FMT_CF32,
+    LINK_FMT_CS16,
+    LINK_FMT_CS8
+} link_format_e;
+
+typedef bool (*link_handler_t)(void *, void *, const link_msg_t *, void *, link_msg_t *);
+typedef bool (*link_view_handler_t)(void *, const link_view_t *, link_view_t *);
+
+typedef struct _link_t
 {
     const char *name;
     int in_ch_s;
     int in_ch_r;
-    struct lws_ring *in_buf;
+    ring_t *in_buf;
     size_t in_sz;
     size_t in_bs;
     size_t in_nb;
 
-    int out_ch_s;
-    struct lws_ring *out_buf;
+    // all consumers read the same 'out_buf', each one through its own
+    // cursor, connecting a source twice makes a tee
+    ring_t *out_buf;
     size_t out_sz;
     size_t out_bs;
+    link_format_e out_fmt;
+    struct _link_t *out_links[RING_MAX_READERS];
+    size_t out_n;
+    struct _link_t *in_link;
+
+    // credits: a producer that runs out of room sets 'stalled' and waits,
+    // consumers wake it up once they have released some of their input
+    _Atomic bool stalled;
+    int out_efd;
+    size_t stalls;
+    uint64_t stall_ns;
+    uint64_t stall_start;
+
+    link_policy_e policy;
+
+    // coalesced notifications: the producer only wakes the consumer when
+    // 'notified' is clear, the consumer takes everything up to the ring
+    // head in one go, 'seen' is the head position it got so far
+    bool coalesce;
+    _Atomic bool notified;
+    size_t seen;
+    // coalesced consumers get no message per block, a retune tag leaves
+    // the ring position where the new frequency starts instead
+    _Atomic bool retune;
+    size_t retune_pos;
+
+    // 'dropped' elements lost in 'drops' events, 'max_queued' is the
+    // bound of MAX_LATENCY, 'drop_buf' takes the output nobody has room for
+    size_t dropped;
+    size_t drops;
+    size_t max_queued;
+    void *drop_buf;
+    volatile bool closed;
+    // the consumer holds its input (link_acquire), the producer cannot
+    // drop it until link_release
+    bool held;
+
+    // sample accounting: 'out_index' gets stamped on the next message sent,
+    // 'in_next' is the index expected on the next message received, a jump
+    // or a GAP flag counts as a gap, 'pending' holds the flags for the
+    // next block sent
+    uint64_t out_index;
+    uint64_t in_next;
+    bool in_synced;
+    int pending;
+    size_t gaps;
 
     bool async;
-} link_t;
 
-typedef struct
-{
-    size_t len;
-    int id;
-} link_msg_t;
+    // only used when the link runs on a multi threaded runtime,
+    // messages go through 'in_msgs' and coroutines wait on 'in_efd'
+    runtime_t *rt;
+    runtime_task_t *task;
+    ring_t *in_msgs;
+    int in_efd;
 
-typedef bool (*link_handler_t)(void *, void *, const link_msg_t *, void *, link_msg_t *);
+    void *ctx;
+    link_view_handler_t handler;
+    link_msg_t in_msg;
+    size_t read;
+
+    // metrics: elements received and sent, the most input queued at once
+    // and the CPU time of the handler (only with link_set_metrics), read
+    // racily when scraped, 'rate_*' is what the last scrape saw
+    uint64_t received;
+    uint64_t sent;
+    size_t queued_max;
+    uint64_t handler_ns;
+    uint64_t rate_sent;
+    uint64_t rate_ns;
+    struct _link_t *next;
+
+    // latency probe: time from the source to the input of this link, a
+    // coalesced link only keeps the origin of the last message
+    latency_hist_t latency;
+    _Atomic uint64_t origin_ns;
+} link_t;
 
+void link_set_runtime(runtime_t *rt);
+void link_set_arena(arena_t *arena);
+void link_set_metrics(bool enabled);
+// Has the links measure the latency from the source, logged when they close
+void link_set_probe(bool enabled);
+bool link_probe_enabled(void);
+uint64_t link_now_ns(void);
+// Calls 'fn' for every link that is not closed yet, in the order they were connected
+void link_foreach(void (*fn)(link_t *, void *), void *arg);
+// Stops the runtime tasks of all the links, to be called before the
+// first one gets closed or destroyed
+void link_stop_tasks(void);
+void *link_alloc(size_t size);
+void link_free(void *p);
 link_t *link_connect(const char *name, link_t *src, size_t in_nb, size_t in_bs, size_t in_sz,
                      size_t out_bs, size_t out_sz);
+// First consumer of 'src' reading blocks of 'bs' from a ring made elsewhere
+// (e.g. shared with other processes), later consumers tee off that ring
+link_t *link_connect_ring(const char *name, link_t *src, ring_t *ring, size_t bs);
+void link_set_policy(link_t *self, link_policy_e policy);
+void link_set_max_latency(link_t *self, size_t rate, unsigned int ms);
+size_t link_trim(link_t *self);
+void link_set_coalesce(link_t *self, bool coalesce);
+void link_set_format(link_t *self, link_format_e fmt);
+size_t link_format_size(link_format_e fmt);
+const char *link_format_name(link_format_e fmt);
+int link_send(link_t *self, const link_msg_t *msg);
+int link_recv(link_t *self, link_msg_t *msg, int64_t deadline);
+int link_wait_send(link_t *self, size_t count, int64_t deadline);
+size_t link_acquire(link_t *self);
+void link_release(link_t *self, size_t count);
+void link_discard(link_t *self, size_t count);
+size_t link_consume(link_t *self, void *dest, size_t max_count);
+size_t link_flush(link_t *self);
+void link_close(link_t *self);
 coroutine void link_run(link_t *self, void *ctx, link_handler_t handler);
+coroutine void link_run_view(link_t *self, void *ctx, link_view_handler_t handler);
 
-#endif // __LINK_H__
\ No newline at end of file
+#endif // __LINK_H__
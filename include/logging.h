@@ -3,17 +3,66 @@
 
 #include <dlg/dlg.h>
 #include <assert.h>
+#include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// lines of a callsite printed per second, the others are counted and
+// reported once the second is over
+#define LOGGING_RATE (10)
+
+// Rate limiting state of a LOG callsite
+typedef struct _logging_site_t
+{
+    uint64_t window;
+    uint32_t count;
+    uint32_t suppressed;
+    int listed;
+    int level;
+    const char *file;
+    unsigned int line;
+    const char *func;
+    struct _logging_site_t *next;
+} logging_site_t;
+
+// Formats the message into a queue slot and returns, a background thread
+// prints it, never blocks nor allocates so it can be used from the audio
+// callbacks. Messages are lost when the queue is full, and counted.
+void logging_write(logging_site_t *site, int level, const char *file, unsigned int line, const char *func,
+                   const char *format, ...) __attribute__((format(printf, 6, 7)));
+// Prints what is queued, from any thread
+void logging_flush(void);
+
+#ifdef NDEBUG
 #define log_assert(x) assert(x)
+#else
+// what was logged before a failure is printed before aborting, x is
+// evaluated once like with assert
+#define log_assert(x) ((x) ? (void)0 : (logging_flush(), __assert_fail(#x, __FILE__, __LINE__, __func__)))
+#endif
 
-#define LOG_DEBUG dlg_debug
-#define LOG_INFO dlg_info
-#define LOG_WARN dlg_warn
-#define LOG_ERROR dlg_error
+#define LOG(_level, _format, _args...)                                       \
+    do                                                                       \
+    {                                                                        \
+        if (dlg_level_##_level >= DLG_LOG_LEVEL)                             \
+        {                                                                    \
+            static logging_site_t _site;                                     \
+            logging_write(&_site, dlg_level_##_level, __FILE__, __LINE__,    \
+                          __func__, _format, ##_args);                       \
+        }                                                                    \
+    } while (0)
 
-#define LOG(_level, _format, _args...) \
-    LOG_##_level(_format, ##_args)
+#define dlg_level_DEBUG dlg_level_debug
+#define dlg_level_INFO dlg_level_info
+#define dlg_level_WARN dlg_level_warn
+#define dlg_level_ERROR dlg_level_error
 
 void logging_init(void);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif // __LOGGING_H__
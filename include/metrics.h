@@ -0,0 +1,27 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define METRICS_DEFAULT_PORT (9101)
+
+typedef struct _metrics_histogram_t metrics_histogram_t;
+
+// Serves the metrics as Prometheus text on http://127.0.0.1:<port>/metrics
+// from a coroutine of the calling thread, and has the links measure the CPU
+// time of their handlers. Everything is read when scraped, the blocks only
+// bump their own counters.
+bool metrics_start(int port);
+void metrics_stop(void);
+
+// Counter owned by a block, 'name' and 'help' must outlive the entry
+void metrics_add_counter(const char *name, const char *help, const volatile size_t *value);
+// Histogram with the upper 'bounds' of its buckets, in ascending order
+metrics_histogram_t *metrics_add_histogram(const char *name, const char *help,
+                                           const double *bounds, size_t n);
+void metrics_observe(metrics_histogram_t *h, double value);
+// Takes a counter or a histogram off the list, histograms are freed
+void metrics_remove(const volatile void *entry);
+
+#endif // __METRICS_H__
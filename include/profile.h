@@ -0,0 +1,19 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// file written by 'autotune', read from the working directory
+#define PROFILE_FILE_NAME "profile.txt"
+
+// Tuned block sizes and ring depths, one 'key = value' per line. Blocks look
+// their settings up when they are created and keep their built-in defaults
+// for the keys the profile does not have.
+bool profile_load(const char *path);
+bool profile_save(const char *path);
+
+size_t profile_get(const char *key, size_t def);
+void profile_set(const char *key, size_t value);
+
+#endif // __PROFILE_H__
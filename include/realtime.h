@@ -0,0 +1,30 @@
+#ifndef __REALTIME_H__
+#define __REALTIME_H__
+
+#include <stdbool.h>
+
+typedef enum
+{
+    REALTIME_DSP = 0,
+    REALTIME_AUDIO,
+    REALTIME_WORKER
+} realtime_role_e;
+
+// priorities under SCHED_FIFO, the audio callback preempts the DSP blocks
+#define REALTIME_PRIO_DSP (80)
+#define REALTIME_PRIO_AUDIO (85)
+#define REALTIME_PRIO_MONITOR (90)
+
+// Locks and prefaults the process memory, everything mapped afterwards
+// (arena, rings, stacks) is locked and faulted in when it is mapped. Puts the
+// calling thread on the DSP core with a real time class and starts measuring
+// the scheduling latency there. 'cpus' is "<dsp>,<audio>", NULL takes the last
+// two cores. Whatever is not permitted is reported and skipped.
+void realtime_init(const char *cpus);
+bool realtime_enabled(void);
+// Applies the class and core of 'role' to the calling thread, once per thread
+void realtime_thread(realtime_role_e role);
+// Stops the latency monitor and logs the worst case
+void realtime_report(void);
+
+#endif // __REALTIME_H__
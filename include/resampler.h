@@ -9,6 +9,14 @@
 typedef struct _resampler_t resampler_t;
 
 resampler_t *resampler_create(unsigned int rate, unsigned int rrate, int offset, link_t *input);
+// Input ring of 'in_nb' blocks, holding at most 'max_latency_ms' of input (0 for no bound)
+resampler_t *resampler_create_bounded(unsigned int rate, unsigned int rrate, int offset, link_t *input,
+                                      size_t in_nb, unsigned int max_latency_ms);
+// Block state without a link, for fused chains (fuse.h)
+resampler_t *resampler_create_stage(unsigned int rate, unsigned int rrate, int offset,
+                                    link_format_e fmt, size_t bs);
+bool resampler_handler(void *ctx, void *in_buf, const link_msg_t *in_msg,
+                       void *out_buf, link_msg_t *out_msg);
 link_t *resampler_get_output(resampler_t *self);
 void resampler_destroy(resampler_t **self_p);
 
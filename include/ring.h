@@ -0,0 +1,57 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "arena.h"
+
+#define RING_MAX_READERS (8)
+#define RING_SHM_NAME_LEN (64)
+
+// Single producer ring buffer with up to RING_MAX_READERS consumers, each
+// having its own read position. The storage is mapped twice, back to back,
+// so any run of up to 'count' elements starting at the read or write position
+// is contiguous in memory and can be handed out as a view.
+//
+// Every ring_t is a handle to the shared storage. Handles made with 'reader'
+// set own a read position, the producer follows the slowest of the blocking
+// readers, while the ones with a non zero 'drop_bs' get whole blocks dropped
+// when they fall behind.
+//
+// A ring can also live in a named POSIX shared memory object, with its
+// positions and 'extra_len' bytes for the caller in front of the storage.
+// Other processes open it as readers, with the storage mapped read only.
+// They never hold the producer back: they get blocks of 'remote_bs' dropped,
+// read without marking their tail busy and find out with ring_try_release
+// whether the block was dropped (and maybe overwritten) while they read it.
+// The reader slots of processes that died holding them get reclaimed when
+// the slots run out, ring_open_shm returns NULL if none can be.
+typedef struct _ring_t ring_t;
+
+ring_t *ring_create(size_t element_len, size_t count);
+ring_t *ring_create_in(arena_t *arena, size_t element_len, size_t count);
+ring_t *ring_create_shm(const char *name, size_t element_len, size_t count, size_t remote_bs,
+                        size_t extra_len, void **extra);
+ring_t *ring_open_shm(const char *name, void **extra);
+ring_t *ring_attach(ring_t *ring, bool reader);
+void ring_set_drop(ring_t *self, size_t drop_bs);
+size_t ring_get_count(ring_t *self);
+size_t ring_get_count_free_elements(ring_t *self);
+size_t ring_get_count_waiting_elements(ring_t *self);
+size_t ring_get_head(ring_t *self);
+size_t ring_get_tail(ring_t *self);
+bool ring_reserve(ring_t *self, size_t count);
+void *ring_get_read_ptr(ring_t *self);
+void *ring_get_write_ptr(ring_t *self);
+void ring_bump_head(ring_t *self, size_t count);
+void ring_bump_tail(ring_t *self, size_t count);
+size_t ring_acquire(ring_t *self);
+void ring_release(ring_t *self, size_t count);
+bool ring_try_release(ring_t *self, size_t tail, size_t count);
+bool ring_try_seek(ring_t *self, size_t tail, size_t pos);
+size_t ring_insert(ring_t *self, const void *src, size_t max_count);
+size_t ring_consume(ring_t *self, void *dest, size_t max_count);
+void ring_destroy(ring_t **self_p);
+
+#endif // __RING_H__
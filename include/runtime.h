@@ -0,0 +1,20 @@
+#ifndef __RUNTIME_H__
+#define __RUNTIME_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Pool of worker threads running tasks with work stealing. A task is never
+// run by two workers at the same time, scheduling a running task makes it
+// run once more after it returns.
+typedef struct _runtime_t runtime_t;
+typedef struct _runtime_task_t runtime_task_t;
+
+runtime_t *runtime_create(size_t num_workers);
+runtime_task_t *runtime_task_create(runtime_t *self, void (*fn)(void *), void *arg);
+void runtime_task_start(runtime_task_t *task);
+bool runtime_task_schedule(runtime_task_t *task);
+void runtime_task_stop(runtime_task_t *task);
+void runtime_destroy(runtime_t **self_p);
+
+#endif // __RUNTIME_H__
@@ -0,0 +1,31 @@
+#ifndef __SHM_LINK_H__
+#define __SHM_LINK_H__
+
+#include "link.h"
+
+// Publishes a stream to other processes. The ring the source writes into is
+// a POSIX shared memory object (/dev/shm/dsp_<name>), the publisher has to be
+// the first consumer of the source and the local consumers connected after it
+// tee off the same ring. Readers map the samples read only and work on them
+// in place; they never hold the source back, when they fall behind their
+// oldest blocks are dropped.
+typedef struct _shm_link_t shm_link_t;
+typedef struct _shm_reader_t shm_reader_t;
+
+shm_link_t *shm_link_publish(const char *name, link_t *src, size_t nb);
+void shm_link_destroy(shm_link_t **self_p);
+
+shm_reader_t *shm_reader_open(const char *name);
+// Waits up to 'timeout_ms' (-1 forever) for the next block, '*buf' points
+// into the shared ring. Returns -1 with ETIMEDOUT or EPIPE once the
+// publisher has gone.
+int shm_reader_acquire(shm_reader_t *self, const void **buf, link_msg_t *msg, int timeout_ms);
+// False when the block was dropped while it was being read, whatever was
+// made of it is not to be trusted
+bool shm_reader_release(shm_reader_t *self);
+link_format_e shm_reader_get_format(shm_reader_t *self);
+size_t shm_reader_get_block_size(shm_reader_t *self);
+size_t shm_reader_get_dropped(shm_reader_t *self);
+void shm_reader_close(shm_reader_t **self_p);
+
+#endif // __SHM_LINK_H__
@@ -1,7 +1,6 @@
 #ifndef __SOAPY_SOURCE_H__
 #define __SOAPY_SOURCE_H__
 
-#include <libwebsockets.h>
 #include "link.h"
 
 typedef struct _soapy_source_t soapy_source_t;
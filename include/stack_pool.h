@@ -0,0 +1,17 @@
+#ifndef __STACK_POOL_H__
+#define __STACK_POOL_H__
+
+#include <stddef.h>
+
+// stack sizes for coroutines launched with 'go_mem'
+#define STACK_SIZE_RUNNER (32UL * 1024)
+#define STACK_SIZE_HANDLER (64UL * 1024)
+
+// Preallocated coroutine stacks, taken from the pipeline arena when there is
+// one. Stacks are painted when handed out so the deepest use can be reported
+// when they come back.
+void *stack_pool_get(const char *name, size_t size);
+void stack_pool_put(void **stack_p);
+void stack_pool_report(void);
+
+#endif // __STACK_POOL_H__
@@ -2,6 +2,7 @@
 #define __TFLITE_RUN_H__
 
 #include <stddef.h>
+#include <stdbool.h>
 
 #ifdef __cplusplus
 #define EXTERNC extern "C"
@@ -16,7 +17,12 @@ EXTERNC tflite_runner_t *tflite_runner_create_from_mem(const void *model_data, s
 EXTERNC int tflite_runner_run(tflite_runner_t *self,
                               const float *input, size_t input_size,
                               float *score);
+// Times every operator of the model from now on, see tflite_runner_report
+EXTERNC void tflite_runner_set_profiling(tflite_runner_t *self, bool enabled);
+// Logs the invoke latency percentiles and prints the time per operator
+EXTERNC void tflite_runner_report(const tflite_runner_t *self);
 EXTERNC const char *tflite_get_label(int id);           
+EXTERNC size_t tflite_get_label_count(void);
 EXTERNC void tflite_runner_destroy(tflite_runner_t **self_p);
 
 #undef EXTERNC
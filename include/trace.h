@@ -0,0 +1,22 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Records handler runs and link events in Chrome trace-event format, to be
+// opened in chrome://tracing or ui.perfetto.dev. Every thread writes to its
+// own preallocated buffer, which wraps around and keeps the latest events,
+// the file is written by trace_stop once the pipeline is gone. The number
+// of events kept per thread is 'trace.events' in the profile.
+bool trace_start(const char *path);
+void trace_stop(void);
+
+// Timestamp to pass to trace_complete, 0 when tracing is off
+uint64_t trace_begin(void);
+// Span from 'start' to now on the calling thread, handlers must not yield
+// in it or the spans of the coroutines sharing the thread would overlap
+void trace_complete(const char *name, const char *cat, uint64_t start);
+void trace_instant(const char *name, const char *cat, uint64_t value);
+
+#endif // __TRACE_H__
@@ -9,6 +9,10 @@
 typedef struct _wbfm_demod_t wbfm_demod_t;
 
 wbfm_demod_t *wbfm_demod_create(unsigned int rate, unsigned int decim, link_t *input);
+// Block state without a link, for fused chains (fuse.h)
+wbfm_demod_t *wbfm_demod_create_stage(unsigned int rate, unsigned int decim, size_t bs);
+bool wbfm_demod_handler(void *ctx, void *in_buf, const link_msg_t *in_msg,
+                        void *out_buf, link_msg_t *out_msg);
 link_t *wbfm_demod_get_output(wbfm_demod_t *self);
 void wbfm_demod_destroy(wbfm_demod_t **self_p);
 
@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include <ctype.h>
+#include <getopt.h>
 
 #include <complex.h>
 #include <math.h>
@@ -11,6 +12,12 @@
 
 #include "util.h"
 #include "logging.h"
+#include "profile.h"
+#include "realtime.h"
+#include "link.h"
+#include "stack_pool.h"
+#include "metrics.h"
+#include "trace.h"
 
 #include "audio_source.h"
 #include "mel_spectrum.h"
@@ -25,7 +32,82 @@
 #define SLICES (((AUDIO_SAMPLERATE - FRAME_LEN) / FRAME_STEP) + 1)
 #define SLICE_STEP (SLICES / 3)
 #define OUTPUT_SIZE (SLICES * SLICE_SIZE)
+// the interpreter runs on the sink coroutine
+#define TF_SINK_STACK_SIZE (512UL * 1024)
 #define DETECTION_THRESHOLD (3.0) // depends on microphone/audio quality
+// audio older than that is dropped when inference falls behind
+#define MAX_LATENCY_MS (125)
+
+static bool realtime = false;
+static const char *realtime_cpus = NULL;
+static int metrics_port = -1;
+static const char *trace_file = NULL;
+static bool probe = false;
+static bool profile_model = false;
+
+static const char help_msg[] =
+    "keywords, recognizes keywords spoken into the microphone\n\n"
+    "Use:\tkeywords [--realtime[=<dsp>,<audio>]] [--metrics[=<port>]]\n"
+    "\t[--trace <file>] [--probe] [--profile-model]\n"
+    "\t--realtime lock memory, real time scheduling, DSP and audio threads on\n"
+    "\t  the given cores (the last two by default)\n"
+    "\t--metrics serve Prometheus metrics on 127.0.0.1 (port 9101 by default)\n"
+    "\t--trace record the handlers and link events, written to <file> on exit\n"
+    "\t--probe measure the latency from the source to every block, logged on exit\n"
+    "\t--profile-model time every operator of the model, printed on exit\n";
+
+static bool parse_args(int argc, char *argv[])
+{
+    int opt;
+    bool ret = true;
+    static const struct option long_opts[] = {
+        {"realtime", optional_argument, NULL, 'R'},
+        {"metrics", optional_argument, NULL, 'M'},
+        {"trace", required_argument, NULL, 'T'},
+        {"probe", no_argument, NULL, 'L'},
+        {"profile-model", no_argument, NULL, 'O'},
+        {NULL, 0, NULL, 0}};
+
+    while (ret && (opt = getopt_long(argc, argv, "h", long_opts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'R':
+            realtime = true;
+            realtime_cpus = optarg;
+            break;
+
+        case 'M':
+            metrics_port = optarg ? atoi(optarg) : METRICS_DEFAULT_PORT;
+            break;
+
+        case 'T':
+            trace_file = optarg;
+            break;
+
+        case 'L':
+            probe = true;
+            break;
+
+        case 'O':
+            profile_model = true;
+            break;
+
+        case 'h':
+            fprintf(stderr, help_msg);
+            ret = false;
+            break;
+
+        default:
+            fprintf(stderr, "\n");
+            fprintf(stderr, help_msg);
+            ret = false;
+            break;
+        }
+    }
+
+    return ret;
+}
 
 static coroutine void tf_sink(link_t *input)
 {
@@ -33,19 +115,28 @@ static coroutine void tf_sink(link_t *input)
     int ret;
     void *dest;
     size_t n, m = 0, read = 0;
-    float in_buf[FRAME_LEN];
-    float out_buf[OUTPUT_SIZE];
+    float *in_buf = (float *)link_alloc(FRAME_LEN * sizeof(float));
+    float *out_buf = (float *)link_alloc(OUTPUT_SIZE * sizeof(float));
     float score;
     bool detecting = false;
     float last_score;
     float last_id;
+    // latency probe: from the capture of the newest sample of a window to
+    // the end of its inference
+    uint64_t probe_ns = 0;
+    latency_hist_t latency;
+
+    latency_init(&latency);
 
     memset(in_buf, 0, FRAME_LEN * sizeof(float));
 
-    link_t *output = link_connect("tf_sink", input, 4,
+    link_t *output = link_connect("tf_sink", input, profile_get("keywords.in_nb", 4),
                                   input->out_bs, sizeof(float),
                                   FRAME_LEN, sizeof(int));
     log_assert(output);
+    // one wakeup covers all the hops that piled up meanwhile
+    link_set_coalesce(output, true);
+    link_set_max_latency(output, AUDIO_SAMPLERATE, MAX_LATENCY_MS);
 
     mel_spectrum_t *mel = mel_spectrum_create(FRAME_LEN, SLICE_SIZE,
                                               AUDIO_SAMPLERATE, 20.0, 7600.0);
@@ -53,31 +144,59 @@ static coroutine void tf_sink(link_t *input)
 
     tflite_runner_t *tfr = tflite_runner_create_from_mem(models_17_keywords_tflite, sizeof(models_17_keywords_tflite));
     log_assert(tfr);
+    tflite_runner_set_profiling(tfr, profile_model);
+
+    static const double inference_bounds[] = {0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5};
+    metrics_histogram_t *inference = metrics_add_histogram("dsp_keyword_inference_seconds",
+                                                           "Time of one keyword inference", inference_bounds,
+                                                           sizeof(inference_bounds) / sizeof(inference_bounds[0]));
 
     while (true)
     {
-        ret = chrecv(output->in_ch_r, &msg, sizeof(link_msg_t), -1);
+        ret = link_recv(output, &msg, -1);
         if (ret != 0)
         {
             break;
         }
-        read += msg.len;
+        // drop the audio we are too late for
+        link_trim(output);
 
-        while(read >= FRAME_STEP)
+        while (true)
         {
+            // the audio callback may drop our oldest blocks, not while we copy them
+            read = link_acquire(output);
+            if (read < FRAME_STEP)
+            {
+                link_release(output, 0);
+                break;
+            }
             dest = memmove(in_buf, &in_buf[FRAME_STEP], FRAME_END * sizeof(float));
             log_assert(dest == in_buf);
 
-            n = lws_ring_consume(output->in_buf, NULL, &in_buf[FRAME_END], FRAME_STEP);
+            n = link_consume(output, &in_buf[FRAME_END], FRAME_STEP);
             log_assert(n == FRAME_STEP);
+            link_release(output, 0);
             read -= FRAME_STEP;
 
+            uint64_t span = trace_begin();
             mel_spectrum_process(mel, in_buf, &out_buf[(SLICES - SLICE_STEP + m) * SLICE_SIZE]);
+            trace_complete("tf_sink", "mel", span);
             m++;
             if(m == SLICE_STEP)
             {
                 m = 0;
+                uint64_t t0 = latency_now_ns();
+                span = trace_begin();
                 int id = tflite_runner_run(tfr, out_buf, OUTPUT_SIZE, &score);
+                trace_complete("tf_sink", "inference", span);
+                metrics_observe(inference, (latency_now_ns() - t0) / 1e9);
+                if (link_probe_enabled() && msg.origin_ns)
+                {
+                    // what is still queued came in after the window
+                    uint64_t captured = msg.origin_ns - ((read * 1000000000ULL) / AUDIO_SAMPLERATE);
+                    probe_ns = link_now_ns() - captured;
+                    latency_add(&latency, probe_ns);
+                }
                 if ((id >= 0) && (score > DETECTION_THRESHOLD))
                 {
                     LOG(DEBUG, "Predicted keyword: %s (score: %f)",
@@ -101,6 +220,10 @@ static coroutine void tf_sink(link_t *input)
                     {
                         LOG(INFO, "Predicted keyword: %s (score: %f)",
                             tflite_get_label(last_id), last_score);
+                        if (link_probe_enabled())
+                        {
+                            LOG(INFO, "Latency from the microphone: %.1f ms", probe_ns / 1e6);
+                        }
                         detecting = false;
                     }
                 }
@@ -114,15 +237,15 @@ static coroutine void tf_sink(link_t *input)
         
     }
 
+    metrics_remove(inference);
+    tflite_runner_report(tfr);
+    latency_log(&latency, "from the microphone to the keyword");
     tflite_runner_destroy(&tfr);
     mel_spectrum_destroy(&mel);
+    link_free(out_buf);
+    link_free(in_buf);
 
-    ret = chdone(output->in_ch_s);
-    log_assert(ret == 0);
-
-    ret = hclose(output->in_ch_s);
-    log_assert(ret == 0);
-    lws_ring_destroy(output->in_buf);
+    link_close(output);
     LOG(DEBUG, "Exiting");
 }
 
@@ -132,19 +255,45 @@ int main(int argc, char *argv[])
     link_msg_t msg;
 
     logging_init();
+
+    if (!parse_args(argc, argv))
+    {
+        exit(EXIT_FAILURE);
+    }
+    // before anything is mapped, so all of it gets locked
+    if (realtime)
+    {
+        realtime_init(realtime_cpus);
+    }
+    profile_load(PROFILE_FILE_NAME);
+    if (trace_file)
+    {
+        trace_start(trace_file);
+    }
+    link_set_probe(probe);
     audio_source_t *source = audio_source_create(AUDIO_SAMPLERATE);
-    int h = go(tf_sink(audio_source_get_output(source)));
+    void *stack = stack_pool_get("tf_sink", TF_SINK_STACK_SIZE);
+    int h = go_mem(tf_sink(audio_source_get_output(source)), stack, TF_SINK_STACK_SIZE);
+    log_assert(h >= 0);
 
     int cc = install_sigint_handler();
 
     audio_source_start(source);
+    if (metrics_port >= 0)
+    {
+        metrics_start(metrics_port);
+    }
 
     ret = chrecv(cc, &msg, sizeof(link_msg_t), -1);
     log_assert(ret == 0);
 
+    metrics_stop();
     audio_source_destroy(&source);
     ret = hclose(h);
     log_assert(ret == 0);
+    stack_pool_put(&stack);
+    trace_stop();
+    realtime_report();
 
     LOG(INFO, "Exiting");
     exit(EXIT_SUCCESS);
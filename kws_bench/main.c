@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <dirent.h>
+
+#include <math.h>
+
+#include <sndfile.h>
+
+#include "latency.h"
+#include "logging.h"
+#include "mel_spectrum.h"
+#include "tflite_runner.h"
+#include "17_keywords.h"
+
+// same front end as keywords and wav2mel
+#define SAMPLE_RATE (16000UL)
+#define NUM_SAMPLES (1 * SAMPLE_RATE)
+#define FRAME_LEN (1024UL)
+#define FRAME_STEP (256UL)
+#define SLICE_SIZE (80UL)
+#define SLICES (((NUM_SAMPLES - FRAME_LEN) / FRAME_STEP) + 1)
+#define OUTPUT_SIZE (SLICES * SLICE_SIZE)
+#define MAX_LABELS (32)
+#define MAX_PATH (512)
+
+typedef struct
+{
+    char path[MAX_PATH];
+    int label;
+    bool loaded;
+} corpus_file_t;
+
+static size_t max_per_label = 0;
+static const char *model_file = NULL;
+static bool profile_model = false;
+
+static const char help_msg[] =
+    "kws_bench, runs the keyword front end and model over a corpus of labelled 1 s,\n"
+    "16 kHz WAV files in <dir>/<label>/*.wav and prints the confusion matrix,\n"
+    "front end and inference time percentiles and files/s\n\n"
+    "Use:\tkws_bench [-n <files>] [-m <model>] [-p] <dir>\n"
+    "\t-n at most <files> per label\n"
+    "\t-m model file instead of the built-in model\n"
+    "\t-p time every operator of the model\n";
+
+static bool parse_args(int argc, char *argv[])
+{
+    int opt;
+    bool ret = true;
+
+    while (ret && (opt = getopt(argc, argv, "n:m:ph")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            max_per_label = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'm':
+            model_file = optarg;
+            break;
+
+        case 'p':
+            profile_model = true;
+            break;
+
+        case 'h':
+            fprintf(stderr, help_msg);
+            ret = false;
+            break;
+
+        default:
+            fprintf(stderr, "\n");
+            fprintf(stderr, help_msg);
+            ret = false;
+            break;
+        }
+    }
+
+    if (ret && (optind >= argc))
+    {
+        fprintf(stderr, help_msg);
+        ret = false;
+    }
+
+    return ret;
+}
+
+static int label_id(const char *name)
+{
+    for (size_t i = 0; i < tflite_get_label_count(); i++)
+    {
+        if (strcmp(name, tflite_get_label(i)) == 0)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static bool is_wav(const char *name)
+{
+    size_t len = strlen(name);
+    return (len > 4) && (strcmp(&name[len - 4], ".wav") == 0);
+}
+
+// Files of every subdirectory named after a label, others are skipped
+static corpus_file_t *list_corpus(const char *dir, size_t *count)
+{
+    size_t cap = 1024, n = 0;
+    corpus_file_t *files = (corpus_file_t *)malloc(cap * sizeof(corpus_file_t));
+    log_assert(files);
+
+    DIR *d = opendir(dir);
+    if (!d)
+    {
+        LOG(ERROR, "Failed to open %s", dir);
+        free(files);
+        return NULL;
+    }
+
+    struct dirent *e;
+    while ((e = readdir(d)))
+    {
+        int label = label_id(e->d_name);
+        if (label < 0)
+        {
+            if (e->d_name[0] != '.')
+            {
+                LOG(INFO, "Skipping %s, not a label of the model", e->d_name);
+            }
+            continue;
+        }
+
+        char sub[MAX_PATH];
+        snprintf(sub, sizeof(sub), "%s/%s", dir, e->d_name);
+        DIR *sd = opendir(sub);
+        if (!sd)
+        {
+            continue;
+        }
+        struct dirent *f;
+        size_t taken = 0;
+        while ((f = readdir(sd)) && ((max_per_label == 0) || (taken < max_per_label)))
+        {
+            if (!is_wav(f->d_name))
+            {
+                continue;
+            }
+            if (n == cap)
+            {
+                cap *= 2;
+                files = (corpus_file_t *)realloc(files, cap * sizeof(corpus_file_t));
+                log_assert(files);
+            }
+            snprintf(files[n].path, MAX_PATH, "%s/%s", sub, f->d_name);
+            files[n].label = label;
+            n++;
+            taken++;
+        }
+        closedir(sd);
+    }
+    closedir(d);
+
+    *count = n;
+    return files;
+}
+
+// One second of audio, shorter files are padded with faint noise like wav2mel does
+static bool load_wav(const char *path, float *audio)
+{
+    SF_INFO sfinfo;
+
+    memset(&sfinfo, 0, sizeof(sfinfo));
+    SNDFILE *file = sf_open(path, SFM_READ, &sfinfo);
+    if (!file)
+    {
+        LOG(WARN, "Failed to open %s", path);
+        return false;
+    }
+    if ((sfinfo.channels != 1) || (sfinfo.samplerate != SAMPLE_RATE))
+    {
+        LOG(WARN, "Skipping %s, not mono at %lu Hz", path, SAMPLE_RATE);
+        sf_close(file);
+        return false;
+    }
+
+    sf_count_t read = sf_read_float(file, audio, NUM_SAMPLES);
+    sf_close(file);
+    for (size_t i = (read > 0) ? read : 0; i < NUM_SAMPLES; i++)
+    {
+        audio[i] = 0.001 * rand() / RAND_MAX;
+    }
+
+    return true;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const uint64_t *sorted, size_t n, double p)
+{
+    size_t i = (size_t)ceil((p / 100.0) * n);
+    return sorted[(i > 0) ? i - 1 : 0];
+}
+
+static void print_confusion(const size_t *confusion, size_t labels)
+{
+    // the last column counts files without any prediction
+    printf("\n%8s", "");
+    for (size_t j = 0; j < labels; j++)
+    {
+        printf(" %5.5s", tflite_get_label(j));
+    }
+    printf(" %5s\n", "none");
+    for (size_t i = 0; i < labels; i++)
+    {
+        printf("%8s", tflite_get_label(i));
+        for (size_t j = 0; j <= labels; j++)
+        {
+            printf(" %5lu", confusion[(i * (labels + 1)) + j]);
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    size_t count = 0, loaded = 0, processed = 0, correct = 0;
+    float *features = (float *)malloc(OUTPUT_SIZE * sizeof(float));
+    log_assert(features);
+
+    logging_init();
+
+    if (!parse_args(argc, argv))
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    corpus_file_t *files = list_corpus(argv[optind], &count);
+    if (!files || (count == 0))
+    {
+        LOG(ERROR, "No labelled WAV files in %s", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    LOG(INFO, "%lu files", count);
+
+    // the whole corpus is read before the clock starts, only the front end
+    // and the model are timed
+    srand(1);
+    float *audio = (float *)malloc(count * NUM_SAMPLES * sizeof(float));
+    log_assert(audio);
+    for (size_t i = 0; i < count; i++)
+    {
+        files[i].loaded = load_wav(files[i].path, &audio[i * NUM_SAMPLES]);
+        loaded += files[i].loaded;
+    }
+    LOG(INFO, "%lu files loaded", loaded);
+
+    size_t labels = tflite_get_label_count();
+    log_assert(labels <= MAX_LABELS);
+    size_t *confusion = (size_t *)calloc(labels * (labels + 1), sizeof(size_t));
+    log_assert(confusion);
+    uint64_t *front_ns = (uint64_t *)malloc(count * sizeof(uint64_t));
+    log_assert(front_ns);
+    uint64_t *infer_ns = (uint64_t *)malloc(count * sizeof(uint64_t));
+    log_assert(infer_ns);
+
+    // loaded once for the whole corpus
+    mel_spectrum_t *mel = mel_spectrum_create(FRAME_LEN, SLICE_SIZE, SAMPLE_RATE, 20.0, 7600.0);
+    log_assert(mel);
+    tflite_runner_t *tfr = model_file ? tflite_runner_create_from_file(model_file)
+                                      : tflite_runner_create_from_mem(models_17_keywords_tflite,
+                                                                      sizeof(models_17_keywords_tflite));
+    log_assert(tfr);
+    tflite_runner_set_profiling(tfr, profile_model);
+
+    uint64_t start = latency_now_ns();
+    for (size_t i = 0; i < count; i++)
+    {
+        float score;
+        const float *x = &audio[i * NUM_SAMPLES];
+
+        if (!files[i].loaded)
+        {
+            continue;
+        }
+
+        uint64_t t0 = latency_now_ns();
+        for (size_t k = 0; k < SLICES; k++)
+        {
+            mel_spectrum_process(mel, &x[k * FRAME_STEP], &features[k * SLICE_SIZE]);
+        }
+        uint64_t t1 = latency_now_ns();
+        int id = tflite_runner_run(tfr, features, OUTPUT_SIZE, &score);
+        uint64_t t2 = latency_now_ns();
+
+        front_ns[processed] = t1 - t0;
+        infer_ns[processed] = t2 - t1;
+        processed++;
+        confusion[(files[i].label * (labels + 1)) + ((id >= 0) ? (size_t)id : labels)]++;
+        correct += (id == files[i].label);
+    }
+    double elapsed = (latency_now_ns() - start) / 1e9;
+
+    if (processed == 0)
+    {
+        LOG(ERROR, "No file could be processed");
+        exit(EXIT_FAILURE);
+    }
+
+    print_confusion(confusion, labels);
+
+    qsort(front_ns, processed, sizeof(uint64_t), compare_u64);
+    qsort(infer_ns, processed, sizeof(uint64_t), compare_u64);
+    printf("\naccuracy %.2f%% (%lu of %lu files)\n", 100.0 * correct / processed, correct, processed);
+    printf("%10s %10s %10s\n", "us/file", "p50", "p99");
+    printf("%10s %10.1f %10.1f\n", "front end",
+           percentile(front_ns, processed, 50) / 1e3, percentile(front_ns, processed, 99) / 1e3);
+    printf("%10s %10.1f %10.1f\n", "inference",
+           percentile(infer_ns, processed, 50) / 1e3, percentile(infer_ns, processed, 99) / 1e3);
+    printf("%.1f files/s\n", processed / elapsed);
+    if (profile_model)
+    {
+        printf("\n");
+        tflite_runner_report(tfr);
+    }
+
+    tflite_runner_destroy(&tfr);
+    mel_spectrum_destroy(&mel);
+    free(infer_ns);
+    free(front_ns);
+    free(confusion);
+    free(audio);
+    free(files);
+    free(features);
+
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <libdill.h>
+
+#include "logging.h"
+#include "link.h"
+#include "runtime.h"
+
+#define NUM_BLOCKS (64UL)
+#define DEFAULT_TOTAL (1UL << 24)
+
+static size_t num_workers = 0;
+static size_t total = DEFAULT_TOTAL;
+
+static const size_t block_sizes[] = {1, 16, 256, 4096};
+
+static const char help_msg[] =
+    "link_bench, messages per second through a null pipeline\n\n"
+    "Use:\tlink_bench [-n <samples>] [-j <threads>]\n"
+    "\t-n number of samples pushed through each run\n"
+    "\t-j run the null block on a pool of worker threads\n";
+
+static bool parse_args(int argc, char *argv[])
+{
+    int opt;
+    bool ret = true;
+
+    while (ret && (opt = getopt(argc, argv, "n:j:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            total = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'j':
+            num_workers = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'h':
+            fprintf(stderr, help_msg);
+            ret = false;
+            break;
+
+        default:
+            fprintf(stderr, "\n");
+            fprintf(stderr, help_msg);
+            ret = false;
+            break;
+        }
+    }
+
+    return ret;
+}
+
+// passes blocks through without touching them
+static bool null_handler(void *ctx, const link_view_t *in, link_view_t *out)
+{
+    (void)ctx;
+    out->msg.len = in->msg.len;
+    return true;
+}
+
+static coroutine void null_source(link_t *out, size_t blocks)
+{
+    link_msg_t msg = {
+        .len = out->out_bs,
+        .id = 0};
+
+    for (size_t i = 0; i < blocks; i++)
+    {
+        if (link_wait_send(out, out->out_bs, -1) != 0)
+        {
+            break;
+        }
+        ring_bump_head(out->out_buf, out->out_bs);
+        if (link_send(out, &msg) != 0)
+        {
+            break;
+        }
+    }
+}
+
+static coroutine void null_sink(link_t *in, size_t samples, int done_ch, size_t *wakeups)
+{
+    link_msg_t msg;
+
+    while (samples > 0)
+    {
+        if (link_recv(in, &msg, -1) != 0)
+        {
+            return;
+        }
+        (*wakeups)++;
+        samples -= link_consume(in, NULL, msg.len);
+    }
+
+    link_close(in);
+    int ret = chsend(done_ch, NULL, 0, -1);
+    log_assert(ret == 0);
+}
+
+static void run(size_t bs, bool coalesce)
+{
+    int ret;
+    int done[2];
+    size_t wakeups = 0;
+    size_t blocks = total / bs;
+
+    ret = chmake(done);
+    log_assert(ret == 0);
+
+    link_t *src = link_connect("null_source", NULL, 0, bs, sizeof(float), bs, sizeof(float));
+    log_assert(src);
+    link_t *null = link_connect("null", src, NUM_BLOCKS, bs, sizeof(float), bs, sizeof(float));
+    log_assert(null);
+    link_t *sink = link_connect("null_sink", null, NUM_BLOCKS, bs, sizeof(float), bs, sizeof(float));
+    log_assert(sink);
+    link_set_coalesce(null, coalesce);
+    link_set_coalesce(sink, coalesce);
+
+    uint64_t start = latency_now_ns();
+
+    int hs = go(null_sink(sink, blocks * bs, done[0], &wakeups));
+    log_assert(hs >= 0);
+    int hn = go(link_run_view(null, NULL, null_handler));
+    log_assert(hn >= 0);
+    int hp = go(null_source(src, blocks));
+    log_assert(hp >= 0);
+
+    ret = chrecv(done[1], NULL, 0, -1);
+    log_assert(ret == 0);
+
+    double elapsed = (latency_now_ns() - start) / 1e9;
+
+    printf("%8lu %10s %14.0f %14.3f %12.2f\n", bs, coalesce ? "coalesced" : "per-block",
+           blocks / elapsed, (blocks * bs) / elapsed / 1e6, (double)blocks / wakeups);
+
+    // the worker threads must be done with the links before they get closed
+    link_stop_tasks();
+    ret = hclose(hp);
+    log_assert(ret == 0);
+    ret = hclose(hn);
+    log_assert(ret == 0);
+    ret = hclose(hs);
+    log_assert(ret == 0);
+    link_close(src);
+    ret = hclose(done[0]);
+    log_assert(ret == 0);
+    ret = hclose(done[1]);
+    log_assert(ret == 0);
+}
+
+int main(int argc, char *argv[])
+{
+    int ret;
+    runtime_t *rt = NULL;
+
+    logging_init();
+
+    ret = parse_args(argc, argv);
+    if (!ret)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    if (num_workers > 0)
+    {
+        rt = runtime_create(num_workers);
+        log_assert(rt);
+        link_set_runtime(rt);
+    }
+
+    printf("%8s %10s %14s %14s %12s\n", "block", "mode", "msgs/s", "Msamples/s", "msgs/wakeup");
+    for (size_t i = 0; i < sizeof(block_sizes) / sizeof(block_sizes[0]); i++)
+    {
+        if (block_sizes[i] > total)
+        {
+            break;
+        }
+        run(block_sizes[i], false);
+        run(block_sizes[i], true);
+    }
+
+    if (rt)
+    {
+        runtime_destroy(&rt);
+    }
+
+    exit(EXIT_SUCCESS);
+}
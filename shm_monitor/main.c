@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <complex.h>
+#include <math.h>
+
+#include "latency.h"
+#include "logging.h"
+#include "shm_link.h"
+
+#define TIMEOUT_MS (100)
+#define REPORT_NS (1000000000LL)
+
+static volatile sig_atomic_t stop = 0;
+
+static void sigint_handler(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+// Mean power of a block relative to full scale, read in place
+static double block_power(const void *buf, size_t n, link_format_e fmt)
+{
+    double sum = 0.0;
+
+    switch (fmt)
+    {
+    case LINK_FMT_CS16:
+    {
+        const int16_t *p = (const int16_t *)buf;
+        for (size_t i = 0; i < 2 * n; i++)
+        {
+            sum += (p[i] / 32768.0) * (p[i] / 32768.0);
+        }
+        break;
+    }
+    case LINK_FMT_CS8:
+    {
+        const int8_t *p = (const int8_t *)buf;
+        for (size_t i = 0; i < 2 * n; i++)
+        {
+            sum += (p[i] / 128.0) * (p[i] / 128.0);
+        }
+        break;
+    }
+    default:
+    {
+        const complex float *p = (const complex float *)buf;
+        for (size_t i = 0; i < n; i++)
+        {
+            sum += crealf(p[i] * conjf(p[i]));
+        }
+        break;
+    }
+    }
+
+    return sum / n;
+}
+
+int main(int argc, char *argv[])
+{
+    const void *buf;
+    link_msg_t msg;
+    size_t blocks = 0, gaps = 0, torn = 0;
+    double power = 0.0;
+
+    logging_init();
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "shm_monitor, reports on a stream published by wbfm_demod -S <name>\n\n"
+                        "Use:\tshm_monitor <name>\n");
+        exit(EXIT_FAILURE);
+    }
+
+    shm_reader_t *reader = shm_reader_open(argv[1]);
+    if (!reader)
+    {
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGINT, sigint_handler);
+
+    size_t bs = shm_reader_get_block_size(reader);
+    link_format_e fmt = shm_reader_get_format(reader);
+    int64_t last = latency_now_ns();
+
+    while (!stop)
+    {
+        if (shm_reader_acquire(reader, &buf, &msg, TIMEOUT_MS) != 0)
+        {
+            if (errno == ETIMEDOUT)
+            {
+                continue;
+            }
+            LOG(INFO, "Publisher has gone");
+            break;
+        }
+
+        double p = block_power(buf, bs, fmt);
+        if (shm_reader_release(reader))
+        {
+            power += p;
+            blocks++;
+            gaps += (msg.flags & LINK_MSG_GAP) ? 1 : 0;
+        }
+        else
+        {
+            torn++;
+        }
+
+        int64_t t = latency_now_ns();
+        if ((t - last) >= REPORT_NS)
+        {
+            printf("%8.3f Msamples/s %8.1f dBFS, index %lu, %lu gaps, %lu blocks torn, %lu samples dropped\n",
+                   (blocks * bs) / ((t - last) / 1e3), 10 * log10(power / (blocks ? blocks : 1)),
+                   msg.index, gaps, torn, shm_reader_get_dropped(reader));
+            blocks = 0;
+            power = 0.0;
+            last = t;
+        }
+    }
+
+    shm_reader_close(&reader);
+    exit(EXIT_SUCCESS);
+}
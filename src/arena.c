@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+
+#include "arena.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "logging.h"
+
+#define ARENA_HUGEPAGE_SIZE (2UL * 1024 * 1024)
+
+struct _arena_t
+{
+    uint8_t *base;
+    size_t size;
+    size_t used;
+    size_t page;
+    // rings map parts of the arena a second time, so it is backed by a file
+    int fd;
+};
+
+static size_t arena_round(size_t v, size_t a)
+{
+    return ((v + a - 1) / a) * a;
+}
+
+static bool arena_map(arena_t *self, bool hugepages)
+{
+    self->fd = memfd_create("arena", MFD_CLOEXEC | (hugepages ? MFD_HUGETLB : 0));
+    if (self->fd < 0)
+    {
+        return false;
+    }
+
+    // populated right away, the pipeline never takes a page fault on it
+    if (ftruncate(self->fd, self->size) == 0)
+    {
+        self->base = mmap(NULL, self->size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, self->fd, 0);
+        if (self->base != MAP_FAILED)
+        {
+            return true;
+        }
+    }
+
+    close(self->fd);
+    self->fd = -1;
+
+    return false;
+}
+
+arena_t *arena_create(size_t size, bool hugepages)
+{
+    arena_t *self = (arena_t *)malloc(sizeof(arena_t));
+    log_assert(self);
+
+    bool mapped = false;
+    if (hugepages)
+    {
+        self->page = ARENA_HUGEPAGE_SIZE;
+        self->size = arena_round(size, self->page);
+        mapped = arena_map(self, true);
+        if (!mapped)
+        {
+            LOG(WARN, "No huge pages available, using regular pages");
+        }
+    }
+
+    if (!mapped)
+    {
+        self->page = sysconf(_SC_PAGESIZE);
+        self->size = arena_round(size, self->page);
+        mapped = arena_map(self, false);
+        log_assert(mapped);
+    }
+    memset(self->base, 0, self->size);
+    self->used = 0;
+
+    LOG(DEBUG, "Arena of %lu bytes with %lu bytes pages", self->size, self->page);
+
+    return self;
+}
+
+void *arena_alloc(arena_t *self, size_t size)
+{
+    size_t start = arena_round(self->used, ARENA_ALIGN);
+
+    dlg_assertm(start + size <= self->size, "Arena exhausted, %lu of %lu bytes used", self->used, self->size);
+    self->used = start + size;
+
+    return &self->base[start];
+}
+
+void *arena_alloc_pages(arena_t *self, size_t size, int *fd, off_t *offset)
+{
+    size_t start = arena_round(self->used, self->page);
+
+    size = arena_round(size, self->page);
+    dlg_assertm(start + size <= self->size, "Arena exhausted, %lu of %lu bytes used", self->used, self->size);
+    self->used = start + size;
+
+    *fd = self->fd;
+    *offset = start;
+
+    return &self->base[start];
+}
+
+size_t arena_get_page_size(arena_t *self)
+{
+    return self->page;
+}
+
+size_t arena_get_used(arena_t *self)
+{
+    return self->used;
+}
+
+bool arena_contains(arena_t *self, const void *p)
+{
+    return ((const uint8_t *)p >= self->base) && ((const uint8_t *)p < (self->base + self->size));
+}
+
+void arena_destroy(arena_t **self_p)
+{
+    log_assert(self_p);
+    if (*self_p)
+    {
+        arena_t *self = *self_p;
+        int ret;
+
+        LOG(DEBUG, "Arena used %lu of %lu bytes", self->used, self->size);
+
+        ret = munmap(self->base, self->size);
+        log_assert(ret == 0);
+        ret = close(self->fd);
+        log_assert(ret == 0);
+        free(self);
+        *self_p = NULL;
+    }
+}
@@ -1,12 +1,23 @@
 #include "audio_sink.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
 #include <rtaudio/rtaudio_c.h>
 #include <libdill.h>
 
 #include "logging.h"
+#include "metrics.h"
+#include "trace.h"
+#include "profile.h"
+#include "realtime.h"
+#include "stack_pool.h"
 
 #define SCALE (0.1)
+// queued audio beyond that is dropped, a stall must not add latency for good
+#define MAX_LATENCY_MS (100)
+// blocks queued in pull mode, one being played and one coming up
+#define PULL_BLOCKS (2)
 
 struct _audio_sink_t
 {
@@ -16,9 +27,39 @@ struct _audio_sink_t
     unsigned int num_channels;
     link_t *in;
     int handle;
-    size_t avail;
+    void *stack;
+    // callbacks that found less than a buffer and the ones the device
+    // reported an underflow to, owned by the callback
+    size_t underruns;
+    size_t xruns;
+    // ring positions published by the runner to the audio callback, which
+    // owns the tail: what has arrived, and where the current station starts
+    _Atomic size_t head;
+    _Atomic bool flush;
+    size_t flush_pos;
+    // latency probe: origin of the newest block the runner published and
+    // the time until a sample played by the callback is heard, filled by
+    // the callback
+    _Atomic uint64_t head_origin;
+    unsigned int samplerate;
+    size_t device_frames;
+    latency_hist_t latency;
 };
 
+// The newest published sample is heard once what is queued before it and
+// the device buffers are played
+static void audio_sink_probe(audio_sink_t *self, size_t head)
+{
+    uint64_t origin = atomic_load_explicit(&self->head_origin, memory_order_relaxed);
+    if (!link_probe_enabled() || (origin == 0))
+    {
+        return;
+    }
+
+    size_t frames = ((head - ring_get_tail(self->in->in_buf)) / self->num_channels) + self->device_frames;
+    latency_add(&self->latency, link_now_ns() - origin + ((frames * 1000000000ULL) / self->samplerate));
+}
+
 static int audio_cb(void *outputBuffer, void *inputBuffer, unsigned int nBufferFrames,
                     double stream_time, rtaudio_stream_status_t status, void *data)
 {
@@ -27,26 +68,56 @@ static int audio_cb(void *outputBuffer, void *inputBuffer, unsigned int nBufferF
     audio_sink_t *self = (audio_sink_t *)data;
     (void)inputBuffer;
 
+    // the first callback puts the audio thread on its core
+    realtime_thread(REALTIME_AUDIO);
+    uint64_t span = trace_begin();
+
     if (status)
+    {
+        self->xruns++;
+        trace_instant("audio_sink", "xrun", self->xruns);
         LOG(WARN, "Stream underflow detected!");
+    }
 
-    if (self->avail >= self->num_channels * nBufferFrames)
+    link_trim(self->in);
+    // the producer may drop our oldest blocks, not while we read them
+    link_acquire(self->in);
+    if (atomic_exchange_explicit(&self->flush, false, memory_order_acquire))
     {
-        n = lws_ring_consume(self->in->in_buf, NULL, buffer, self->num_channels * nBufferFrames);
-        log_assert(n == self->num_channels * nBufferFrames);
-        for (size_t i = 0; i < self->num_channels * nBufferFrames; i++)
+        // audio of the previous station is still queued, skip it
+        size_t stale = self->flush_pos - ring_get_tail(self->in->in_buf);
+        if ((ssize_t)stale > 0)
         {
-            buffer[i] *= SCALE;
+            link_consume(self->in, NULL, stale);
         }
-        self->avail -= self->num_channels * nBufferFrames;
+    }
+
+    size_t head = atomic_load_explicit(&self->head, memory_order_acquire);
+    size_t avail = head - ring_get_tail(self->in->in_buf);
+    if ((ssize_t)avail >= (ssize_t)(self->num_channels * nBufferFrames))
+    {
+        n = self->num_channels * nBufferFrames;
+        log_assert(ring_get_count_waiting_elements(self->in->in_buf) >= n);
+        // scale straight out of the ring, no intermediate copy
+        const float *samples = (const float *)ring_get_read_ptr(self->in->in_buf);
+        for (size_t i = 0; i < n; i++)
+        {
+            buffer[i] = samples[i] * SCALE;
+        }
+        link_release(self->in, n);
+        audio_sink_probe(self, head);
     } else {
+        link_release(self->in, 0);
         for (size_t i = 0; i < self->num_channels * nBufferFrames; i++)
         {
             buffer[i] = 0.0;
         }
+        self->underruns++;
+        trace_instant("audio_sink", "underrun", self->underruns);
     }
+    trace_complete("audio_cb", "audio", span);
 
-    //LOG(DEBUG, "Audio samples left: %ld", self->avail);
+    //LOG(DEBUG, "Audio samples left: %ld", avail);
 
     return 0;
 }
@@ -63,26 +134,28 @@ static coroutine void audio_sink_runner(audio_sink_t *self)
 
     while (true)
     {
-        ret = chrecv(self->in->in_ch_r, &msg, sizeof(link_msg_t), -1);
+        ret = link_recv(self->in, &msg, -1);
         if (ret != 0)
         {
             break;
         }
         LOG(DEBUG, "Received %lu samples (id = %d)", msg.len, msg.id);
-        self->avail += msg.len;
+        if (msg.flags & LINK_MSG_RETUNE)
+        {
+            self->flush_pos = self->in->retune_pos;
+            atomic_store_explicit(&self->flush, true, memory_order_release);
+        }
+        atomic_store_explicit(&self->head_origin, msg.origin_ns, memory_order_relaxed);
+        atomic_store_explicit(&self->head, msg.index + msg.len, memory_order_release);
+        trace_instant("audio_sink", "publish", msg.index + msg.len);
     }
 
-    ret = chdone(self->in->in_ch_s);
-    log_assert(ret == 0);
-
-    ret = hclose(self->in->in_ch_s);
-    log_assert(ret == 0);
-    lws_ring_destroy(self->in->in_buf);
+    link_close(self->in);
     LOG(DEBUG, "Exiting");
 }
 
-audio_sink_t *audio_sink_create(unsigned int samplerate, unsigned int num_channels,
-                                link_t *input)
+static audio_sink_t *audio_sink_create_mode(unsigned int samplerate, unsigned int num_channels,
+                                            link_t *input, bool pull)
 {
     log_assert(num_channels < 3 && num_channels > 0);
     
@@ -104,7 +177,7 @@ audio_sink_t *audio_sink_create(unsigned int samplerate, unsigned int num_channe
     }
     LOG(INFO, "Using default audio device");
 
-    audio_sink_t *self = (audio_sink_t *)malloc(sizeof(audio_sink_t));
+    audio_sink_t *self = (audio_sink_t *)link_alloc(sizeof(audio_sink_t));
     log_assert(self);
 
     self->dac = dac;
@@ -118,30 +191,65 @@ audio_sink_t *audio_sink_create(unsigned int samplerate, unsigned int num_channe
 
     self->options.flags = RTAUDIO_FLAGS_HOG_DEVICE;
     self->options.flags |= RTAUDIO_FLAGS_MINIMIZE_LATENCY;
+    if (realtime_enabled())
+    {
+        self->options.flags |= RTAUDIO_FLAGS_SCHEDULE_REALTIME;
+        self->options.priority = REALTIME_PRIO_AUDIO;
+    }
     self->bufferFrames = input->out_bs;
     self->num_channels = num_channels;
 
-    self->in = link_connect("audio_sink", input, 50,
+    self->in = link_connect("audio_sink", input,
+                            pull ? PULL_BLOCKS : profile_get("audio_sink.in_nb", 50),
                             input->out_bs, sizeof(float),
                             input->out_bs, sizeof(float));
     log_assert(self->in);
-    self->avail = 0;
+    link_set_coalesce(self->in, true);
+    if (!pull)
+    {
+        link_set_max_latency(self->in, samplerate * num_channels, MAX_LATENCY_MS);
+    }
+    self->underruns = 0;
+    self->xruns = 0;
+    metrics_add_counter("dsp_audio_sink_underruns_total", "Audio callbacks without a whole block queued",
+                        &self->underruns);
+    metrics_add_counter("dsp_audio_sink_xruns_total", "Underflows reported by the audio device", &self->xruns);
+    atomic_init(&self->head, self->in->seen);
+    atomic_init(&self->flush, false);
+    self->flush_pos = 0;
+    atomic_init(&self->head_origin, 0);
+    self->samplerate = samplerate;
+    latency_init(&self->latency);
 
     rtaudio_error_t err = rtaudio_open_stream(self->dac, &o_params, NULL, RTAUDIO_FORMAT_FLOAT32,
                                               samplerate, &self->bufferFrames, &audio_cb,
                                               (void *)self, &self->options,
                                               &error_cb);
     log_assert(err == 0);
+    self->device_frames = rtaudio_get_stream_latency(self->dac);
 
     err = rtaudio_start_stream(self->dac);
     log_assert(err == 0);
 
-    self->handle = go(audio_sink_runner(self));
+    self->stack = stack_pool_get("audio_sink", STACK_SIZE_RUNNER);
+    self->handle = go_mem(audio_sink_runner(self), self->stack, STACK_SIZE_RUNNER);
     log_assert(self->handle >= 0);
 
     return self;
 }
 
+audio_sink_t *audio_sink_create(unsigned int samplerate, unsigned int num_channels,
+                                link_t *input)
+{
+    return audio_sink_create_mode(samplerate, num_channels, input, false);
+}
+
+audio_sink_t *audio_sink_create_pull(unsigned int samplerate, unsigned int num_channels,
+                                     link_t *input)
+{
+    return audio_sink_create_mode(samplerate, num_channels, input, true);
+}
+
 void audio_sink_destroy(audio_sink_t **self_p)
 {
     log_assert(self_p);
@@ -150,16 +258,25 @@ void audio_sink_destroy(audio_sink_t **self_p)
         int ret;
         audio_sink_t *self = *self_p;
 
-        ret = hclose(self->handle);
-        log_assert(ret == 0);
-
+        // the callback reads the input ring, which goes away with the runner
         rtaudio_error_t err = rtaudio_stop_stream(self->dac);
         log_assert(err == 0);
         if (rtaudio_is_stream_open(self->dac))
         {
             rtaudio_close_stream(self->dac);
         }
-        free(self);
+
+        ret = hclose(self->handle);
+        log_assert(ret == 0);
+        stack_pool_put(&self->stack);
+        if (self->underruns)
+        {
+            LOG(INFO, "Audio sink ran short %lu times", self->underruns);
+        }
+        latency_log(&self->latency, "from the source to the speaker");
+        metrics_remove(&self->xruns);
+        metrics_remove(&self->underruns);
+        link_free(self);
         *self_p = NULL;
     }
 }
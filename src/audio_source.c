@@ -1,45 +1,83 @@
 #include "audio_source.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <rtaudio/rtaudio_c.h>
 #include <libdill.h>
 
 #include "logging.h"
+#include "metrics.h"
+#include "profile.h"
+#include "realtime.h"
+#include "stack_pool.h"
 
 #define SCALE (0.1)
 #define BLOCK_SIZE (1000)
 #define NUM_CHANNELS (1)
 
+// what the callback tells the runner about a block it queued
+typedef struct
+{
+    uint64_t origin_ns;
+    bool lost;
+} audio_source_block_t;
+
 struct _audio_source_t
 {
     rtaudio_t adc;
+    rtaudio_stream_options_t options;
     unsigned int bufferFrames;
     unsigned int num_channels;
     link_t *out;
     int handle;
+    void *stack;
     int pipe[2];
+    // a block was lost since the last one that went out and overflows the
+    // device reported, owned by the callback
+    bool lost;
+    size_t xruns;
 };
 
 static int audio_cb(void *outputBuffer, void *inputBuffer, unsigned int nBufferFrames,
                     double stream_time, rtaudio_stream_status_t status, void *data)
 {
     int ret;
-    uint8_t v;
+    audio_source_block_t b;
     size_t n;
     float *buffer = (float *)inputBuffer;
     audio_source_t *self = (audio_source_t *)data;
     (void)outputBuffer;
 
+    // the first callback puts the audio thread on its core
+    realtime_thread(REALTIME_AUDIO);
+
     if (status)
+    {
+        self->xruns++;
         LOG(WARN, "Stream underflow detected!");
+    }
 
     log_assert((self->num_channels * nBufferFrames) == self->out->out_bs);
 
     LOG(DEBUG, "Received audio input samples");
-    n = lws_ring_insert(self->out->out_buf, buffer, self->out->out_bs);
+    // the callback cannot wait, without room the newest block is lost
+    if (!ring_reserve(self->out->out_buf, self->out->out_bs))
+    {
+        self->out->dropped += self->out->out_bs;
+        self->out->drops++;
+        self->lost = true;
+        return 0;
+    }
+    n = ring_insert(self->out->out_buf, buffer, self->out->out_bs);
     log_assert(n == self->out->out_bs);
-    ret = write(self->pipe[1], &v, 1);
-    log_assert(ret == 1);
+    // tells the runner when the block was captured and whether it follows a lost one
+    b.origin_ns = link_now_ns();
+    b.lost = self->lost;
+    self->lost = false;
+    ret = write(self->pipe[1], &b, sizeof(b));
+    log_assert(ret == sizeof(b));
 
     return 0;
 }
@@ -52,7 +90,7 @@ static void error_cb(rtaudio_error_t err, const char *msg)
 static void coroutine audio_source_runner(audio_source_t *self)
 {
     int ret;
-    uint8_t v;
+    audio_source_block_t b;
 
     link_msg_t msg = {
         .len = self->out->out_bs,
@@ -66,12 +104,14 @@ static void coroutine audio_source_runner(audio_source_t *self)
             break;
         }
 
-        ret = read(self->pipe[0], &v, 1);
-        log_assert(ret == 1);
+        ret = read(self->pipe[0], &b, sizeof(b));
+        log_assert(ret == sizeof(b));
+        msg.flags = b.lost ? LINK_MSG_GAP : 0;
+        msg.origin_ns = b.origin_ns;
 
         LOG(DEBUG, "Sending out audio samples");
 
-        ret = chsend(self->out->out_ch_s, &msg, sizeof(link_msg_t), -1);
+        ret = link_send(self->out, &msg);
         if (ret == 0)
         {
             ret = yield();
@@ -79,16 +119,12 @@ static void coroutine audio_source_runner(audio_source_t *self)
         }
         else
         {
-            log_assert((errno == ETIMEDOUT) || (errno == ECANCELED));
+            log_assert((errno == ETIMEDOUT) || (errno == ECANCELED) || (errno == EPIPE));
             break;
         }
     }
 
-    ret = chdone(self->out->in_ch_s);
-    log_assert(ret == 0);
-
-    ret = hclose(self->out->in_ch_s);
-    log_assert(ret == 0);
+    link_close(self->out);
     LOG(DEBUG, "Exiting");
 }
 
@@ -113,7 +149,7 @@ audio_source_t *audio_source_create(unsigned int samplerate)
     }
     LOG(INFO, "Using default audio device");
 
-    audio_source_t *self = (audio_source_t *)malloc(sizeof(audio_source_t));
+    audio_source_t *self = (audio_source_t *)link_alloc(sizeof(audio_source_t));
     log_assert(self);
 
     self->adc = adc;
@@ -125,12 +161,21 @@ audio_source_t *audio_source_create(unsigned int samplerate)
         .num_channels = NUM_CHANNELS
     };
 
-    self->bufferFrames = BLOCK_SIZE;
+    memset(&self->options, 0, sizeof(self->options));
+    if (realtime_enabled())
+    {
+        self->options.flags |= RTAUDIO_FLAGS_SCHEDULE_REALTIME;
+        self->options.priority = REALTIME_PRIO_AUDIO;
+    }
+    self->bufferFrames = profile_get("audio_source.block_size", BLOCK_SIZE);
     self->num_channels = NUM_CHANNELS;
+    self->lost = false;
+    self->xruns = 0;
+    metrics_add_counter("dsp_audio_source_xruns_total", "Overflows reported by the audio device", &self->xruns);
 
     self->out = link_connect("audio_source", NULL, 0,
                              0, sizeof(float),
-                             BLOCK_SIZE, sizeof(float));
+                             self->bufferFrames, sizeof(float));
     log_assert(self->out);
 
     // the pipe is just used as a non-blocking (in libdill) semaphore
@@ -139,7 +184,7 @@ audio_source_t *audio_source_create(unsigned int samplerate)
 
     rtaudio_error_t err = rtaudio_open_stream(self->adc, NULL, &i_params, RTAUDIO_FORMAT_FLOAT32,
                                               samplerate, &self->bufferFrames, &audio_cb,
-                                              (void *)self, NULL,
+                                              (void *)self, &self->options,
                                               &error_cb);
     log_assert(err == 0);
 
@@ -148,7 +193,8 @@ audio_source_t *audio_source_create(unsigned int samplerate)
 
 void audio_source_start(audio_source_t *self)
 {
-    self->handle = go(audio_source_runner(self));
+    self->stack = stack_pool_get("audio_source", STACK_SIZE_RUNNER);
+    self->handle = go_mem(audio_source_runner(self), self->stack, STACK_SIZE_RUNNER);
     log_assert(self->handle >= 0);
 
     rtaudio_error_t err = rtaudio_start_stream(self->adc);
@@ -171,6 +217,7 @@ void audio_source_destroy(audio_source_t **self_p)
 
         ret = hclose(self->handle);
         log_assert(ret == 0);
+        stack_pool_put(&self->stack);
 
         rtaudio_error_t err = rtaudio_stop_stream(self->adc);
         log_assert(err == 0);
@@ -179,15 +226,14 @@ void audio_source_destroy(audio_source_t **self_p)
             rtaudio_close_stream(self->adc);
         }
 
-        lws_ring_destroy(self->out->in_buf);
-
         fdclean(self->pipe[0]);
         ret = close(self->pipe[0]);
         log_assert(ret == 0);
         ret = close(self->pipe[1]);
         log_assert(ret == 0);
 
-        free(self);
+        metrics_remove(&self->xruns);
+        link_free(self);
         *self_p = NULL;
     }
 }
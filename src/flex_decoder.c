@@ -6,6 +6,8 @@
 #include <liquid/liquid.h>
 
 #include "logging.h"
+#include "profile.h"
+#include "stack_pool.h"
 
 #define INTERP (10)
 
@@ -20,6 +22,12 @@ struct _flex_decoder_t
     unsigned char *payload_p;
     unsigned int payload_len;
     int handle;
+    void *stack;
+
+    // scratch: analytic signal of one input block and its resampled version
+    complex float *tmp1;
+    complex float *tmp2;
+    size_t bs;
 };
 
 static int callback(unsigned char *_header,
@@ -43,13 +51,15 @@ static int callback(unsigned char *_header,
     return 0;
 }
 
-static bool flex_decoder_handler(void *ctx, void *in_buf, const link_msg_t *in_msg,
-                                 void *out_buf, link_msg_t *out_msg)
+bool flex_decoder_handler(void *ctx, void *in_buf, const link_msg_t *in_msg,
+                          void *out_buf, link_msg_t *out_msg)
 {
     unsigned int n;
     flex_decoder_t *self = (flex_decoder_t *)ctx;
-    complex float tmp1[in_msg->len / 2];
-    complex float tmp2[in_msg->len / (2 * INTERP)];
+    complex float *tmp1 = self->tmp1;
+    complex float *tmp2 = self->tmp2;
+
+    log_assert(in_msg->len <= self->bs);
 
     firhilbf_decim_execute_block(self->fh, (float *)in_buf, in_msg->len / 2, tmp1);
 
@@ -68,9 +78,9 @@ static bool flex_decoder_handler(void *ctx, void *in_buf, const link_msg_t *in_m
     return true;
 }
 
-flex_decoder_t *flex_decoder_create(link_t *input)
+flex_decoder_t *flex_decoder_create_stage(size_t bs)
 {
-    flex_decoder_t *self = (flex_decoder_t *)malloc(sizeof(flex_decoder_t));
+    flex_decoder_t *self = (flex_decoder_t *)link_alloc(sizeof(flex_decoder_t));
     log_assert(self);
 
     self->fs = flexframesync_create(callback, self);
@@ -88,12 +98,29 @@ flex_decoder_t *flex_decoder_create(link_t *input)
     self->fh = firhilbf_create(5, 60.0f);
     log_assert(self->fh);
 
-    self->output = link_connect("flex_decoder", input, 4,
+    self->bs = bs;
+    self->tmp1 = (complex float *)link_alloc((self->bs / 2) * sizeof(complex float));
+    // the resampler can produce a sample more than the ratio says
+    self->tmp2 = (complex float *)link_alloc(((self->bs / (2 * INTERP)) + 2) * sizeof(complex float));
+    self->output = NULL;
+    self->handle = -1;
+    self->stack = NULL;
+
+    return self;
+}
+
+flex_decoder_t *flex_decoder_create(link_t *input)
+{
+    flex_decoder_t *self = flex_decoder_create_stage(input->out_bs);
+    log_assert(self);
+
+    self->output = link_connect("flex_decoder", input, profile_get("flex_decoder.in_nb", 4),
                                 input->out_bs, sizeof(float),
-                                1024, sizeof(char));
+                                FLEX_DECODER_MAX_PAYLOAD, sizeof(char));
     log_assert(self->output);
 
-    self->handle = go(link_run(self->output, self, flex_decoder_handler));
+    self->stack = stack_pool_get("flex_decoder", STACK_SIZE_HANDLER);
+    self->handle = go_mem(link_run(self->output, self, flex_decoder_handler), self->stack, STACK_SIZE_HANDLER);
     log_assert(self->handle >= 0);
 
     return self;
@@ -111,15 +138,21 @@ void flex_decoder_destroy(flex_decoder_t **self_p)
     if (*self_p)
     {
         flex_decoder_t *self = *self_p;
-        int ret = hclose(self->handle);
-        log_assert(ret == 0);
+        if (self->handle >= 0)
+        {
+            int ret = hclose(self->handle);
+            log_assert(ret == 0);
+            stack_pool_put(&self->stack);
+        }
 
         flexframesync_destroy(self->fs);
         msresamp_crcf_destroy(self->resamp);
         nco_crcf_destroy(self->nco);
         firhilbf_destroy(self->fh);
 
-        free(self);
+        link_free(self->tmp2);
+        link_free(self->tmp1);
+        link_free(self);
         *self_p = NULL;
     }
     LOG(DEBUG, "Destroyed");
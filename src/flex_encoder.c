@@ -7,6 +7,8 @@
 #include <libdill.h>
 
 #include "logging.h"
+#include "profile.h"
+#include "stack_pool.h"
 
 #define INTERP (10)
 #define MAX_PAYLOAD_SIZE (480)
@@ -21,27 +23,31 @@ struct _flex_encoder_t
     nco_crcf nco;
     firhilbf fh;
     unsigned char header[14];
+    // no frame in progress, the next input starts one
+    bool idle;
     size_t bs;
+    // frame samples before interpolation
+    complex float *tmp;
     link_t *output;
     int handle;
+    void *stack;
 };
 
-static bool flex_encoder_handler(void *ctx, void *in_buf, const link_msg_t *in_msg,
-                                 void *out_buf, link_msg_t *out_msg)
+bool flex_encoder_handler(void *ctx, void *in_buf, const link_msg_t *in_msg,
+                          void *out_buf, link_msg_t *out_msg)
 {
     flex_encoder_t *self = (flex_encoder_t *)ctx;
     int frame_complete = 0;
-    static bool idle = true;
     unsigned int n;
-    complex float tmp[self->bs];
+    complex float *tmp = self->tmp;
 
-    if (idle)
+    if (self->idle)
     {
         flexframegen_reset(self->fg);
         flexframegen_setprops(self->fg, &self->fgprops);
         //flexframegen_print(self->fg);
         flexframegen_assemble(self->fg, self->header, in_buf, in_msg->len);
-        idle = false;
+        self->idle = false;
     }
 
     frame_complete = flexframegen_write_samples(self->fg, tmp, self->bs);
@@ -55,15 +61,15 @@ static bool flex_encoder_handler(void *ctx, void *in_buf, const link_msg_t *in_m
 
     if (frame_complete)
     {
-        idle = true;
+        self->idle = true;
     }
 
     return frame_complete;
 }
 
-flex_encoder_t *flex_encoder_create(link_t *input)
+flex_encoder_t *flex_encoder_create_stage(size_t bs)
 {
-    flex_encoder_t *self = (flex_encoder_t *)malloc(sizeof(flex_encoder_t));
+    flex_encoder_t *self = (flex_encoder_t *)link_alloc(sizeof(flex_encoder_t));
     log_assert(self);
 
     flexframegenprops_init_default(&self->fgprops);
@@ -89,15 +95,36 @@ flex_encoder_t *flex_encoder_create(link_t *input)
     for (size_t i = 0; i < sizeof(self->header); i++)
         self->header[i] = i;
 
-    self->output = link_connect("flex_encoder", input, 2,
+    log_assert(bs % (2 * INTERP) == 0);
+    self->idle = true;
+    self->bs = bs / (2 * INTERP);
+    self->tmp = (complex float *)link_alloc(self->bs * sizeof(complex float));
+    self->output = NULL;
+    self->handle = -1;
+    self->stack = NULL;
+
+    return self;
+}
+
+flex_encoder_t *flex_encoder_create(link_t *input)
+{
+    size_t bs = profile_get("flex_encoder.block_size", BLOCK_SIZE);
+    if (bs % (2 * INTERP) != 0)
+    {
+        LOG(WARN, "Block size %lu is not a multiple of %d, using %d", bs, 2 * INTERP, BLOCK_SIZE);
+        bs = BLOCK_SIZE;
+    }
+    flex_encoder_t *self = flex_encoder_create_stage(bs);
+    log_assert(self);
+
+    self->output = link_connect("flex_encoder", input, profile_get("flex_encoder.in_nb", 2),
                                 input->out_bs, sizeof(uint8_t),
-                                2000, sizeof(float));
+                                bs, sizeof(float));
     log_assert(self->output);
-    log_assert(self->output->out_bs % (2 * INTERP) == 0);
-    self->bs = self->output->out_bs / (2 * INTERP);
     self->output->async = true;
 
-    self->handle = go(link_run(self->output, self, flex_encoder_handler));
+    self->stack = stack_pool_get("flex_encoder", STACK_SIZE_HANDLER);
+    self->handle = go_mem(link_run(self->output, self, flex_encoder_handler), self->stack, STACK_SIZE_HANDLER);
     log_assert(self->handle >= 0);
 
     return self;
@@ -117,15 +144,20 @@ void flex_encoder_destroy(flex_encoder_t **self_p)
         int ret;
         flex_encoder_t *self = *self_p;
 
-        ret = hclose(self->handle);
-        log_assert(ret == 0);
+        if (self->handle >= 0)
+        {
+            ret = hclose(self->handle);
+            log_assert(ret == 0);
+            stack_pool_put(&self->stack);
+        }
 
         flexframegen_destroy(self->fg);
         msresamp_crcf_destroy(self->resamp);
         nco_crcf_destroy(self->nco);
         firhilbf_destroy(self->fh);
 
-        free(self);
+        link_free(self->tmp);
+        link_free(self);
         *self_p = NULL;
     }
     LOG(DEBUG, "Destroyed");
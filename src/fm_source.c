@@ -0,0 +1,270 @@
+#include "fm_source.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <complex.h>
+#include <math.h>
+
+#include <libdill.h>
+#include <liquid/liquid.h>
+
+#include "logging.h"
+#include "stack_pool.h"
+
+#define DEVIATION_HZ (75000.0f)
+#define PILOT_HZ (19000.0f)
+// share of the deviation, the rest goes to the program
+#define PILOT_LEVEL (0.1f)
+#define DEFAULT_LEFT_HZ (1000.0f)
+#define DEFAULT_RIGHT_HZ (1500.0f)
+#define DEFAULT_AMPLITUDE (0.8f)
+// gaussian noise is looked up, blocks start at random offsets
+#define NOISE_LEN (1UL << 16)
+
+struct _fm_source_t
+{
+    link_t *out;
+    int handle;
+    void *stack;
+    double samplerate;
+
+    nco_crcf nco_left;
+    nco_crcf nco_right;
+    nco_crcf nco_pilot;
+    nco_crcf nco_offset;
+    freqmod mod;
+    bool left_on;
+    bool right_on;
+    float amplitude;
+    float offset_hz;
+
+    complex float *noise;
+    float noise_std;
+
+    bool paced;
+    size_t length;
+
+    // scratch: multiplex signal of one block
+    float *mpx;
+};
+
+// Multiplex: (L+R)/2, pilot and (L-R)/2 on twice the pilot phase, with the
+// pilot and the subcarrier crossing zero together like on air. There is
+// no pre-emphasis, keep the tones below the de-emphasis of fms_demod.
+static void fm_source_generate(fm_source_t *self, complex float *out, size_t n)
+{
+    float *mpx = self->mpx;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        float l = self->left_on ? self->amplitude * nco_crcf_sin(self->nco_left) : 0.0f;
+        float r = self->right_on ? self->amplitude * nco_crcf_sin(self->nco_right) : 0.0f;
+        float ps, pc;
+        nco_crcf_sincos(self->nco_pilot, &ps, &pc);
+        nco_crcf_step(self->nco_left);
+        nco_crcf_step(self->nco_right);
+        nco_crcf_step(self->nco_pilot);
+
+        float sub = 2.0f * ps * pc;
+        mpx[i] = (1.0f - PILOT_LEVEL) * ((0.5f * (l + r)) + (0.5f * (l - r) * sub)) + (PILOT_LEVEL * ps);
+    }
+    freqmod_modulate_block(self->mod, mpx, n, out);
+
+    if (self->offset_hz != 0.0f)
+    {
+        nco_crcf_mix_block_up(self->nco_offset, out, out, n);
+    }
+
+    if (self->noise_std > 0.0f)
+    {
+        size_t k = rand() % NOISE_LEN;
+        for (size_t i = 0; i < n; i++)
+        {
+            out[i] += self->noise_std * self->noise[(k + i) % NOISE_LEN];
+        }
+    }
+}
+
+static coroutine void fm_source_runner(fm_source_t *self)
+{
+    int ret;
+    size_t bs = self->out->out_bs;
+    size_t sent = 0;
+    int64_t start_ns = (int64_t)latency_now_ns();
+    link_msg_t msg = {
+        .len = bs,
+        .id = 0,
+        .flags = LINK_MSG_HAS_TIME};
+
+    while ((self->length == 0) || (sent < self->length))
+    {
+        // the time stamp is the one of the first sample, like the SDR's
+        msg.time_ns = start_ns + (int64_t)((sent * 1e9) / self->samplerate);
+        if (self->paced)
+        {
+            int64_t wait = start_ns + (int64_t)(((sent + bs) * 1e9) / self->samplerate) - (int64_t)latency_now_ns();
+            if ((wait > 0) && (msleep(now() + ((wait + 999999) / 1000000)) != 0))
+            {
+                break;
+            }
+        }
+
+        ret = link_wait_send(self->out, bs, -1);
+        if ((ret != 0) && (errno != ENOBUFS))
+        {
+            break;
+        }
+        // a consumer dropping the newest blocks has no room, the signal
+        // still goes on in the drop buffer
+        bool dropping = (ret != 0);
+        complex float *buf = dropping ? (complex float *)self->out->drop_buf
+                                      : (complex float *)ring_get_write_ptr(self->out->out_buf);
+        fm_source_generate(self, buf, bs);
+        msg.origin_ns = link_now_ns();
+        sent += bs;
+        if (dropping)
+        {
+            link_discard(self->out, bs);
+            continue;
+        }
+
+        ring_bump_head(self->out->out_buf, bs);
+        ret = link_send(self->out, &msg);
+        if (ret != 0)
+        {
+            break;
+        }
+        ret = yield();
+        if (ret != 0)
+        {
+            break;
+        }
+    }
+
+    link_close(self->out);
+    LOG(DEBUG, "Exiting");
+}
+
+fm_source_t *fm_source_create(double samplerate, link_t *output)
+{
+    log_assert(output->out_sz == sizeof(complex float));
+
+    fm_source_t *self = (fm_source_t *)link_alloc(sizeof(fm_source_t));
+    log_assert(self);
+
+    self->out = output;
+    self->samplerate = samplerate;
+    self->handle = -1;
+    self->stack = NULL;
+
+    self->nco_left = nco_crcf_create(LIQUID_VCO);
+    log_assert(self->nco_left);
+    self->nco_right = nco_crcf_create(LIQUID_VCO);
+    log_assert(self->nco_right);
+    self->nco_pilot = nco_crcf_create(LIQUID_VCO);
+    log_assert(self->nco_pilot);
+    nco_crcf_set_frequency(self->nco_pilot, 2 * M_PI * PILOT_HZ / samplerate);
+    self->nco_offset = nco_crcf_create(LIQUID_VCO);
+    log_assert(self->nco_offset);
+    // liquid's modulation factor is the deviation relative to the sample rate
+    self->mod = freqmod_create(DEVIATION_HZ / samplerate);
+    log_assert(self->mod);
+
+    self->noise = (complex float *)link_alloc(NOISE_LEN * sizeof(complex float));
+    log_assert(self->noise);
+    for (size_t i = 0; i < NOISE_LEN; i++)
+    {
+        // unit power, like the carrier
+        self->noise[i] = (randnf() + (randnf() * I)) * (float)M_SQRT1_2;
+    }
+    self->noise_std = 0.0f;
+
+    self->mpx = (float *)link_alloc(output->out_bs * sizeof(float));
+    log_assert(self->mpx);
+
+    fm_source_set_program(self, DEFAULT_LEFT_HZ, DEFAULT_RIGHT_HZ, DEFAULT_AMPLITUDE);
+    fm_source_set_offset(self, 0.0f);
+    self->paced = false;
+    self->length = 0;
+
+    return self;
+}
+
+void fm_source_set_program(fm_source_t *self, float left_hz, float right_hz, float amplitude)
+{
+    log_assert((amplitude >= 0.0f) && (amplitude <= 1.0f));
+    self->left_on = left_hz > 0.0f;
+    self->right_on = right_hz > 0.0f;
+    self->amplitude = amplitude;
+    nco_crcf_set_frequency(self->nco_left, 2 * M_PI * left_hz / self->samplerate);
+    nco_crcf_set_frequency(self->nco_right, 2 * M_PI * right_hz / self->samplerate);
+}
+
+void fm_source_set_noise(fm_source_t *self, float cnr_db)
+{
+    self->noise_std = isinf(cnr_db) ? 0.0f : powf(10.0f, -cnr_db / 20.0f);
+}
+
+void fm_source_set_offset(fm_source_t *self, float offset_hz)
+{
+    self->offset_hz = offset_hz;
+    nco_crcf_set_frequency(self->nco_offset, 2 * M_PI * offset_hz / self->samplerate);
+}
+
+void fm_source_set_paced(fm_source_t *self, bool paced)
+{
+    self->paced = paced;
+}
+
+void fm_source_set_length(fm_source_t *self, size_t samples)
+{
+    self->length = samples;
+}
+
+void fm_source_start(fm_source_t *self)
+{
+    self->stack = stack_pool_get("fm_source", STACK_SIZE_RUNNER);
+    self->handle = go_mem(fm_source_runner(self), self->stack, STACK_SIZE_RUNNER);
+    log_assert(self->handle >= 0);
+}
+
+void fm_source_destroy(fm_source_t **self_p)
+{
+    LOG(DEBUG, "Destroying");
+    log_assert(self_p);
+    if (*self_p)
+    {
+        fm_source_t *self = *self_p;
+        if (self->handle >= 0)
+        {
+            int ret = hclose(self->handle);
+            log_assert(ret == 0);
+            stack_pool_put(&self->stack);
+        }
+        freqmod_destroy(self->mod);
+        nco_crcf_destroy(self->nco_offset);
+        nco_crcf_destroy(self->nco_pilot);
+        nco_crcf_destroy(self->nco_right);
+        nco_crcf_destroy(self->nco_left);
+
+        link_free(self->mpx);
+        link_free(self->noise);
+        link_free(self);
+        *self_p = NULL;
+    }
+    LOG(DEBUG, "Destroyed");
+}
+
+void fm_source_fill(complex float *out, size_t n, double samplerate)
+{
+    float phase = 0.0f;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        float t = (float)(i / samplerate);
+        float m = 0.6f * sinf(2 * M_PI * 1000.0f * t) + 0.4f * sinf(2 * M_PI * 7000.0f * t);
+        phase += 2 * M_PI * DEVIATION_HZ * m / samplerate;
+        phase = fmodf(phase, 2 * M_PI);
+        out[i] = cexpf(I * phase);
+    }
+}
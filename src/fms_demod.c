@@ -5,6 +5,8 @@
 #include <liquid/liquid.h>
 
 #include "logging.h"
+#include "profile.h"
+#include "stack_pool.h"
 
 #define PILOT_FREQ_HZ (19000.0f)
 #define PLL_BANDWIDTH_HZ (9.0f)
@@ -30,21 +32,52 @@ struct _fms_demod_t
     firdecim_rrrf fir_decim_r;
 
     int handle;
+    void *stack;
     link_t *output;
     unsigned int decim;
+    float pilot_freq;
+
+    // scratch: demodulated input block and one decimation step per channel
+    float *tmp;
+    float *tmp_l;
+    float *tmp_r;
+    size_t bs;
 };
 
-static bool fms_demod_handle(void *ctx, void *in_buf, const link_msg_t *in_msg,
-                             void *out_buf, link_msg_t *out_msg)
+// Starts over on a new station, the pilot PLL has to lock again
+static void fms_demod_reset(fms_demod_t *self)
+{
+    freqdem_reset(self->fmdemod);
+    nco_crcf_set_phase(self->nco_pilot_approx, 0.0f);
+    nco_crcf_set_phase(self->nco_pilot_exact, 0.0f);
+    nco_crcf_set_frequency(self->nco_pilot_exact, self->pilot_freq);
+    nco_crcf_set_phase(self->nco_stereo_subcarrier, 0.0f);
+    firfilt_crcf_reset(self->fir_pilot);
+    wdelaycf_reset(self->audio_delay);
+    firfilt_crcf_reset(self->fir_l_plus_r);
+    firfilt_crcf_reset(self->fir_l_minus_r);
+    iirfilt_crcf_reset(self->iir_deemph_l);
+    iirfilt_crcf_reset(self->iir_deemph_r);
+    firdecim_rrrf_reset(self->fir_decim_l);
+    firdecim_rrrf_reset(self->fir_decim_r);
+}
+
+bool fms_demod_handle(void *ctx, void *in_buf, const link_msg_t *in_msg,
+                      void *out_buf, link_msg_t *out_msg)
 {
     fms_demod_t *self = (fms_demod_t *)ctx;
-    float tmp_l[self->decim];
-    float tmp_r[self->decim];
+    float *tmp_l = self->tmp_l;
+    float *tmp_r = self->tmp_r;
+    float *tmp = self->tmp;
     size_t j = 0, k = 0;
 
+    log_assert(in_msg->len <= self->bs);
+    if (in_msg->flags & LINK_MSG_RETUNE)
+    {
+        fms_demod_reset(self);
+    }
     out_msg->id = 0;
     out_msg->len = 2 * (in_msg->len / self->decim);
-    float tmp[in_msg->len];
 
     freqdem_demodulate_block(self->fmdemod, (float complex *)in_buf, in_msg->len, tmp);
 
@@ -106,7 +139,7 @@ static firfilt_crcf create_fir_filter(unsigned int len, float fc, float As, floa
     return f;
 }
 
-fms_demod_t *fms_demod_create(unsigned int rate, unsigned int decim, link_t *input)
+fms_demod_t *fms_demod_create_stage(unsigned int rate, unsigned int decim, size_t bs)
 {
     if (rate < 106000)
     {
@@ -114,9 +147,10 @@ fms_demod_t *fms_demod_create(unsigned int rate, unsigned int decim, link_t *inp
         return NULL;
     }
 
-    fms_demod_t *self = (fms_demod_t *)malloc(sizeof(fms_demod_t));
+    fms_demod_t *self = (fms_demod_t *)link_alloc(sizeof(fms_demod_t));
     log_assert(self);
     self->decim = decim;
+    self->pilot_freq = PILOT_FREQ_HZ * 2 * M_PI / rate;
 
     self->fmdemod = freqdem_create(0.8);
     log_assert(self->fmdemod);
@@ -166,12 +200,32 @@ fms_demod_t *fms_demod_create(unsigned int rate, unsigned int decim, link_t *inp
     self->fir_decim_r = firdecim_rrrf_create_kaiser(decim, 10, 60.0);
     log_assert(self->fir_decim_r);
 
-    self->output = link_connect("fms_demod", input, 2,
+    self->bs = bs;
+    self->tmp = (float *)link_alloc(self->bs * sizeof(float));
+    self->tmp_l = (float *)link_alloc(decim * sizeof(float));
+    self->tmp_r = (float *)link_alloc(decim * sizeof(float));
+    self->output = NULL;
+    self->handle = -1;
+    self->stack = NULL;
+
+    return self;
+}
+
+fms_demod_t *fms_demod_create(unsigned int rate, unsigned int decim, link_t *input)
+{
+    fms_demod_t *self = fms_demod_create_stage(rate, decim, input->out_bs);
+    if (!self)
+    {
+        return NULL;
+    }
+
+    self->output = link_connect("fms_demod", input, profile_get("fms_demod.in_nb", 2),
                                 input->out_bs, sizeof(complex float),
                                 2 * (input->out_bs / decim), sizeof(float));
     log_assert(self->output);
 
-    self->handle = go(link_run(self->output, self, fms_demod_handle));
+    self->stack = stack_pool_get("fms_demod", STACK_SIZE_HANDLER);
+    self->handle = go_mem(link_run(self->output, self, fms_demod_handle), self->stack, STACK_SIZE_HANDLER);
     log_assert(self->handle >= 0);
 
     return self;
@@ -189,8 +243,12 @@ void fms_demod_destroy(fms_demod_t **self_p)
     if (*self_p)
     {
         fms_demod_t *self = *self_p;
-        int ret = hclose(self->handle);
-        log_assert(ret == 0);
+        if (self->handle >= 0)
+        {
+            int ret = hclose(self->handle);
+            log_assert(ret == 0);
+            stack_pool_put(&self->stack);
+        }
         iirfilt_crcf_destroy(self->iir_deemph_r);
         iirfilt_crcf_destroy(self->iir_deemph_l);
         firfilt_crcf_destroy(self->fir_l_minus_r);
@@ -202,7 +260,10 @@ void fms_demod_destroy(fms_demod_t **self_p)
         nco_crcf_destroy(self->nco_pilot_approx);
         freqdem_destroy(self->fmdemod);
 
-        free(self);
+        link_free(self->tmp_r);
+        link_free(self->tmp_l);
+        link_free(self->tmp);
+        link_free(self);
         *self_p = NULL;
     }
     LOG(DEBUG, "Destroyed");
@@ -0,0 +1,55 @@
+#include "fuse.h"
+
+#include <string.h>
+
+link_fused_t *link_fused_create(void *first, void *second, size_t mid_bs, size_t mid_sz)
+{
+    link_fused_t *self = (link_fused_t *)link_alloc(sizeof(link_fused_t));
+    log_assert(self);
+
+    self->first = first;
+    self->second = second;
+    self->mid_bs = mid_bs;
+    self->mid_sz = mid_sz;
+    // a partial block plus one full output of the first stage
+    self->mid = (uint8_t *)link_alloc(2 * mid_bs * mid_sz);
+    log_assert(self->mid);
+    self->fill = 0;
+    self->fed = false;
+    self->pending = 0;
+
+    return self;
+}
+
+void *link_fused_tail(link_fused_t *self)
+{
+    log_assert(self->fill < self->mid_bs);
+    return self->mid + (self->fill * self->mid_sz);
+}
+
+void link_fused_advance(link_fused_t *self, const link_msg_t *msg)
+{
+    log_assert(msg->len <= self->mid_bs);
+    self->fill += msg->len;
+    // same as a link: the tag goes with the next block processed
+    self->pending |= msg->flags & LINK_MSG_RETUNE;
+    self->fed = true;
+}
+
+void link_fused_shift(link_fused_t *self)
+{
+    self->fill -= self->mid_bs;
+    memmove(self->mid, self->mid + (self->mid_bs * self->mid_sz), self->fill * self->mid_sz);
+}
+
+void link_fused_destroy(link_fused_t **self_p)
+{
+    log_assert(self_p);
+    if (*self_p)
+    {
+        link_fused_t *self = *self_p;
+        link_free(self->mid);
+        link_free(self);
+        *self_p = NULL;
+    }
+}
@@ -0,0 +1,85 @@
+#include "latency.h"
+
+#include <string.h>
+#include <time.h>
+
+#include "logging.h"
+
+uint64_t latency_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+void latency_init(latency_hist_t *h)
+{
+    memset(h, 0, sizeof(latency_hist_t));
+}
+
+// Below 4 us one bucket per us, above it the top 3 bits of the value
+static size_t latency_bucket(uint64_t us)
+{
+    if (us < 4)
+    {
+        return us;
+    }
+
+    int o = 63 - __builtin_clzll(us);
+    size_t b = ((o - 1) << 2) | ((us >> (o - 2)) & 3);
+
+    return (b < LATENCY_BUCKETS) ? b : LATENCY_BUCKETS - 1;
+}
+
+static uint64_t latency_bucket_top_ns(size_t b)
+{
+    if (b < 4)
+    {
+        return (b + 1) * 1000;
+    }
+
+    int o = (b >> 2) + 1;
+    return ((uint64_t)(5 + (b & 3)) << (o - 2)) * 1000;
+}
+
+void latency_add(latency_hist_t *h, uint64_t ns)
+{
+    h->counts[latency_bucket(ns / 1000)]++;
+    h->count++;
+    h->sum_ns += ns;
+    if (ns > h->max_ns)
+    {
+        h->max_ns = ns;
+    }
+}
+
+uint64_t latency_percentile(const latency_hist_t *h, double p)
+{
+    size_t seen = 0;
+    size_t rank = (size_t)((p / 100.0) * h->count);
+
+    for (size_t b = 0; b < LATENCY_BUCKETS; b++)
+    {
+        seen += h->counts[b];
+        if (seen > rank)
+        {
+            // the bucket may reach past the largest value seen
+            uint64_t top = latency_bucket_top_ns(b);
+            return (top < h->max_ns) ? top : h->max_ns;
+        }
+    }
+
+    return h->max_ns;
+}
+
+void latency_log(const latency_hist_t *h, const char *what)
+{
+    if (h->count == 0)
+    {
+        return;
+    }
+
+    LOG(INFO, "Latency %s: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms, mean %.2f ms over %lu blocks", what,
+        latency_percentile(h, 50) / 1e6, latency_percentile(h, 90) / 1e6, latency_percentile(h, 99) / 1e6,
+        h->max_ns / 1e6, (h->sum_ns / h->count) / 1e6, h->count);
+}
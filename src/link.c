@@ -5,22 +5,224 @@
 #include <stdbool.h>
 #include <string.h>
 #include <assert.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
 
-#include <libwebsockets.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include "logging.h"
+#include "trace.h"
 
-link_t *link_connect(const char *name, link_t *src, size_t in_nb,
-                     size_t in_bs, size_t in_sz,
-                     size_t out_bs, size_t out_sz)
+// with a runtime messages are queued, 'link_process' stops when the queue is full
+#define LINK_MSG_QUEUE_LEN (256)
+
+typedef enum
+{
+    LINK_IDLE = 0,
+    LINK_BLOCKED,
+    LINK_CLOSED
+} link_state_e;
+
+typedef struct
+{
+    void *ctx;
+    link_handler_t handler;
+} link_shim_t;
+
+static runtime_t *link_runtime;
+static arena_t *link_arena;
+static bool link_metrics;
+static bool link_probe;
+// every link until it gets closed, for the metrics
+static link_t *link_list;
+
+static void link_task(void *arg);
+static void link_credit(link_t *self);
+
+void link_set_runtime(runtime_t *rt)
+{
+    link_runtime = rt;
+}
+
+void link_set_arena(arena_t *arena)
+{
+    link_arena = arena;
+}
+
+void link_set_metrics(bool enabled)
+{
+    link_metrics = enabled;
+}
+
+void link_set_probe(bool enabled)
+{
+    link_probe = enabled;
+}
+
+bool link_probe_enabled(void)
+{
+    return link_probe;
+}
+
+void link_foreach(void (*fn)(link_t *, void *), void *arg)
+{
+    for (link_t *l = link_list; l; l = l->next)
+    {
+        fn(l, arg);
+    }
+}
+
+// Waits for the runs in progress, no worker thread touches the links
+// after this, which is what makes closing them safe
+void link_stop_tasks(void)
+{
+    for (link_t *l = link_list; l; l = l->next)
+    {
+        if (l->task)
+        {
+            runtime_task_stop(l->task);
+        }
+    }
+}
+
+static void link_register(link_t *self)
+{
+    link_t **p = &link_list;
+    while (*p)
+    {
+        p = &(*p)->next;
+    }
+    self->next = NULL;
+    *p = self;
+}
+
+static void link_unregister(link_t *self)
+{
+    for (link_t **p = &link_list; *p; p = &(*p)->next)
+    {
+        if (*p == self)
+        {
+            *p = self->next;
+            break;
+        }
+    }
+}
+
+static uint64_t link_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+// Input occupancy high-water mark
+static void link_note_queued(link_t *self)
+{
+    size_t queued = ring_get_count_waiting_elements(self->in_buf);
+    if (queued > self->queued_max)
+    {
+        self->queued_max = queued;
+    }
+}
+
+// Time from the source to the input of the link
+static void link_note_origin(link_t *self, uint64_t origin_ns)
+{
+    if (link_probe && origin_ns)
+    {
+        latency_add(&self->latency, link_now_ns() - origin_ns);
+    }
+}
+
+// Block state and scratch buffers, taken from the pipeline arena when there
+// is one, always zeroed and 64 bytes aligned
+void *link_alloc(size_t size)
+{
+    void *p;
+
+    if (link_arena)
+    {
+        return arena_alloc(link_arena, size);
+    }
+
+    p = aligned_alloc(ARENA_ALIGN, ((size + ARENA_ALIGN - 1) / ARENA_ALIGN) * ARENA_ALIGN);
+    log_assert(p);
+    memset(p, 0, size);
+
+    return p;
+}
+
+void link_free(void *p)
+{
+    // arena memory goes away with the arena
+    if (!link_arena || !arena_contains(link_arena, p))
+    {
+        free(p);
+    }
+}
+
+// 'ring' replaces the input ring the link would create, the consumers
+// connected to 'src' afterwards read it as a tee
+static link_t *link_connect_with(const char *name, link_t *src, size_t in_nb,
+                                 size_t in_bs, size_t in_sz,
+                                 size_t out_bs, size_t out_sz, ring_t *ring)
 {
     int ret;
     int in_ch[2];
 
-    link_t *self = (link_t *)malloc(sizeof(link_t));
+    link_t *self = (link_t *)link_alloc(sizeof(link_t));
     log_assert(self);
     self->name = name;
     self->async = false;
+    self->rt = link_runtime;
+    self->task = NULL;
+    self->in_msgs = NULL;
+    self->in_efd = -1;
+    self->ctx = NULL;
+    self->handler = NULL;
+    self->read = 0;
+
+    self->out_buf = NULL;
+    self->out_n = 0;
+    self->out_fmt = LINK_FMT_RAW;
+    self->in_link = src;
+
+    atomic_init(&self->stalled, false);
+    self->out_efd = -1;
+    self->stalls = 0;
+    self->stall_ns = 0;
+    self->stall_start = 0;
+
+    self->policy = LINK_POLICY_BLOCK;
+    self->dropped = 0;
+    self->drops = 0;
+    self->max_queued = 0;
+    self->drop_buf = NULL;
+    self->closed = false;
+    self->held = false;
+
+    self->out_index = 0;
+    self->in_next = 0;
+    self->in_synced = false;
+    self->pending = 0;
+    self->gaps = 0;
+
+    self->received = 0;
+    self->sent = 0;
+    self->queued_max = 0;
+    self->handler_ns = 0;
+    self->rate_sent = 0;
+    self->rate_ns = 0;
+    latency_init(&self->latency);
+    atomic_init(&self->origin_ns, 0);
+
+    self->coalesce = false;
+    atomic_init(&self->notified, false);
+    self->seen = 0;
+    atomic_init(&self->retune, false);
+    self->retune_pos = 0;
 
     self->in_sz = in_sz;
     self->in_bs = in_bs;
@@ -36,24 +238,69 @@ link_t *link_connect(const char *name, link_t *src, size_t in_nb,
     self->in_ch_s = in_ch[0];
     self->in_ch_r = in_ch[1];
 
-    self->in_buf = lws_ring_create(self->in_sz, 1 + (self->in_nb * self->in_bs), NULL);
-    log_assert(self->in_buf);
-    LOG(DEBUG, "%s -> input buffer: %lu * %lu * %lu = %lu", self->name,
-        self->in_nb, self->in_bs, self->in_sz,
-        self->in_sz * self->in_nb * self->in_bs);
+    if ((self->in_nb * self->in_bs) > 0)
+    {
+        if (ring)
+        {
+            log_assert(!src || (src->out_n == 0));
+            self->in_buf = ring;
+            log_assert(ring_get_count(self->in_buf) == self->in_nb * self->in_bs);
+        }
+        else if (src && (src->out_n > 0))
+        {
+            // tee: the source ring is already there, read it with a cursor of our own
+            log_assert(src->out_n < RING_MAX_READERS);
+            log_assert(!src->drop_buf);
+            self->in_buf = ring_attach(src->out_buf, true);
+            log_assert(self->in_buf);
+            log_assert(self->in_bs <= ring_get_count(self->in_buf));
+            LOG(DEBUG, "%s -> sharing input buffer of '%s'", self->name, src->name);
+        }
+        else
+        {
+            self->in_buf = ring_create_in(link_arena, self->in_sz, self->in_nb * self->in_bs);
+            log_assert(self->in_buf);
+            LOG(DEBUG, "%s -> input buffer: %lu * %lu * %lu = %lu", self->name,
+                self->in_nb, self->in_bs, self->in_sz,
+                self->in_sz * self->in_nb * self->in_bs);
 
-    log_assert(lws_ring_get_count_free_elements(self->in_buf) == self->in_nb * self->in_bs);
+            log_assert(ring_get_count_free_elements(self->in_buf) == self->in_nb * self->in_bs);
+        }
 
-    if (src)
-    {
-        log_assert(src->out_sz == self->in_sz);
-        src->out_ch_s = self->in_ch_s;
-        src->out_buf = self->in_buf;
+        if (self->rt)
+        {
+            self->in_msgs = ring_create_in(link_arena, sizeof(link_msg_t), LINK_MSG_QUEUE_LEN);
+            log_assert(self->in_msgs);
+            self->in_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            log_assert(self->in_efd >= 0);
+            self->task = runtime_task_create(self->rt, link_task, self);
+            log_assert(self->task);
+        }
     }
     else
     {
-        self->out_ch_s = -1;
-        self->out_buf = NULL;
+        self->in_buf = NULL;
+    }
+
+    if (self->in_buf)
+    {
+        self->seen = ring_get_head(self->in_buf);
+    }
+
+    if (src)
+    {
+        log_assert(src->out_sz == self->in_sz);
+        log_assert(self->in_buf);
+        // handlers write straight into the ring, so a whole output block must fit
+        log_assert(src->out_bs <= ring_get_count(self->in_buf));
+        if (src->out_n == 0)
+        {
+            src->out_buf = ring_attach(self->in_buf, false);
+            log_assert(src->out_buf);
+            src->out_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            log_assert(src->out_efd >= 0);
+        }
+        src->out_links[src->out_n++] = self;
     }
 
     if (src)
@@ -64,92 +311,859 @@ link_t *link_connect(const char *name, link_t *src, size_t in_nb,
     {
         LOG(DEBUG, "Link '%s' created", self->name);
     }
+    link_register(self);
 
     return self;
 }
 
-coroutine void link_run(link_t *self, void *ctx, link_handler_t handler)
+link_t *link_connect(const char *name, link_t *src, size_t in_nb,
+                     size_t in_bs, size_t in_sz,
+                     size_t out_bs, size_t out_sz)
 {
-    int ret;
-    size_t n, read = 0;
-    link_msg_t in_msg, out_msg;
+    return link_connect_with(name, src, in_nb, in_bs, in_sz, out_bs, out_sz, NULL);
+}
 
-    dlg_assertm(self->in_buf &&
-                    (self->in_ch_r >= 0) &&
-                    (self->in_ch_s >= 0),
-                "Initial links cannot be run !!!");
+link_t *link_connect_ring(const char *name, link_t *src, ring_t *ring, size_t bs)
+{
+    log_assert((ring_get_count(ring) % bs) == 0);
+    return link_connect_with(name, src, ring_get_count(ring) / bs, bs, src->out_sz, bs, src->out_sz, ring);
+}
 
-    uint8_t *out_p = malloc(self->out_sz * self->out_bs);
-    log_assert(out_p);
+void link_set_policy(link_t *self, link_policy_e policy)
+{
+    log_assert(self->in_buf);
+    log_assert(!self->handler);
 
-    uint8_t *in_p = malloc(self->in_bs * self->in_sz);
-    log_assert(in_p);
+    if (policy == LINK_POLICY_DROP_NEWEST)
+    {
+        // the source throws away what it produces, for all of its consumers
+        link_t *src = self->in_link;
+        dlg_assertm(src->out_n == 1, "Link '%s' is tee'd, it cannot drop the newest blocks", self->name);
+        if (!src->drop_buf)
+        {
+            src->drop_buf = link_alloc(src->out_bs * src->out_sz);
+        }
+    }
 
-    LOG(DEBUG, "Running link '%s'", self->name);
+    self->policy = policy;
+    ring_set_drop(self->in_buf, ((policy == LINK_POLICY_DROP_OLDEST) ||
+                                 (policy == LINK_POLICY_MAX_LATENCY)) ? self->in_bs : 0);
+}
 
-    while (true)
+void link_set_max_latency(link_t *self, size_t rate, unsigned int ms)
+{
+    link_set_policy(self, LINK_POLICY_MAX_LATENCY);
+
+    // never less than one block
+    self->max_queued = (rate * ms) / 1000;
+    if (self->max_queued < self->in_bs)
+    {
+        self->max_queued = self->in_bs;
+    }
+    LOG(INFO, "Link '%s' keeps at most %u ms (%lu elements) of input", self->name, ms, self->max_queued);
+}
+
+static void link_count_drop(link_t *self, size_t count)
+{
+    if (count)
+    {
+        LOG(DEBUG, "Link '%s' dropped %lu elements", self->name, count);
+        self->dropped += count;
+        self->drops++;
+    }
+}
+
+// Drops the oldest whole blocks of input beyond the latency bound of a
+// MAX_LATENCY link, to be called by whoever owns the input tail
+size_t link_trim(link_t *self)
+{
+    if (self->policy != LINK_POLICY_MAX_LATENCY)
+    {
+        return 0;
+    }
+
+    log_assert(!self->held);
+    size_t dropped = ring_acquire(self->in_buf);
+    size_t waiting = ring_get_count_waiting_elements(self->in_buf);
+    size_t skip = 0;
+    if (waiting > self->max_queued)
+    {
+        skip = ((waiting - self->max_queued + self->in_bs - 1) / self->in_bs) * self->in_bs;
+        if (skip > waiting)
+        {
+            skip = waiting;
+        }
+    }
+    ring_release(self->in_buf, skip);
+
+    link_count_drop(self, dropped + skip);
+    if (skip)
+    {
+        link_credit(self);
+    }
+
+    return dropped + skip;
+}
+
+void link_set_coalesce(link_t *self, bool coalesce)
+{
+    log_assert(self->in_buf);
+    log_assert(!self->handler);
+    // message boundaries are lost, only links working on fixed blocks can do it
+    log_assert(!self->async);
+
+    self->coalesce = coalesce;
+}
+
+size_t link_format_size(link_format_e fmt)
+{
+    switch (fmt)
+    {
+    case LINK_FMT_F32:
+        return sizeof(float);
+    case LINK_FMT_CF32:
+        return 2 * sizeof(float);
+    case LINK_FMT_CS16:
+        return 2 * sizeof(int16_t);
+    case LINK_FMT_CS8:
+        return 2 * sizeof(int8_t);
+    default:
+        return 0;
+    }
+}
+
+const char *link_format_name(link_format_e fmt)
+{
+    switch (fmt)
+    {
+    case LINK_FMT_F32:
+        return "F32";
+    case LINK_FMT_CF32:
+        return "CF32";
+    case LINK_FMT_CS16:
+        return "CS16";
+    case LINK_FMT_CS8:
+        return "CS8";
+    default:
+        return "RAW";
+    }
+}
+
+void link_set_format(link_t *self, link_format_e fmt)
+{
+    dlg_assertm((fmt == LINK_FMT_RAW) || (link_format_size(fmt) == self->out_sz),
+                "Link '%s' elements are %lu bytes, not %s", self->name, self->out_sz, link_format_name(fmt));
+    self->out_fmt = fmt;
+}
+
+static void link_notify(link_t *self)
+{
+    if (!runtime_task_schedule(self->task))
+    {
+        // not run by the runtime, wake up the coroutine waiting in 'link_recv'
+        uint64_t v = 1;
+        ssize_t sz = write(self->in_efd, &v, sizeof(v));
+        log_assert(sz == sizeof(v));
+    }
+}
+
+static bool link_can_send(link_t *self, size_t count)
+{
+    // makes room for 'count' elements, dropping old input of the
+    // consumers that allow it
+    if (!ring_reserve(self->out_buf, count))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < self->out_n; i++)
     {
-        ret = chrecv(self->in_ch_r, &in_msg, sizeof(link_msg_t), -1);
+        link_t *dst = self->out_links[i];
+        if (dst->rt && !dst->closed && !dst->coalesce && (dst->policy == LINK_POLICY_BLOCK) &&
+            (ring_get_count_free_elements(dst->in_msgs) == 0))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+uint64_t link_now_ns(void)
+{
+    return latency_now_ns();
+}
+
+// Announces that the producer waits for credits, returns false when room
+// showed up meanwhile and there is nothing to wait for
+static bool link_stall(link_t *self, size_t count)
+{
+    atomic_store(&self->stalled, true);
+    if (link_can_send(self, count))
+    {
+        atomic_store(&self->stalled, false);
+        return false;
+    }
+
+    if (self->stall_start == 0)
+    {
+        self->stalls++;
+        self->stall_start = link_now_ns();
+        trace_instant(self->name, "stall", count);
+    }
+
+    return true;
+}
+
+static void link_unstall(link_t *self)
+{
+    if (self->stall_start)
+    {
+        self->stall_ns += link_now_ns() - self->stall_start;
+        self->stall_start = 0;
+    }
+}
+
+// Called by consumers after they made room, wakes up a stalled producer
+static void link_credit(link_t *self)
+{
+    link_t *src = self->in_link;
+
+    if (!src)
+    {
+        return;
+    }
+
+    // pairs with the store in 'link_stall', the released tail must be
+    // visible before we look at the flag
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&src->stalled, memory_order_relaxed) &&
+        atomic_exchange(&src->stalled, false))
+    {
+        if ((!src->task || !runtime_task_schedule(src->task)) && (src->out_efd >= 0))
+        {
+            uint64_t v = 1;
+            ssize_t sz = write(src->out_efd, &v, sizeof(v));
+            log_assert(sz == sizeof(v));
+        }
+    }
+}
+
+// The only consumer would rather lose new blocks than wait for room
+static bool link_drops_newest(link_t *self)
+{
+    return (self->out_n == 1) && (self->out_links[0]->policy == LINK_POLICY_DROP_NEWEST) &&
+           !self->out_links[0]->closed;
+}
+
+// Throws away 'count' elements the producer wrote to 'drop_buf', the
+// consumer sees the jump in the sample index
+static void link_drop_newest(link_t *self, size_t count)
+{
+    link_count_drop(self->out_links[0], count);
+    self->out_index += count;
+}
+
+int link_wait_send(link_t *self, size_t count, int64_t deadline)
+{
+    log_assert(count <= ring_get_count(self->out_buf));
+
+    if (link_drops_newest(self) && !link_can_send(self, count))
+    {
+        // the caller writes to 'drop_buf' instead, see link_discard
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    while (link_stall(self, count))
+    {
+        uint64_t v;
+        int ret = fdin(self->out_efd, deadline);
         if (ret != 0)
+        {
+            atomic_store(&self->stalled, false);
+            link_unstall(self);
+            return ret;
+        }
+        ssize_t sz = read(self->out_efd, &v, sizeof(v));
+        log_assert((sz == sizeof(v)) || (errno == EAGAIN));
+    }
+    link_unstall(self);
+
+    return 0;
+}
+
+// Accounts for a block a source wrote to 'drop_buf' after link_wait_send
+// failed with ENOBUFS
+void link_discard(link_t *self, size_t count)
+{
+    link_drop_newest(self, count);
+}
+
+// Only these policies let the producer move our tail
+static bool link_droppable(link_t *self)
+{
+    return (self->policy == LINK_POLICY_DROP_OLDEST) || (self->policy == LINK_POLICY_MAX_LATENCY);
+}
+
+// Keeps the producer from dropping the input until link_release, for
+// consumers reading straight out of the ring, returns what is waiting
+size_t link_acquire(link_t *self)
+{
+    log_assert(!self->held);
+    size_t dropped = ring_acquire(self->in_buf);
+    link_count_drop(self, dropped);
+    self->held = true;
+
+    return ring_get_count_waiting_elements(self->in_buf);
+}
+
+void link_release(link_t *self, size_t count)
+{
+    log_assert(self->held);
+    self->held = false;
+    ring_release(self->in_buf, count);
+    if (count)
+    {
+        trace_instant(self->name, "consume", count);
+        link_credit(self);
+    }
+}
+
+size_t link_consume(link_t *self, void *dest, size_t max_count)
+{
+    size_t n;
+
+    if (!self->held && link_droppable(self))
+    {
+        // the copy must not race with the producer dropping the same block
+        link_acquire(self);
+        n = ring_consume(self->in_buf, dest, max_count);
+        link_release(self, 0);
+    }
+    else
+    {
+        n = ring_consume(self->in_buf, dest, max_count);
+    }
+    if (n)
+    {
+        trace_instant(self->name, "consume", n);
+        link_credit(self);
+    }
+
+    return n;
+}
+
+// Drops the input elements queued before the last retune tag of a coalesced link
+size_t link_flush(link_t *self)
+{
+    size_t stale = self->retune_pos - ring_get_tail(self->in_buf);
+    if ((ssize_t)stale <= 0)
+    {
+        return 0;
+    }
+
+    return link_consume(self, NULL, stale);
+}
+
+// Takes everything published since the last call, re-arming notifications first
+static size_t link_take(link_t *self)
+{
+    atomic_store(&self->notified, false);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    size_t head = ring_get_head(self->in_buf);
+    size_t n = head - self->seen;
+    self->seen = head;
+
+    return n;
+}
+
+static int link_deliver_coalesced(link_t *dst, const link_msg_t *msg)
+{
+    atomic_store_explicit(&dst->origin_ns, msg->origin_ns, memory_order_relaxed);
+    if (msg->flags & LINK_MSG_RETUNE)
+    {
+        // the elements of this message are already in the ring
+        dst->retune_pos = ring_get_head(dst->in_buf) - msg->len;
+        atomic_store_explicit(&dst->retune, true, memory_order_release);
+    }
+
+    // the ring head already tells what is there, one wakeup is enough
+    // until the consumer comes back for more
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_exchange(&dst->notified, true))
+    {
+        return 0;
+    }
+
+    if (!dst->rt)
+    {
+        // a consumer that is not waiting checks the ring before it does
+        int ret = chsend(dst->in_ch_s, msg, sizeof(link_msg_t), 0);
+        if ((ret != 0) && (errno == ETIMEDOUT))
+        {
+            ret = 0;
+        }
+        return ret;
+    }
+
+    link_notify(dst);
+
+    return 0;
+}
+
+static int link_deliver(link_t *dst, const link_msg_t *msg)
+{
+    bool lossy = (dst->policy != LINK_POLICY_BLOCK);
+
+    if (dst->coalesce)
+    {
+        return link_deliver_coalesced(dst, msg);
+    }
+
+    if (!dst->rt)
+    {
+        // a lossy consumer that is not waiting misses the notification,
+        // it picks up the data with the next one
+        int ret = chsend(dst->in_ch_s, msg, sizeof(link_msg_t), lossy ? 0 : -1);
+        if ((ret != 0) && lossy && (errno == ETIMEDOUT))
+        {
+            ret = 0;
+        }
+        return ret;
+    }
+
+    while (ring_insert(dst->in_msgs, msg, 1) == 0)
+    {
+        if (lossy)
         {
             break;
         }
-        LOG(DEBUG, "Link '%s' (%p) received %lu elements with id %d", self->name, self->in_buf, in_msg.len, in_msg.id);
-        read += in_msg.len;
+        // runtime tasks check for room up front, only coroutines get here
+        int ret = yield();
+        if (ret != 0)
+        {
+            return ret;
+        }
+    }
+    link_notify(dst);
+
+    return 0;
+}
+
+int link_send(link_t *self, const link_msg_t *msg)
+{
+    size_t open = 0;
+    link_msg_t m = *msg;
+
+    log_assert(self->out_n > 0);
 
-        while (read >= (self->async ? in_msg.len : self->in_bs))
+    m.index = self->out_index;
+    self->out_index += m.len;
+    self->sent += m.len;
+    trace_instant(self->name, "send", m.len);
+
+    for (size_t i = 0; i < self->out_n; i++)
+    {
+        link_t *dst = self->out_links[i];
+
+        if (dst->closed)
         {
-            if(!self->async){
-                in_msg.len = self->in_bs;
-            }
-            n = lws_ring_consume(self->in_buf, NULL, in_p, in_msg.len);
-            log_assert(n == in_msg.len);
+            continue;
+        }
+
+        int ret = link_deliver(dst, &m);
+        if (ret == 0)
+        {
+            open++;
+        }
+        else if (errno == EPIPE)
+        {
+            dst->closed = true;
+        }
+        else
+        {
+            return ret;
+        }
+    }
 
-            bool finished = false;
+    // keep going as long as somebody is listening
+    if (open == 0)
+    {
+        errno = EPIPE;
+        return -1;
+    }
+
+    return 0;
+}
 
-            while (!finished)
+// Checks the message against the elements received so far
+static void link_account(link_t *self, const link_msg_t *msg)
+{
+    if ((msg->flags & LINK_MSG_GAP) || (self->in_synced && (msg->index != self->in_next)))
+    {
+        LOG(DEBUG, "Link '%s' gap at %lu, expected %lu", self->name, msg->index, self->in_next);
+        self->gaps++;
+        self->pending |= LINK_MSG_GAP;
+    }
+    self->in_next = msg->index + msg->len;
+    self->in_synced = true;
+    self->received += msg->len;
+    link_note_queued(self);
+    link_note_origin(self, msg->origin_ns);
+    trace_instant(self->name, "recv", msg->len);
+}
+
+static int link_recv_coalesced(link_t *self, link_msg_t *msg, int64_t deadline)
+{
+    int ret;
+
+    size_t start = self->seen;
+
+    while ((msg->len = link_take(self)) == 0)
+    {
+        if (!self->rt)
+        {
+            link_msg_t m;
+            ret = chrecv(self->in_ch_r, &m, sizeof(link_msg_t), deadline);
+        }
+        else
+        {
+            uint64_t v;
+            ret = fdin(self->in_efd, deadline);
+            if (ret == 0)
             {
-                out_msg.len = 0;
-                finished = handler(ctx, in_p, &in_msg, out_p, &out_msg);
-                log_assert((out_msg.len * self->out_sz) <= (self->out_bs * self->out_sz));
-                if (out_msg.len)
-                {
-                    LOG(DEBUG, "Sending out %lu elements with id %d from link '%s'", out_msg.len, out_msg.id, self->name);
-                    while (true)
-                    {
-                        n = lws_ring_get_count_free_elements(self->out_buf);
-                        if (n >= out_msg.len)
-                        {
-                            break;
-                        }
-                        LOG(WARN, "Cannot write to output");
-                        ret = yield();
-                        log_assert(ret == 0);
-                    }
-                    n = lws_ring_insert(self->out_buf, out_p, out_msg.len);
-                    log_assert(n == out_msg.len);
-                    ret = chsend(self->out_ch_s, &out_msg, sizeof(link_msg_t), -1);
-                    if (ret != 0)
-                    {
-                        goto exit;
-                    }
-                }
+                ssize_t sz = read(self->in_efd, &v, sizeof(v));
+                log_assert((sz == sizeof(v)) || (errno == EAGAIN));
             }
-            read -= in_msg.len;
+        }
+
+        if (ret != 0)
+        {
+            return ret;
         }
     }
+    self->received += msg->len;
+    link_note_queued(self);
+    trace_instant(self->name, "recv", msg->len);
+    // there is no message per block, the ring position is all there is
+    msg->id = 0;
+    msg->flags = 0;
+    msg->index = start;
+    msg->time_ns = 0;
+    msg->origin_ns = atomic_load_explicit(&self->origin_ns, memory_order_relaxed);
+    link_note_origin(self, msg->origin_ns);
+    if (atomic_exchange_explicit(&self->retune, false, memory_order_acquire))
+    {
+        // 'retune_pos' tells where the new frequency starts, link_flush
+        // drops what came before
+        msg->flags |= LINK_MSG_RETUNE;
+    }
 
-exit:
-    LOG(DEBUG, "Stopping link '%s'", self->name);
+    return 0;
+}
+
+int link_recv(link_t *self, link_msg_t *msg, int64_t deadline)
+{
+    if (self->coalesce)
+    {
+        return link_recv_coalesced(self, msg, deadline);
+    }
+
+    if (!self->rt)
+    {
+        int ret = chrecv(self->in_ch_r, msg, sizeof(link_msg_t), deadline);
+        if (ret == 0)
+        {
+            link_account(self, msg);
+        }
+        return ret;
+    }
+
+    while (ring_consume(self->in_msgs, msg, 1) == 0)
+    {
+        uint64_t v;
+        int ret = fdin(self->in_efd, deadline);
+        if (ret != 0)
+        {
+            return ret;
+        }
+        ssize_t sz = read(self->in_efd, &v, sizeof(v));
+        log_assert((sz == sizeof(v)) || (errno == EAGAIN));
+    }
+    link_account(self, msg);
+    link_credit(self);
+
+    return 0;
+}
+
+void link_close(link_t *self)
+{
+    int ret;
+
+    LOG(DEBUG, "Closing link '%s'", self->name);
+
+    self->closed = true;
+    link_unregister(self);
 
     ret = chdone(self->in_ch_s);
     log_assert(ret == 0);
 
     ret = hclose(self->in_ch_s);
     log_assert(ret == 0);
-    lws_ring_destroy(self->in_buf);
-    free(in_p);
-    free(out_p);
 
+    if (self->in_efd >= 0)
+    {
+        fdclean(self->in_efd);
+        ret = close(self->in_efd);
+        log_assert(ret == 0);
+        self->in_efd = -1;
+    }
+    ring_destroy(&self->in_msgs);
+    ring_destroy(&self->in_buf);
+    ring_destroy(&self->out_buf);
+
+    // a producer waiting on us would never get its credits otherwise
+    link_credit(self);
+
+    atomic_store(&self->stalled, false);
+    if (self->out_efd >= 0)
+    {
+        fdclean(self->out_efd);
+        ret = close(self->out_efd);
+        log_assert(ret == 0);
+        self->out_efd = -1;
+    }
+
+    if (self->drop_buf)
+    {
+        link_free(self->drop_buf);
+        self->drop_buf = NULL;
+    }
+
+    if (self->stalls || self->dropped || self->gaps)
+    {
+        LOG(INFO, "Link '%s' stalled %lu times for %.3f ms, dropped %lu elements in %lu drops, %lu gaps", self->name,
+            self->stalls, self->stall_ns / 1e6, self->dropped, self->drops, self->gaps);
+    }
+    if (self->latency.count)
+    {
+        char what[64];
+        snprintf(what, sizeof(what), "from the source to '%s'", self->name);
+        latency_log(&self->latency, what);
+    }
+}
+
+static int link_process(link_t *self)
+{
+    int ret;
+    link_view_t in, out;
+
+    while (true)
+    {
+        link_trim(self);
+        // the input cannot be dropped under our feet until it is released
+        size_t dropped = ring_acquire(self->in_buf);
+        if (self->policy != LINK_POLICY_BLOCK)
+        {
+            // messages may have been skipped, the ring tells what is really there
+            log_assert(!self->async);
+            link_count_drop(self, dropped);
+            self->read = ring_get_count_waiting_elements(self->in_buf);
+        }
+
+        if (self->read < (self->async ? self->in_msg.len : self->in_bs))
+        {
+            ring_release(self->in_buf, 0);
+            break;
+        }
+
+        if(!self->async){
+            self->in_msg.len = self->in_bs;
+        }
+        if (self->in_msg.flags & LINK_MSG_RETUNE)
+        {
+            // passed on with the first block that comes out of the new input
+            self->pending |= LINK_MSG_RETUNE;
+        }
+        log_assert(ring_get_count_waiting_elements(self->in_buf) >= self->in_msg.len);
+        in.buf = ring_get_read_ptr(self->in_buf);
+        in.msg = self->in_msg;
+
+        bool finished = false;
+
+        while (!finished)
+        {
+            // the handler can be called again with the same input once there is room
+            bool drop = false;
+            if (!link_can_send(self, self->out_bs))
+            {
+                if (!link_drops_newest(self))
+                {
+                    ring_release(self->in_buf, 0);
+                    return LINK_BLOCKED;
+                }
+                drop = true;
+            }
+            link_unstall(self);
+
+            out.buf = drop ? self->drop_buf : ring_get_write_ptr(self->out_buf);
+            out.msg.len = 0;
+            out.msg.id = 0;
+            out.msg.flags = (self->in_msg.flags & LINK_MSG_HAS_TIME) | self->pending;
+            out.msg.time_ns = self->in_msg.time_ns;
+            out.msg.origin_ns = self->in_msg.origin_ns;
+            uint64_t start = link_metrics ? link_cpu_ns() : 0;
+            uint64_t span = trace_begin();
+            finished = self->handler(self->ctx, &in, &out);
+            trace_complete(self->name, "handler", span);
+            if (link_metrics)
+            {
+                self->handler_ns += link_cpu_ns() - start;
+            }
+            log_assert(out.msg.len <= self->out_bs);
+            if (out.msg.len && drop)
+            {
+                link_drop_newest(self, out.msg.len);
+            }
+            else if (out.msg.len)
+            {
+                LOG(DEBUG, "Sending out %lu elements with id %d from link '%s'", out.msg.len, out.msg.id, self->name);
+                ring_bump_head(self->out_buf, out.msg.len);
+                ret = link_send(self, &out.msg);
+                self->pending = 0;
+                if (ret != 0)
+                {
+                    ring_release(self->in_buf, 0);
+                    return LINK_CLOSED;
+                }
+            }
+        }
+        ring_release(self->in_buf, self->in_msg.len);
+        trace_instant(self->name, "consume", self->in_msg.len);
+        link_credit(self);
+        self->read -= self->in_msg.len;
+        // only the first block after the tag starts from scratch
+        self->in_msg.flags &= ~LINK_MSG_RETUNE;
+    }
+
+    return LINK_IDLE;
+}
+
+static void link_task(void *arg)
+{
+    int state;
+    link_t *self = (link_t *)arg;
+
+    while ((state = link_process(self)) == LINK_IDLE)
+    {
+        if (self->coalesce)
+        {
+            size_t n = link_take(self);
+            if (n == 0)
+            {
+                return;
+            }
+            self->received += n;
+            link_note_queued(self);
+            trace_instant(self->name, "recv", n);
+            self->in_msg.origin_ns = atomic_load_explicit(&self->origin_ns, memory_order_relaxed);
+            link_note_origin(self, self->in_msg.origin_ns);
+            if (atomic_exchange_explicit(&self->retune, false, memory_order_acquire))
+            {
+                self->in_msg.flags |= LINK_MSG_RETUNE;
+            }
+            self->read += n;
+            continue;
+        }
+
+        if (ring_consume(self->in_msgs, &self->in_msg, 1) == 0)
+        {
+            return;
+        }
+        link_account(self, &self->in_msg);
+        LOG(DEBUG, "Link '%s' (%p) received %lu elements with id %d", self->name, self->in_buf, self->in_msg.len, self->in_msg.id);
+        self->read += self->in_msg.len;
+        // the message queue has room again
+        link_credit(self);
+    }
+
+    if ((state == LINK_BLOCKED) && !link_stall(self, self->out_bs))
+    {
+        // room showed up before the consumers could see we are waiting
+        runtime_task_schedule(self->task);
+    }
+}
+
+static bool link_shim(void *ctx, const link_view_t *in, link_view_t *out)
+{
+    link_shim_t *shim = (link_shim_t *)ctx;
+    return shim->handler(shim->ctx, in->buf, &in->msg, out->buf, &out->msg);
+}
+
+coroutine void link_run(link_t *self, void *ctx, link_handler_t handler)
+{
+    link_shim_t shim = {
+        .ctx = ctx,
+        .handler = handler};
+
+    link_run_view(self, &shim, link_shim);
+}
+
+coroutine void link_run_view(link_t *self, void *ctx, link_view_handler_t handler)
+{
+    int ret;
+
+    dlg_assertm(self->in_buf &&
+                    (self->in_ch_r >= 0) &&
+                    (self->in_ch_s >= 0),
+                "Initial links cannot be run !!!");
+
+    self->ctx = ctx;
+    self->handler = handler;
+
+    LOG(DEBUG, "Running link '%s'", self->name);
+
+    if (self->rt)
+    {
+        // the handler runs on the worker threads, this coroutine only
+        // keeps the link alive until it gets closed
+        runtime_task_start(self->task);
+        ret = msleep(-1);
+        log_assert(ret != 0);
+        runtime_task_stop(self->task);
+    }
+    else
+    {
+        while (true)
+        {
+            ret = link_recv(self, &self->in_msg, -1);
+            if (ret != 0)
+            {
+                break;
+            }
+            LOG(DEBUG, "Link '%s' (%p) received %lu elements with id %d", self->name, self->in_buf, self->in_msg.len, self->in_msg.id);
+            self->read += self->in_msg.len;
+
+            while ((ret = link_process(self)) == LINK_BLOCKED)
+            {
+                // sleep until the consumers hand out credits
+                if (link_wait_send(self, self->out_bs, -1) != 0)
+                {
+                    ret = LINK_CLOSED;
+                    break;
+                }
+            }
+
+            if (ret == LINK_CLOSED)
+            {
+                break;
+            }
+        }
+    }
+
+    LOG(DEBUG, "Stopping link '%s'", self->name);
+    link_close(self);
     LOG(DEBUG, "Exiting link '%s'", self->name);
-}
\ No newline at end of file
+}
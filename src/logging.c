@@ -1,18 +1,312 @@
+#define _GNU_SOURCE
+
 #include "logging.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <sched.h>
+
 #include <dlg/output.h>
 
+// slots of the queue, a power of 2
+#define QUEUE_LEN (1024)
+#define MSG_SIZE (256)
+#define FORMAT_SIZE (64)
+// how often the background thread looks at the queue
+#define PERIOD_NS (10 * 1000 * 1000)
+
+// Slot of the bounded multi producer queue, 'seq' tells whose turn it is:
+// the producer of position 'pos' waits for 'pos', the consumer for 'pos + 1'
+typedef struct
+{
+    _Atomic size_t seq;
+    int level;
+    const char *file;
+    unsigned int line;
+    const char *func;
+    struct timespec ts;
+    uint32_t suppressed;
+    char msg[MSG_SIZE];
+} logging_entry_t;
+
 static dlg_handler old_handler;
 static void* old_data;
 
+static logging_entry_t queue[QUEUE_LEN];
+static _Atomic size_t enqueue_pos;
+static size_t dequeue_pos;
+// held by whoever drains the queue, the background thread or a flush
+static atomic_flag draining = ATOMIC_FLAG_INIT;
+static _Atomic size_t lost;
+// callsites that suppressed messages, for the summaries
+static logging_site_t *_Atomic sites;
+static _Atomic bool started;
+static _Atomic bool stopping;
+static pthread_t thread;
+
+static const char *no_tags[] = {NULL};
+
+static void logging_print(const struct timespec *ts, int level, const char *file, unsigned int line,
+                          const char *func, const char *msg)
+{
+    struct tm tm;
+    char format[FORMAT_SIZE];
+    struct dlg_origin origin = {
+        .file = file,
+        .line = line,
+        .func = func,
+        .level = (enum dlg_level)level,
+        .tags = no_tags,
+        .expr = NULL};
+
+    // the time the message was logged, not the time it gets printed
+    localtime_r(&ts->tv_sec, &tm);
+    snprintf(format, sizeof(format), "[%02d:%02d:%02d:%03ld {%%t} %%f] %%s%%c\n",
+             tm.tm_hour, tm.tm_min, tm.tm_sec, ts->tv_nsec / 1000000);
+    dlg_generic_outputf_stream(stdout, format, &origin, msg, dlg_default_output_styles, false);
+}
+
 static void custom_handler(const struct dlg_origin *origin, const char *string, void *data)
 {
     (void)data;
+    // dlg asserts and direct dlg calls, printed right away after what is queued
+    logging_flush();
     dlg_generic_outputf_stream(stdout, "[%h:%m {%t} %f] %s%c\n", origin, string, dlg_default_output_styles, false);
 }
 
+// Summaries of the callsites that were quiet since their last suppressed
+// message, the others report with their next message unless it is 'final'
+static void logging_summarize(const struct timespec *now, bool final)
+{
+    struct timespec coarse;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &coarse);
+
+    for (logging_site_t *s = atomic_load(&sites); s; s = s->next)
+    {
+        if ((!final && (__atomic_load_n(&s->window, __ATOMIC_RELAXED) == (uint64_t)coarse.tv_sec)) ||
+            (__atomic_load_n(&s->suppressed, __ATOMIC_RELAXED) == 0))
+        {
+            continue;
+        }
+
+        uint32_t n = __atomic_exchange_n(&s->suppressed, 0, __ATOMIC_RELAXED);
+        if (n)
+        {
+            char msg[MSG_SIZE];
+            snprintf(msg, sizeof(msg), "%u similar messages suppressed", n);
+            logging_print(now, s->level, s->file, s->line, s->func, msg);
+        }
+    }
+}
+
+// Prints everything queued, returns false when somebody else is at it
+static bool logging_drain(bool final)
+{
+    struct timespec now;
+
+    if (atomic_flag_test_and_set_explicit(&draining, memory_order_acquire))
+    {
+        return false;
+    }
+
+    while (true)
+    {
+        logging_entry_t *e = &queue[dequeue_pos & (QUEUE_LEN - 1)];
+        if (atomic_load_explicit(&e->seq, memory_order_acquire) != (dequeue_pos + 1))
+        {
+            break;
+        }
+
+        logging_print(&e->ts, e->level, e->file, e->line, e->func, e->msg);
+        if (e->suppressed)
+        {
+            char msg[MSG_SIZE];
+            snprintf(msg, sizeof(msg), "%u similar messages suppressed before", e->suppressed);
+            logging_print(&e->ts, e->level, e->file, e->line, e->func, msg);
+        }
+        atomic_store_explicit(&e->seq, dequeue_pos + QUEUE_LEN, memory_order_release);
+        dequeue_pos++;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    logging_summarize(&now, final);
+    size_t n = atomic_exchange(&lost, 0);
+    if (n)
+    {
+        char msg[MSG_SIZE];
+        snprintf(msg, sizeof(msg), "%lu log messages lost, the queue was full", n);
+        logging_print(&now, dlg_level_warn, __FILE__, __LINE__, __func__, msg);
+    }
+    fflush(stdout);
+
+    atomic_flag_clear_explicit(&draining, memory_order_release);
+
+    return true;
+}
+
+static void *logging_thread(void *arg)
+{
+    (void)arg;
+    struct timespec period = {.tv_sec = 0, .tv_nsec = PERIOD_NS};
+
+    pthread_setname_np(pthread_self(), "logging");
+
+    while (!atomic_load(&stopping))
+    {
+        logging_drain(false);
+        nanosleep(&period, NULL);
+    }
+
+    return NULL;
+}
+
+static void logging_drain_all(bool final)
+{
+    if (!atomic_load(&started))
+    {
+        return;
+    }
+
+    while (!logging_drain(final))
+    {
+        sched_yield();
+    }
+}
+
+void logging_flush(void)
+{
+    logging_drain_all(false);
+}
+
+static void logging_stop(void)
+{
+    atomic_store(&stopping, true);
+    pthread_join(thread, NULL);
+    logging_drain_all(true);
+}
+
+// Takes the message unless the callsite already printed its share of this
+// second, 'suppressed' gets what was held back in the previous one
+static bool logging_admit(logging_site_t *site, int level, const char *file, unsigned int line,
+                          const char *func, uint32_t *suppressed)
+{
+    struct timespec coarse;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &coarse);
+    uint64_t window = coarse.tv_sec;
+
+    *suppressed = 0;
+    uint64_t old = __atomic_load_n(&site->window, __ATOMIC_RELAXED);
+    if ((old != window) &&
+        __atomic_compare_exchange_n(&site->window, &old, window, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+        *suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+    }
+
+    if (__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) <= LOGGING_RATE)
+    {
+        return true;
+    }
+
+    __atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+    if (__atomic_exchange_n(&site->listed, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        // first time over the limit, the background thread reports the
+        // suppressed messages once the callsite is quiet
+        site->level = level;
+        site->file = file;
+        site->line = line;
+        site->func = func;
+        site->next = atomic_load(&sites);
+        while (!atomic_compare_exchange_weak(&sites, &site->next, site))
+        {
+        }
+    }
+
+    return false;
+}
+
+void logging_write(logging_site_t *site, int level, const char *file, unsigned int line, const char *func,
+                   const char *format, ...)
+{
+    va_list args;
+    uint32_t suppressed;
+    logging_entry_t *e;
+
+    if (!logging_admit(site, level, file, line, func, &suppressed))
+    {
+        return;
+    }
+
+    if (!atomic_load_explicit(&started, memory_order_acquire))
+    {
+        // before logging_init there is nobody to print the queue
+        char msg[MSG_SIZE];
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        va_start(args, format);
+        vsnprintf(msg, sizeof(msg), format, args);
+        va_end(args);
+        logging_print(&ts, level, file, line, func, msg);
+        return;
+    }
+
+    size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    while (true)
+    {
+        e = &queue[pos & (QUEUE_LEN - 1)];
+        size_t seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (dif < 0)
+        {
+            // full, waiting is not an option
+            atomic_fetch_add_explicit(&lost, 1, memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    e->level = level;
+    e->file = file;
+    e->line = line;
+    e->func = func;
+    e->suppressed = suppressed;
+    clock_gettime(CLOCK_REALTIME, &e->ts);
+    va_start(args, format);
+    vsnprintf(e->msg, sizeof(e->msg), format, args);
+    va_end(args);
+    atomic_store_explicit(&e->seq, pos + 1, memory_order_release);
+}
+
 void logging_init(void)
 {
     old_handler = dlg_get_handler(&old_data);
     dlg_set_handler(custom_handler, NULL);
+
+    for (size_t i = 0; i < QUEUE_LEN; i++)
+    {
+        atomic_init(&queue[i].seq, i);
+    }
+    int ret = pthread_create(&thread, NULL, logging_thread, NULL);
+    log_assert(ret == 0);
+    atomic_store_explicit(&started, true, memory_order_release);
+    // whatever is queued when the application exits still gets printed
+    atexit(logging_stop);
 }
@@ -19,6 +19,7 @@ struct _mel_spectrum_t
     float *w;
     float complex *x;
     float complex *X;
+    float *power;
 };
 
 // Hann window
@@ -120,6 +121,9 @@ mel_spectrum_t *mel_spectrum_create(size_t input_size,
     self->X = malloc(input_size * sizeof(complex float));
     log_assert(self->X);
 
+    self->power = malloc(((input_size / 2) + 1) * sizeof(float));
+    log_assert(self->power);
+
     for (size_t i = 0; i < input_size; i++)
     {
         self->w[i] = hann_(i, input_size);
@@ -134,7 +138,7 @@ mel_spectrum_t *mel_spectrum_create(size_t input_size,
 void mel_spectrum_process(mel_spectrum_t *self, float const *input, float *output)
 {
     size_t i;
-    float tmp[(self->input_size / 2) + 1];
+    float *tmp = self->power;
 
     for (i = 0; i < self->input_size; i++)
     {
@@ -167,6 +171,7 @@ void mel_spectrum_destroy(mel_spectrum_t **self_p)
         free(self->w);
         free(self->x);
         free(self->X);
+        free(self->power);
         smatrixf_destroy(self->mel_mat);
         fft_destroy_plan(self->pf);
         free(self);
@@ -0,0 +1,384 @@
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+
+#include <libdill.h>
+
+#include "logging.h"
+#include "link.h"
+#include "stack_pool.h"
+
+#define MAX_ENTRIES (32)
+#define MAX_BUCKETS (16)
+#define BACKLOG (4)
+// a client gets that long to send its request and take the answer
+#define CLIENT_TIMEOUT_MS (1000)
+#define BODY_INITIAL_SIZE (4096)
+
+struct _metrics_histogram_t
+{
+    double bounds[MAX_BUCKETS];
+    size_t counts[MAX_BUCKETS + 1];
+    size_t n;
+    double sum;
+    size_t count;
+};
+
+typedef struct
+{
+    const char *name;
+    const char *help;
+    const volatile size_t *counter;
+    metrics_histogram_t *histogram;
+} metrics_entry_t;
+
+typedef struct
+{
+    char *data;
+    size_t len;
+    size_t cap;
+} metrics_body_t;
+
+// Per link series, 'get' reads the value off the link
+typedef struct
+{
+    const char *name;
+    const char *help;
+    const char *type;
+    double (*get)(link_t *);
+} metrics_link_family_t;
+
+static metrics_entry_t entries[MAX_ENTRIES];
+static size_t num_entries;
+static int listener = -1;
+static int handle = -1;
+static void *stack;
+
+void metrics_add_counter(const char *name, const char *help, const volatile size_t *value)
+{
+    if (num_entries == MAX_ENTRIES)
+    {
+        LOG(WARN, "No room for metric %s", name);
+        return;
+    }
+    entries[num_entries++] = (metrics_entry_t){.name = name, .help = help, .counter = value};
+}
+
+metrics_histogram_t *metrics_add_histogram(const char *name, const char *help,
+                                           const double *bounds, size_t n)
+{
+    log_assert(n <= MAX_BUCKETS);
+
+    metrics_histogram_t *h = (metrics_histogram_t *)calloc(1, sizeof(metrics_histogram_t));
+    log_assert(h);
+    memcpy(h->bounds, bounds, n * sizeof(double));
+    h->n = n;
+
+    if (num_entries == MAX_ENTRIES)
+    {
+        LOG(WARN, "No room for metric %s", name);
+    }
+    else
+    {
+        entries[num_entries++] = (metrics_entry_t){.name = name, .help = help, .histogram = h};
+    }
+
+    return h;
+}
+
+void metrics_observe(metrics_histogram_t *h, double value)
+{
+    size_t i = 0;
+    while ((i < h->n) && (value > h->bounds[i]))
+    {
+        i++;
+    }
+    h->counts[i]++;
+    h->sum += value;
+    h->count++;
+}
+
+void metrics_remove(const volatile void *entry)
+{
+    for (size_t i = 0; i < num_entries; i++)
+    {
+        if ((entries[i].counter == entry) || (entries[i].histogram == entry))
+        {
+            free(entries[i].histogram);
+            entries[i] = entries[--num_entries];
+            return;
+        }
+    }
+}
+
+static void body_printf(metrics_body_t *b, const char *fmt, ...)
+{
+    va_list args;
+
+    while (true)
+    {
+        va_start(args, fmt);
+        int n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, args);
+        va_end(args);
+        log_assert(n >= 0);
+        if ((size_t)n < (b->cap - b->len))
+        {
+            b->len += n;
+            return;
+        }
+        b->cap *= 2;
+        b->data = (char *)realloc(b->data, b->cap);
+        log_assert(b->data);
+    }
+}
+
+static double link_received(link_t *l)
+{
+    return l->received;
+}
+
+static double link_sent(link_t *l)
+{
+    return l->sent;
+}
+
+// Since the previous scrape
+static double link_sent_rate(link_t *l)
+{
+    uint64_t t = latency_now_ns();
+    double rate = l->rate_ns ? (l->sent - l->rate_sent) * 1e9 / (t - l->rate_ns) : 0.0;
+    l->rate_sent = l->sent;
+    l->rate_ns = t;
+    return rate;
+}
+
+static double link_queued(link_t *l)
+{
+    return l->in_buf ? ring_get_count_waiting_elements(l->in_buf) : 0;
+}
+
+static double link_queued_max(link_t *l)
+{
+    return l->queued_max;
+}
+
+static double link_capacity(link_t *l)
+{
+    return l->in_nb * l->in_bs;
+}
+
+static double link_stalls(link_t *l)
+{
+    return l->stalls;
+}
+
+static double link_stall_seconds(link_t *l)
+{
+    return l->stall_ns / 1e9;
+}
+
+static double link_dropped(link_t *l)
+{
+    return l->dropped;
+}
+
+static double link_gaps(link_t *l)
+{
+    return l->gaps;
+}
+
+static double link_handler_seconds(link_t *l)
+{
+    return l->handler_ns / 1e9;
+}
+
+static const metrics_link_family_t link_families[] = {
+    {"dsp_link_received_total", "Elements received by the link", "counter", link_received},
+    {"dsp_link_sent_total", "Elements sent by the link", "counter", link_sent},
+    {"dsp_link_sent_per_second", "Elements sent per second since the previous scrape", "gauge", link_sent_rate},
+    {"dsp_link_queued", "Input elements waiting", "gauge", link_queued},
+    {"dsp_link_queued_max", "Most input elements waiting at once", "gauge", link_queued_max},
+    {"dsp_link_capacity", "Size of the input ring in elements", "gauge", link_capacity},
+    {"dsp_link_stalls_total", "Times the producer waited for room", "counter", link_stalls},
+    {"dsp_link_stall_seconds_total", "Time the producer waited for room", "counter", link_stall_seconds},
+    {"dsp_link_dropped_total", "Input elements dropped", "counter", link_dropped},
+    {"dsp_link_gaps_total", "Discontinuities in the input", "counter", link_gaps},
+    {"dsp_link_handler_seconds_total", "CPU time of the handler", "counter", link_handler_seconds},
+};
+#define NUM_LINK_FAMILIES (sizeof(link_families) / sizeof(link_families[0]))
+
+typedef struct
+{
+    metrics_body_t *body;
+    const metrics_link_family_t *family;
+} metrics_link_arg_t;
+
+static void write_link(link_t *l, void *arg)
+{
+    metrics_link_arg_t *a = (metrics_link_arg_t *)arg;
+    body_printf(a->body, "%s{link=\"%s\"} %.9g\n", a->family->name, l->name, a->family->get(l));
+}
+
+static void write_histogram(metrics_body_t *b, const char *name, const metrics_histogram_t *h)
+{
+    size_t cumulative = 0;
+
+    for (size_t i = 0; i < h->n; i++)
+    {
+        cumulative += h->counts[i];
+        body_printf(b, "%s_bucket{le=\"%g\"} %lu\n", name, h->bounds[i], cumulative);
+    }
+    body_printf(b, "%s_bucket{le=\"+Inf\"} %lu\n", name, h->count);
+    body_printf(b, "%s_sum %.9g\n", name, h->sum);
+    body_printf(b, "%s_count %lu\n", name, h->count);
+}
+
+static void write_metrics(metrics_body_t *b)
+{
+    for (size_t i = 0; i < NUM_LINK_FAMILIES; i++)
+    {
+        metrics_link_arg_t arg = {.body = b, .family = &link_families[i]};
+        body_printf(b, "# HELP %s %s\n# TYPE %s %s\n", link_families[i].name, link_families[i].help,
+                    link_families[i].name, link_families[i].type);
+        link_foreach(write_link, &arg);
+    }
+
+    for (size_t i = 0; i < num_entries; i++)
+    {
+        const metrics_entry_t *e = &entries[i];
+        body_printf(b, "# HELP %s %s\n# TYPE %s %s\n", e->name, e->help, e->name,
+                    e->histogram ? "histogram" : "counter");
+        if (e->histogram)
+        {
+            write_histogram(b, e->name, e->histogram);
+        }
+        else
+        {
+            body_printf(b, "%s %lu\n", e->name, *e->counter);
+        }
+    }
+}
+
+static void serve(int s, metrics_body_t *body)
+{
+    char command[16];
+    char resource[256];
+    char name[256];
+    char value[256];
+    char length[32];
+    int64_t deadline = now() + CLIENT_TIMEOUT_MS;
+
+    s = http_attach(s);
+    if (s < 0)
+    {
+        return;
+    }
+    if (http_recvrequest(s, command, sizeof(command), resource, sizeof(resource), deadline) != 0)
+    {
+        hclose(s);
+        return;
+    }
+    while (http_recvfield(s, name, sizeof(name), value, sizeof(value), deadline) == 0)
+    {
+    }
+    if (errno != EPIPE)
+    {
+        hclose(s);
+        return;
+    }
+
+    body->len = 0;
+    bool found = (strcmp(command, "GET") == 0) && (strcmp(resource, "/metrics") == 0);
+    if (found)
+    {
+        write_metrics(body);
+    }
+    snprintf(length, sizeof(length), "%lu", body->len);
+
+    if ((http_sendstatus(s, found ? 200 : 404, found ? "OK" : "Not Found", deadline) != 0) ||
+        (http_sendfield(s, "Content-Type", "text/plain; version=0.0.4", deadline) != 0) ||
+        (http_sendfield(s, "Content-Length", length, deadline) != 0) ||
+        (http_sendfield(s, "Connection", "close", deadline) != 0))
+    {
+        hclose(s);
+        return;
+    }
+    s = http_detach(s, deadline);
+    if (s < 0)
+    {
+        return;
+    }
+    if (body->len)
+    {
+        bsend(s, body->data, body->len, deadline);
+    }
+    tcp_close(s, deadline);
+}
+
+// One client at a time, scrapes are rare and short
+static coroutine void metrics_server(int ls)
+{
+    metrics_body_t body = {
+        .data = (char *)malloc(BODY_INITIAL_SIZE),
+        .len = 0,
+        .cap = BODY_INITIAL_SIZE};
+    log_assert(body.data);
+
+    while (true)
+    {
+        int s = tcp_accept(ls, NULL, -1);
+        if (s < 0)
+        {
+            if (errno == ECANCELED)
+            {
+                break;
+            }
+            continue;
+        }
+        serve(s, &body);
+    }
+
+    free(body.data);
+    LOG(DEBUG, "Exiting");
+}
+
+bool metrics_start(int port)
+{
+    struct ipaddr addr;
+
+    int ret = ipaddr_local(&addr, "127.0.0.1", port, IPADDR_IPV4);
+    log_assert(ret == 0);
+    listener = tcp_listen(&addr, BACKLOG);
+    if (listener < 0)
+    {
+        LOG(ERROR, "Cannot serve metrics on port %d (%d)", port, errno);
+        return false;
+    }
+
+    link_set_metrics(true);
+    stack = stack_pool_get("metrics", STACK_SIZE_HANDLER);
+    handle = go_mem(metrics_server(listener), stack, STACK_SIZE_HANDLER);
+    log_assert(handle >= 0);
+    LOG(INFO, "Serving metrics on http://127.0.0.1:%d/metrics", port);
+
+    return true;
+}
+
+void metrics_stop(void)
+{
+    if (handle >= 0)
+    {
+        int ret = hclose(handle);
+        log_assert(ret == 0);
+        stack_pool_put(&stack);
+        handle = -1;
+        ret = hclose(listener);
+        log_assert(ret == 0);
+        listener = -1;
+        link_set_metrics(false);
+    }
+}
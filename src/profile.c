@@ -0,0 +1,109 @@
+#include "profile.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "logging.h"
+
+#define MAX_ENTRIES (32)
+#define MAX_KEY (48)
+
+typedef struct
+{
+    char key[MAX_KEY];
+    size_t value;
+} profile_entry_t;
+
+static profile_entry_t entries[MAX_ENTRIES];
+static size_t num_entries = 0;
+
+static profile_entry_t *profile_find(const char *key)
+{
+    for (size_t i = 0; i < num_entries; i++)
+    {
+        if (strncmp(entries[i].key, key, MAX_KEY) == 0)
+        {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+bool profile_load(const char *path)
+{
+    char line[128];
+    char key[MAX_KEY];
+    size_t value;
+
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        LOG(DEBUG, "No profile %s, using defaults", path);
+        return false;
+    }
+
+    size_t n = 0;
+    while (fgets(line, sizeof(line), file))
+    {
+        if ((line[0] == '#') || (line[0] == '\n'))
+        {
+            continue;
+        }
+        if ((sscanf(line, " %47[^= ] = %lu", key, &value) == 2) && (value > 0))
+        {
+            profile_set(key, value);
+            n++;
+        }
+        else
+        {
+            LOG(WARN, "Ignoring profile line: %s", line);
+        }
+    }
+    fclose(file);
+
+    LOG(INFO, "Loaded %lu settings from %s", n, path);
+    return true;
+}
+
+bool profile_save(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (!file)
+    {
+        LOG(ERROR, "Failed to write %s", path);
+        return false;
+    }
+
+    fprintf(file, "# written by autotune\n");
+    for (size_t i = 0; i < num_entries; i++)
+    {
+        fprintf(file, "%s = %lu\n", entries[i].key, entries[i].value);
+    }
+    fclose(file);
+    return true;
+}
+
+size_t profile_get(const char *key, size_t def)
+{
+    profile_entry_t *entry = profile_find(key);
+    if (entry)
+    {
+        LOG(DEBUG, "%s = %lu (default %lu)", key, entry->value, def);
+        return entry->value;
+    }
+    return def;
+}
+
+void profile_set(const char *key, size_t value)
+{
+    profile_entry_t *entry = profile_find(key);
+    if (!entry)
+    {
+        log_assert(num_entries < MAX_ENTRIES);
+        log_assert(strlen(key) < MAX_KEY);
+        entry = &entries[num_entries++];
+        strncpy(entry->key, key, MAX_KEY - 1);
+    }
+    entry->value = value;
+}
@@ -0,0 +1,249 @@
+#define _GNU_SOURCE
+
+#include "realtime.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "latency.h"
+#include "logging.h"
+
+#define PREFAULT_HEAP (16UL * 1024 * 1024)
+#define PREFAULT_STACK (256UL * 1024)
+#define MONITOR_PERIOD_NS (1000000LL)
+
+static bool enabled = false;
+static int dsp_cpu = -1;
+static int audio_cpu = -1;
+static int monitor_cpu = -1;
+
+static pthread_t monitor;
+static bool monitor_running = false;
+static _Atomic bool monitor_stop;
+static _Atomic int64_t worst_ns;
+static _Atomic uint64_t wakeups;
+
+static _Thread_local bool thread_done = false;
+
+static bool realtime_set_class(const char *name, int prio)
+{
+    struct sched_param param = {.sched_priority = prio};
+
+    int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (ret != 0)
+    {
+        LOG(WARN, "No real time class for %s (%s), needs CAP_SYS_NICE or RLIMIT_RTPRIO", name, strerror(ret));
+        return false;
+    }
+    return true;
+}
+
+static bool realtime_pin(const char *name, int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0)
+    {
+        return false;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0)
+    {
+        LOG(WARN, "Failed to pin %s to core %d (%s)", name, cpu, strerror(ret));
+        return false;
+    }
+    return true;
+}
+
+// Every core but the DSP and the audio ones, the workers spread over them
+// and never compete with the pinned threads on their cores
+static void realtime_unpin_workers(void)
+{
+    cpu_set_t set;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    CPU_ZERO(&set);
+    for (long i = 0; i < n; i++)
+    {
+        if ((i != audio_cpu) && (i != dsp_cpu))
+        {
+            CPU_SET(i, &set);
+        }
+    }
+    if (CPU_COUNT(&set) == 0)
+    {
+        // nothing left, better sharing the DSP core than none
+        CPU_SET((dsp_cpu >= 0) ? dsp_cpu : 0, &set);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void realtime_prefault(void)
+{
+    // freed memory stays with the process instead of going back unlocked
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+
+    char *heap = (char *)malloc(PREFAULT_HEAP);
+    if (heap)
+    {
+        memset(heap, 0, PREFAULT_HEAP);
+        free(heap);
+    }
+
+    volatile char stack[PREFAULT_STACK];
+    memset((char *)stack, 0, sizeof(stack));
+}
+
+// Cyclic timer above the DSP priority, the overshoot of its wakeups is
+// what real time threads see from the kernel. It runs on a core of its
+// own, on the DSP one it would preempt the thread it measures for.
+static void *realtime_monitor(void *arg)
+{
+    (void)arg;
+    struct timespec ts;
+
+    pthread_setname_np(pthread_self(), "rt_monitor");
+    realtime_pin("latency monitor", monitor_cpu);
+    realtime_set_class("latency monitor", REALTIME_PRIO_MONITOR);
+
+    int64_t next = (int64_t)latency_now_ns();
+    while (!atomic_load(&monitor_stop))
+    {
+        next += MONITOR_PERIOD_NS;
+        ts.tv_sec = next / 1000000000LL;
+        ts.tv_nsec = next % 1000000000LL;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+
+        int64_t late = (int64_t)latency_now_ns() - next;
+        if (late > atomic_load(&worst_ns))
+        {
+            atomic_store(&worst_ns, late);
+        }
+        atomic_fetch_add(&wakeups, 1);
+    }
+
+    return NULL;
+}
+
+void realtime_init(const char *cpus)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    enabled = true;
+    if (cpus)
+    {
+        if (sscanf(cpus, "%d,%d", &dsp_cpu, &audio_cpu) < 1)
+        {
+            LOG(WARN, "Ignoring core list '%s'", cpus);
+        }
+    }
+    else if (n >= 2)
+    {
+        dsp_cpu = n - 2;
+        audio_cpu = n - 1;
+    }
+    if ((dsp_cpu >= n) || (audio_cpu >= n))
+    {
+        LOG(WARN, "Only %ld cores, not pinning", n);
+        dsp_cpu = -1;
+        audio_cpu = -1;
+    }
+    // the first core left to the workers
+    monitor_cpu = -1;
+    for (int i = 0; (dsp_cpu >= 0) && (i < n); i++)
+    {
+        if ((i != dsp_cpu) && (i != audio_cpu))
+        {
+            monitor_cpu = i;
+            break;
+        }
+    }
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+    {
+        LOG(WARN, "Memory not locked (%s), check RLIMIT_MEMLOCK", strerror(errno));
+    }
+    realtime_prefault();
+
+    realtime_thread(REALTIME_DSP);
+
+    atomic_init(&monitor_stop, false);
+    atomic_init(&worst_ns, 0);
+    atomic_init(&wakeups, 0);
+    monitor_running = (pthread_create(&monitor, NULL, realtime_monitor, NULL) == 0);
+
+    if (dsp_cpu < 0)
+    {
+        LOG(INFO, "Real time mode, threads not pinned to cores");
+    }
+    else if (audio_cpu < 0)
+    {
+        LOG(INFO, "Real time mode, DSP on core %d, audio not pinned", dsp_cpu);
+    }
+    else
+    {
+        LOG(INFO, "Real time mode, DSP on core %d, audio on core %d", dsp_cpu, audio_cpu);
+    }
+}
+
+bool realtime_enabled(void)
+{
+    return enabled;
+}
+
+void realtime_thread(realtime_role_e role)
+{
+    if (!enabled || thread_done)
+    {
+        return;
+    }
+    thread_done = true;
+
+    switch (role)
+    {
+    case REALTIME_DSP:
+        realtime_pin("DSP thread", dsp_cpu);
+        realtime_set_class("DSP thread", REALTIME_PRIO_DSP);
+        break;
+
+    case REALTIME_AUDIO:
+        realtime_pin("audio thread", audio_cpu);
+        realtime_set_class("audio thread", REALTIME_PRIO_AUDIO);
+        break;
+
+    case REALTIME_WORKER:
+        realtime_unpin_workers();
+        realtime_set_class("worker", REALTIME_PRIO_DSP);
+        break;
+    }
+}
+
+void realtime_report(void)
+{
+    if (!monitor_running)
+    {
+        return;
+    }
+
+    atomic_store(&monitor_stop, true);
+    int ret = pthread_join(monitor, NULL);
+    log_assert(ret == 0);
+    monitor_running = false;
+
+    LOG(INFO, "Worst case scheduling latency: %.1f us over %lu wakeups",
+        atomic_load(&worst_ns) / 1e3, atomic_load(&wakeups));
+}
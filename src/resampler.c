@@ -1,10 +1,13 @@
 #include "resampler.h"
 
 #include <math.h>
+#include <stdint.h>
 
 #include <liquid/liquid.h>
 
 #include "logging.h"
+#include "profile.h"
+#include "stack_pool.h"
 
 struct _resampler_t
 {
@@ -15,20 +18,67 @@ struct _resampler_t
 
     link_t *output;
     int handle;
+    void *stack;
+
+    // integer input gets converted into 'conv' before anything else, float
+    // input is mixed into it, the input ring is shared with other readers
+    link_format_e fmt;
+    float complex *conv;
 };
 
-static bool resampler_handler(void *ctx, void *in_buf, const link_msg_t *in_msg,
-                              void *out_buf, link_msg_t *out_msg)
+// Plain loops over the interleaved I/Q values, simple enough for the
+// compiler to vectorize
+static void resampler_convert_cs8(float *restrict out, const int8_t *restrict in, size_t n)
+{
+    for (size_t i = 0; i < 2 * n; i++)
+    {
+        out[i] = in[i] * (1.0f / 128.0f);
+    }
+}
+
+static void resampler_convert_cs16(float *restrict out, const int16_t *restrict in, size_t n)
+{
+    for (size_t i = 0; i < 2 * n; i++)
+    {
+        out[i] = in[i] * (1.0f / 32768.0f);
+    }
+}
+
+bool resampler_handler(void *ctx, void *in_buf, const link_msg_t *in_msg,
+                       void *out_buf, link_msg_t *out_msg)
 {
     resampler_t *self = (resampler_t *)ctx;
+    float complex *x = (float complex *)in_buf;
     unsigned int n;
 
+    if (in_msg->flags & LINK_MSG_RETUNE)
+    {
+        // nothing from the old frequency may leak into the new one
+        msresamp_crcf_reset(self->resamp);
+        iirfilt_crcf_reset(self->dc_blocker);
+    }
+
+    switch (self->fmt)
+    {
+    case LINK_FMT_CS8:
+        resampler_convert_cs8((float *)self->conv, (const int8_t *)in_buf, in_msg->len);
+        x = self->conv;
+        break;
+    case LINK_FMT_CS16:
+        resampler_convert_cs16((float *)self->conv, (const int16_t *)in_buf, in_msg->len);
+        x = self->conv;
+        break;
+    default:
+        break;
+    }
+
     if (self->nco)
     {
-        self->mix(self->nco, (float complex *)in_buf, (float complex *)in_buf, in_msg->len);
+        self->mix(self->nco, x, self->conv, in_msg->len);
+        x = self->conv;
     }
 
-    msresamp_crcf_execute(self->resamp, (float complex *)in_buf, in_msg->len, (float complex *)out_buf, &n);
+    msresamp_crcf_execute(self->resamp, x, in_msg->len, (float complex *)out_buf, &n);
     out_msg->len = n;
     out_msg->id = 0;
     iirfilt_crcf_execute_block(self->dc_blocker, out_buf, out_msg->len, out_buf);
@@ -36,13 +86,14 @@ static bool resampler_handler(void *ctx, void *in_buf, const link_msg_t *in_msg,
     return true;
 }
 
-resampler_t *resampler_create(unsigned int rate, unsigned int rrate, int offset, link_t *input)
+resampler_t *resampler_create_stage(unsigned int rate, unsigned int rrate, int offset,
+                                    link_format_e fmt, size_t bs)
 {
     log_assert(rrate < rate);
     log_assert(abs(offset) < rate);
-    log_assert((input->out_bs * rrate) % rate == 0);
+    log_assert((bs * rrate) % rate == 0);
 
-    resampler_t *self = (resampler_t *)malloc(sizeof(resampler_t));
+    resampler_t *self = (resampler_t *)link_alloc(sizeof(resampler_t));
     log_assert(self);
 
     if (offset != 0)
@@ -61,7 +112,9 @@ resampler_t *resampler_create(unsigned int rate, unsigned int rrate, int offset,
             nco_crcf_set_frequency(self->nco, -f);
             self->mix = nco_crcf_mix_block_up;
         }
-    } else {
+    }
+    else
+    {
         self->nco = NULL;
     }
 
@@ -71,12 +124,50 @@ resampler_t *resampler_create(unsigned int rate, unsigned int rrate, int offset,
     self->dc_blocker = iirfilt_crcf_create_dc_blocker(0.0005);
     log_assert(self->dc_blocker);
 
-    self->output = link_connect("resampler", input, 2,
-                                input->out_bs, sizeof(complex float),
+    self->fmt = fmt;
+    self->conv = NULL;
+    if ((self->fmt == LINK_FMT_CS8) || (self->fmt == LINK_FMT_CS16) || self->nco)
+    {
+        self->conv = (float complex *)link_alloc(bs * sizeof(float complex));
+    }
+    LOG(INFO, "Resampler input format %s", link_format_name(self->fmt));
+
+    self->output = NULL;
+    self->handle = -1;
+    self->stack = NULL;
+
+    return self;
+}
+
+resampler_t *resampler_create(unsigned int rate, unsigned int rrate, int offset, link_t *input)
+{
+    return resampler_create_bounded(rate, rrate, offset, input, profile_get("resampler.in_nb", 2), 0);
+}
+
+resampler_t *resampler_create_bounded(unsigned int rate, unsigned int rrate, int offset, link_t *input,
+                                      size_t in_nb, unsigned int max_latency_ms)
+{
+    if ((input->out_fmt != LINK_FMT_CS8) && (input->out_fmt != LINK_FMT_CS16))
+    {
+        log_assert(input->out_sz == sizeof(complex float));
+    }
+
+    resampler_t *self = resampler_create_stage(rate, rrate, offset, input->out_fmt, input->out_bs);
+    log_assert(self);
+
+    self->output = link_connect("resampler", input, in_nb,
+                                input->out_bs, input->out_sz,
                                 (input->out_bs * rrate) / rate, sizeof(complex float));
     log_assert(self->output);
+    link_set_format(self->output, LINK_FMT_CF32);
+    if (max_latency_ms)
+    {
+        // the source never waits for us, we skip what we are too late for
+        link_set_max_latency(self->output, rate, max_latency_ms);
+    }
 
-    self->handle = go(link_run(self->output, self, resampler_handler));
+    self->stack = stack_pool_get("resampler", STACK_SIZE_HANDLER);
+    self->handle = go_mem(link_run(self->output, self, resampler_handler), self->stack, STACK_SIZE_HANDLER);
     log_assert(self->handle >= 0);
 
     return self;
@@ -94,15 +185,23 @@ void resampler_destroy(resampler_t **self_p)
     if (*self_p)
     {
         resampler_t *self = *self_p;
-        int ret = hclose(self->handle);
-        log_assert(ret == 0);
+        if (self->handle >= 0)
+        {
+            int ret = hclose(self->handle);
+            log_assert(ret == 0);
+            stack_pool_put(&self->stack);
+        }
         msresamp_crcf_destroy(self->resamp);
         if (self->nco)
         {
             nco_crcf_destroy(self->nco);
         }
         iirfilt_crcf_destroy(self->dc_blocker);
-        free(self);
+        if (self->conv)
+        {
+            link_free(self->conv);
+        }
+        link_free(self);
         *self_p = NULL;
     }
     LOG(DEBUG, "Destroyed");
@@ -0,0 +1,669 @@
+#define _GNU_SOURCE
+
+#include "ring.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "logging.h"
+
+// read positions are stored shifted left by one, the lowest bit is set
+// while the reader works on the data and the producer must not drop it
+#define TAIL_BUSY (1UL)
+#define TAIL_POS(_t) ((_t) >> 1)
+// the extra header of a shared ring starts on its own cache line
+#define RING_SHM_EXTRA (512UL)
+// set by the creator of a shared ring once its state is written
+#define RING_SHM_READY (0x72696e67U)
+
+// positions are free running element counters, only the producer writes
+// the head and each reader owns its tail. A reader slot is 'claimed' before
+// it is set up and shows in 'readers' once the producer may look at it.
+typedef struct
+{
+    // RING_SHM_READY once the rest can be trusted, shared rings only
+    _Atomic uint32_t ready;
+    // process that created the ring and the ones owning the reader slots,
+    // the slots of readers that died without giving them back get reclaimed
+    pid_t creator;
+    _Atomic pid_t owners[RING_MAX_READERS];
+    size_t element_len;
+    size_t count;
+    // what the readers of other processes get dropped in
+    size_t remote_bs;
+    _Atomic size_t head;
+    _Atomic size_t tails[RING_MAX_READERS];
+    size_t drop_bs[RING_MAX_READERS];
+    _Atomic size_t dropped[RING_MAX_READERS];
+    _Atomic unsigned int claimed;
+    _Atomic unsigned int readers;
+} ring_state_t;
+
+typedef struct
+{
+    uint8_t *buf;
+    void *resv;
+    size_t resv_len;
+    size_t element_len;
+    size_t count;
+    size_t size;
+    // 'local' unless the ring is shared with other processes, then the
+    // state sits in the first page of the shared object
+    ring_state_t *st;
+    ring_state_t local;
+    _Atomic int refs;
+    // the storage and the handles come from the arena when there is one
+    arena_t *arena;
+    // shared rings: mapping of the state and the extra header, the creator
+    // removes the name when it goes away
+    void *shm;
+    size_t shm_len;
+    char shm_name[RING_SHM_NAME_LEN];
+    bool shm_owner;
+} ring_core_t;
+
+struct _ring_t
+{
+    ring_core_t *core;
+    int reader;
+    size_t dropped;
+};
+
+static inline uint8_t *ring_elem_ptr(ring_core_t *core, size_t pos)
+{
+    return &core->buf[(pos * core->element_len) % core->size];
+}
+
+static bool ring_pid_alive(pid_t pid)
+{
+    return (kill(pid, 0) == 0) || (errno != ESRCH);
+}
+
+// Gives back the slots of readers whose process is gone
+static void ring_reclaim(ring_state_t *st)
+{
+    for (int r = 0; r < RING_MAX_READERS; r++)
+    {
+        pid_t pid = atomic_load(&st->owners[r]);
+        // a slot being set up has no owner yet
+        if ((pid == 0) || ring_pid_alive(pid))
+        {
+            continue;
+        }
+        if (atomic_compare_exchange_strong(&st->owners[r], &pid, 0))
+        {
+            LOG(WARN, "Reclaiming the ring reader slot %d of dead process %d", r, pid);
+            atomic_fetch_and(&st->readers, ~(1U << r));
+            atomic_fetch_and(&st->claimed, ~(1U << r));
+        }
+    }
+}
+
+// Claims a free reader slot, -1 when there is none
+static int ring_claim(ring_state_t *st)
+{
+    unsigned int claimed = atomic_load(&st->claimed);
+    int r;
+
+    // other processes may be claiming a slot at the same time
+    do
+    {
+        for (r = 0; r < RING_MAX_READERS; r++)
+        {
+            if (!(claimed & (1U << r)))
+            {
+                break;
+            }
+        }
+        if (r == RING_MAX_READERS)
+        {
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak(&st->claimed, &claimed, claimed | (1U << r)));
+    atomic_store(&st->owners[r], getpid());
+
+    return r;
+}
+
+// NULL when all the reader slots are taken
+static ring_t *ring_new_handle(ring_core_t *core, bool reader, size_t drop_bs)
+{
+    int r = -1;
+
+    if (reader)
+    {
+        r = ring_claim(core->st);
+        if (r < 0)
+        {
+            ring_reclaim(core->st);
+            r = ring_claim(core->st);
+        }
+        if (r < 0)
+        {
+            return NULL;
+        }
+    }
+
+    ring_t *self = core->arena ? (ring_t *)arena_alloc(core->arena, sizeof(ring_t))
+                               : (ring_t *)malloc(sizeof(ring_t));
+    log_assert(self);
+
+    self->core = core;
+    self->reader = r;
+    self->dropped = 0;
+
+    if (reader)
+    {
+        // a new reader only sees what gets written after it joined
+        core->st->drop_bs[r] = drop_bs;
+        atomic_store(&core->st->dropped[r], 0);
+        atomic_store(&core->st->tails[r], atomic_load(&core->st->head) << 1);
+        atomic_fetch_or(&core->st->readers, 1U << r);
+    }
+    atomic_fetch_add(&core->refs, 1);
+
+    return self;
+}
+
+static void ring_state_init(ring_state_t *st, size_t element_len, size_t count)
+{
+    atomic_init(&st->ready, 0);
+    st->creator = getpid();
+    for (int r = 0; r < RING_MAX_READERS; r++)
+    {
+        atomic_init(&st->owners[r], 0);
+    }
+    st->element_len = element_len;
+    st->count = count;
+    st->remote_bs = 0;
+    atomic_init(&st->head, 0);
+    atomic_init(&st->claimed, 0);
+    atomic_init(&st->readers, 0);
+}
+
+static void ring_core_init(ring_core_t *core, ring_state_t *st, size_t element_len, size_t count, size_t page)
+{
+    core->st = st;
+    core->element_len = element_len;
+    core->count = count;
+    core->size = (((element_len * count) + page - 1) / page) * page;
+    core->shm = NULL;
+    core->shm_owner = false;
+    atomic_init(&core->refs, 0);
+}
+
+// reserves twice the size and maps the same pages into both halves,
+// huge pages need the views aligned to their size
+static void ring_map(ring_core_t *core, int fd, off_t offset, int flags, int prot, size_t page)
+{
+    void *p;
+
+    core->resv_len = (2 * core->size) + page;
+    core->resv = mmap(NULL, core->resv_len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    log_assert(core->resv != MAP_FAILED);
+    core->buf = (uint8_t *)((((uintptr_t)core->resv) + page - 1) & ~(uintptr_t)(page - 1));
+
+    p = mmap(core->buf, core->size, prot, flags, fd, offset);
+    log_assert(p == core->buf);
+    p = mmap(core->buf + core->size, core->size, prot, flags, fd, offset);
+    log_assert(p == core->buf + core->size);
+}
+
+ring_t *ring_create(size_t element_len, size_t count)
+{
+    return ring_create_in(NULL, element_len, count);
+}
+
+ring_t *ring_create_in(arena_t *arena, size_t element_len, size_t count)
+{
+    int ret;
+    int fd;
+    off_t offset = 0;
+    int flags = MAP_SHARED | MAP_FIXED;
+
+    log_assert(element_len > 0);
+    log_assert(count > 0);
+
+    ring_core_t *core = arena ? (ring_core_t *)arena_alloc(arena, sizeof(ring_core_t))
+                              : (ring_core_t *)calloc(1, sizeof(ring_core_t));
+    log_assert(core);
+
+    size_t page = arena ? arena_get_page_size(arena) : (size_t)sysconf(_SC_PAGESIZE);
+    core->arena = arena;
+    ring_state_init(&core->local, element_len, count);
+    ring_core_init(core, &core->local, element_len, count, page);
+
+    if (arena)
+    {
+        // both views map pages of the arena, which are already populated
+        arena_alloc_pages(arena, core->size, &fd, &offset);
+        flags |= MAP_POPULATE;
+    }
+    else
+    {
+        fd = memfd_create("ring", MFD_CLOEXEC);
+        log_assert(fd >= 0);
+        ret = ftruncate(fd, core->size);
+        log_assert(ret == 0);
+    }
+
+    ring_map(core, fd, offset, flags, PROT_READ | PROT_WRITE, page);
+
+    if (!arena)
+    {
+        ret = close(fd);
+        log_assert(ret == 0);
+    }
+
+    ring_t *self = ring_new_handle(core, true, 0);
+    log_assert(self);
+    return self;
+}
+
+// Whether the process that created the shared ring 'name' is still there
+static bool ring_shm_in_use(const char *name)
+{
+    struct stat sb;
+    bool alive = false;
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        return false;
+    }
+    if ((fstat(fd, &sb) == 0) && ((size_t)sb.st_size >= RING_SHM_EXTRA))
+    {
+        ring_state_t *st = (ring_state_t *)mmap(NULL, RING_SHM_EXTRA, PROT_READ, MAP_SHARED, fd, 0);
+        if (st != MAP_FAILED)
+        {
+            // zero until the creator got to initialize the state
+            alive = (st->creator != 0) && ring_pid_alive(st->creator);
+            munmap(st, RING_SHM_EXTRA);
+        }
+    }
+    close(fd);
+
+    return alive;
+}
+
+ring_t *ring_create_shm(const char *name, size_t element_len, size_t count, size_t remote_bs,
+                        size_t extra_len, void **extra)
+{
+    int ret;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    log_assert(element_len > 0);
+    log_assert(count > 0);
+    log_assert(strlen(name) < RING_SHM_NAME_LEN);
+    log_assert(sizeof(ring_state_t) <= RING_SHM_EXTRA);
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if ((fd < 0) && (errno == EEXIST))
+    {
+        if (ring_shm_in_use(name))
+        {
+            LOG(ERROR, "Shared ring %s is in use by another process", name);
+            return NULL;
+        }
+        // left over by a publisher that did not exit cleanly
+        LOG(WARN, "Replacing stale shared ring %s", name);
+        shm_unlink(name);
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    }
+    if (fd < 0)
+    {
+        LOG(ERROR, "Failed to create shared ring %s (%s)", name, strerror(errno));
+        return NULL;
+    }
+
+    ring_core_t *core = (ring_core_t *)calloc(1, sizeof(ring_core_t));
+    log_assert(core);
+    core->arena = NULL;
+    ring_core_init(core, NULL, element_len, count, page);
+
+    core->shm_len = ((RING_SHM_EXTRA + extra_len + page - 1) / page) * page;
+    ret = ftruncate(fd, core->shm_len + core->size);
+    log_assert(ret == 0);
+    core->shm = mmap(NULL, core->shm_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    log_assert(core->shm != MAP_FAILED);
+    core->st = (ring_state_t *)core->shm;
+    ring_state_init(core->st, element_len, count);
+    core->st->remote_bs = remote_bs;
+    strncpy(core->shm_name, name, RING_SHM_NAME_LEN - 1);
+    core->shm_owner = true;
+
+    ring_map(core, fd, core->shm_len, MAP_SHARED | MAP_FIXED, PROT_READ | PROT_WRITE, page);
+    ret = close(fd);
+    log_assert(ret == 0);
+
+    // readers opening it from now on find the sizes written
+    atomic_store_explicit(&core->st->ready, RING_SHM_READY, memory_order_release);
+
+    *extra = (uint8_t *)core->shm + RING_SHM_EXTRA;
+    ring_t *self = ring_new_handle(core, true, 0);
+    log_assert(self);
+    return self;
+}
+
+ring_t *ring_open_shm(const char *name, void **extra)
+{
+    int ret;
+    struct stat sb;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+    {
+        LOG(ERROR, "Failed to open shared ring %s (%s)", name, strerror(errno));
+        return NULL;
+    }
+    ret = fstat(fd, &sb);
+    log_assert(ret == 0);
+    if ((size_t)sb.st_size < RING_SHM_EXTRA)
+    {
+        // the creator has not sized it yet
+        LOG(ERROR, "Shared ring %s is not ready", name);
+        close(fd);
+        return NULL;
+    }
+
+    // the sizes are only valid once the creator marked the state ready
+    ring_state_t *st = (ring_state_t *)mmap(NULL, RING_SHM_EXTRA, PROT_READ, MAP_SHARED, fd, 0);
+    log_assert(st != MAP_FAILED);
+    bool ready = atomic_load_explicit(&st->ready, memory_order_acquire) == RING_SHM_READY;
+    size_t element_len = st->element_len;
+    size_t count = st->count;
+    ret = munmap(st, RING_SHM_EXTRA);
+    log_assert(ret == 0);
+    if (!ready)
+    {
+        LOG(ERROR, "Shared ring %s is not ready", name);
+        close(fd);
+        return NULL;
+    }
+
+    ring_core_t *core = (ring_core_t *)calloc(1, sizeof(ring_core_t));
+    log_assert(core);
+    core->arena = NULL;
+    ring_core_init(core, NULL, element_len, count, page);
+    core->shm_len = sb.st_size - core->size;
+
+    // the reader writes its tail, the samples are read only
+    core->shm = mmap(NULL, core->shm_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    log_assert(core->shm != MAP_FAILED);
+    core->st = (ring_state_t *)core->shm;
+    strncpy(core->shm_name, name, RING_SHM_NAME_LEN - 1);
+
+    ring_map(core, fd, core->shm_len, MAP_SHARED | MAP_FIXED, PROT_READ, page);
+    ret = close(fd);
+    log_assert(ret == 0);
+
+    ring_t *self = ring_new_handle(core, true, core->st->remote_bs);
+    if (!self)
+    {
+        LOG(ERROR, "Shared ring %s has no reader slot left", name);
+        ret = munmap(core->resv, core->resv_len);
+        log_assert(ret == 0);
+        ret = munmap(core->shm, core->shm_len);
+        log_assert(ret == 0);
+        free(core);
+        return NULL;
+    }
+
+    *extra = (uint8_t *)core->shm + RING_SHM_EXTRA;
+    return self;
+}
+
+ring_t *ring_attach(ring_t *ring, bool reader)
+{
+    return ring_new_handle(ring->core, reader, 0);
+}
+
+void ring_set_drop(ring_t *self, size_t drop_bs)
+{
+    log_assert(self->reader >= 0);
+    log_assert(drop_bs <= self->core->count);
+    self->core->st->drop_bs[self->reader] = drop_bs;
+}
+
+size_t ring_get_count(ring_t *self)
+{
+    return self->core->count;
+}
+
+size_t ring_get_count_free_elements(ring_t *self)
+{
+    ring_core_t *core = self->core;
+    size_t head = atomic_load_explicit(&core->st->head, memory_order_relaxed);
+    unsigned int readers = atomic_load_explicit(&core->st->readers, memory_order_acquire);
+    size_t used = 0;
+
+    for (int r = 0; readers; r++, readers >>= 1)
+    {
+        if (readers & 1)
+        {
+            size_t tail = TAIL_POS(atomic_load_explicit(&core->st->tails[r], memory_order_acquire));
+            if ((head - tail) > used)
+            {
+                used = head - tail;
+            }
+        }
+    }
+
+    return core->count - used;
+}
+
+size_t ring_get_count_waiting_elements(ring_t *self)
+{
+    ring_core_t *core = self->core;
+    size_t head = atomic_load_explicit(&core->st->head, memory_order_acquire);
+    size_t tail = TAIL_POS(atomic_load_explicit(&core->st->tails[self->reader], memory_order_relaxed));
+
+    return head - tail;
+}
+
+size_t ring_get_head(ring_t *self)
+{
+    return atomic_load_explicit(&self->core->st->head, memory_order_acquire);
+}
+
+size_t ring_get_tail(ring_t *self)
+{
+    return TAIL_POS(atomic_load_explicit(&self->core->st->tails[self->reader], memory_order_relaxed));
+}
+
+bool ring_reserve(ring_t *self, size_t count)
+{
+    ring_core_t *core = self->core;
+    size_t head = atomic_load_explicit(&core->st->head, memory_order_relaxed);
+    unsigned int readers = atomic_load_explicit(&core->st->readers, memory_order_acquire);
+
+    log_assert(count <= core->count);
+
+    for (int r = 0; readers; r++, readers >>= 1)
+    {
+        if (!(readers & 1) || (core->st->drop_bs[r] == 0))
+        {
+            continue;
+        }
+
+        size_t tail = atomic_load(&core->st->tails[r]);
+        while (!(tail & TAIL_BUSY))
+        {
+            size_t lag = head - TAIL_POS(tail);
+            if ((core->count - lag) >= count)
+            {
+                break;
+            }
+
+            // drop the oldest whole blocks, never more than is waiting
+            size_t bs = core->st->drop_bs[r];
+            size_t skip = (((count - (core->count - lag)) + bs - 1) / bs) * bs;
+            if (skip > lag)
+            {
+                skip = lag;
+            }
+
+            if (atomic_compare_exchange_weak(&core->st->tails[r], &tail, (TAIL_POS(tail) + skip) << 1))
+            {
+                atomic_fetch_add(&core->st->dropped[r], skip);
+                break;
+            }
+        }
+    }
+
+    return ring_get_count_free_elements(self) >= count;
+}
+
+void *ring_get_read_ptr(ring_t *self)
+{
+    ring_core_t *core = self->core;
+    return ring_elem_ptr(core, TAIL_POS(atomic_load_explicit(&core->st->tails[self->reader], memory_order_relaxed)));
+}
+
+void *ring_get_write_ptr(ring_t *self)
+{
+    ring_core_t *core = self->core;
+    return ring_elem_ptr(core, atomic_load_explicit(&core->st->head, memory_order_relaxed));
+}
+
+void ring_bump_head(ring_t *self, size_t count)
+{
+    log_assert(count <= ring_get_count_free_elements(self));
+    atomic_fetch_add_explicit(&self->core->st->head, count, memory_order_release);
+}
+
+void ring_bump_tail(ring_t *self, size_t count)
+{
+    log_assert(count <= ring_get_count_waiting_elements(self));
+    atomic_fetch_add_explicit(&self->core->st->tails[self->reader], count << 1, memory_order_release);
+}
+
+size_t ring_acquire(ring_t *self)
+{
+    ring_core_t *core = self->core;
+    _Atomic size_t *tail = &core->st->tails[self->reader];
+    size_t t = atomic_load(tail);
+
+    // from here on the producer cannot drop what we are looking at
+    while (!atomic_compare_exchange_weak(tail, &t, t | TAIL_BUSY))
+    {
+    }
+
+    size_t dropped = atomic_load(&core->st->dropped[self->reader]);
+    size_t n = dropped - self->dropped;
+    self->dropped = dropped;
+
+    return n;
+}
+
+void ring_release(ring_t *self, size_t count)
+{
+    ring_core_t *core = self->core;
+    _Atomic size_t *tail = &core->st->tails[self->reader];
+    size_t t = atomic_load_explicit(tail, memory_order_relaxed);
+
+    log_assert(count <= ring_get_count_waiting_elements(self));
+    atomic_store_explicit(tail, (TAIL_POS(t) + count) << 1, memory_order_release);
+}
+
+bool ring_try_release(ring_t *self, size_t tail, size_t count)
+{
+    return ring_try_seek(self, tail, tail + count);
+}
+
+// Moves the read position from 'tail' to 'pos', which may lie behind it
+// but must still be in the ring, unless the producer moved it meanwhile
+bool ring_try_seek(ring_t *self, size_t tail, size_t pos)
+{
+    size_t t = tail << 1;
+    return atomic_compare_exchange_strong(&self->core->st->tails[self->reader], &t, pos << 1);
+}
+
+size_t ring_insert(ring_t *self, const void *src, size_t max_count)
+{
+    size_t n;
+
+    ring_reserve(self, max_count < self->core->count ? max_count : self->core->count);
+    n = ring_get_count_free_elements(self);
+    if (n > max_count)
+    {
+        n = max_count;
+    }
+
+    memcpy(ring_get_write_ptr(self), src, n * self->core->element_len);
+    ring_bump_head(self, n);
+
+    return n;
+}
+
+size_t ring_consume(ring_t *self, void *dest, size_t max_count)
+{
+    size_t n = ring_get_count_waiting_elements(self);
+
+    if (n > max_count)
+    {
+        n = max_count;
+    }
+
+    if (dest)
+    {
+        memcpy(dest, ring_get_read_ptr(self), n * self->core->element_len);
+    }
+    ring_bump_tail(self, n);
+
+    return n;
+}
+
+void ring_destroy(ring_t **self_p)
+{
+    log_assert(self_p);
+    if (*self_p)
+    {
+        ring_t *self = *self_p;
+        ring_core_t *core = self->core;
+
+        if (self->reader >= 0)
+        {
+            atomic_fetch_and(&core->st->readers, ~(1U << self->reader));
+            atomic_store(&core->st->owners[self->reader], 0);
+            atomic_fetch_and(&core->st->claimed, ~(1U << self->reader));
+        }
+
+        bool owned = (core->arena == NULL);
+
+        if (atomic_fetch_sub(&core->refs, 1) == 1)
+        {
+            int ret = munmap(core->resv, core->resv_len);
+            log_assert(ret == 0);
+            if (core->shm)
+            {
+                ret = munmap(core->shm, core->shm_len);
+                log_assert(ret == 0);
+                if (core->shm_owner)
+                {
+                    shm_unlink(core->shm_name);
+                }
+            }
+            if (owned)
+            {
+                free(core);
+            }
+        }
+
+        if (owned)
+        {
+            free(self);
+        }
+        *self_p = NULL;
+    }
+}
@@ -0,0 +1,473 @@
+#define _GNU_SOURCE
+
+#include "runtime.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "logging.h"
+#include "realtime.h"
+
+#define RUNTIME_MAX_TASKS (64)
+#define RUNTIME_MAX_WORKERS (32)
+// both queues must be able to hold every task at once
+#define RUNTIME_QUEUE_LEN (RUNTIME_MAX_TASKS)
+
+typedef enum
+{
+    TASK_PARKED = 0,
+    TASK_IDLE,
+    TASK_QUEUED,
+    TASK_RUNNING,
+    TASK_NOTIFIED,
+    TASK_STOPPED
+} task_state_e;
+
+struct _runtime_task_t
+{
+    runtime_t *rt;
+    void (*fn)(void *);
+    void *arg;
+    _Atomic int state;
+};
+
+// Chase-Lev work stealing deque, only the owner pushes and takes
+typedef struct
+{
+    _Atomic int64_t top;
+    _Atomic int64_t bottom;
+    runtime_task_t *_Atomic buf[RUNTIME_QUEUE_LEN];
+} deque_t;
+
+// bounded MPMC queue, used for tasks scheduled from outside of the workers
+// and for tasks that asked to run again
+typedef struct
+{
+    _Atomic size_t seq;
+    runtime_task_t *task;
+} cell_t;
+
+typedef struct
+{
+    cell_t cells[RUNTIME_QUEUE_LEN];
+    _Atomic size_t enq;
+    _Atomic size_t deq;
+} inject_t;
+
+typedef struct
+{
+    runtime_t *rt;
+    size_t id;
+    pthread_t thread;
+    deque_t deque;
+} worker_t;
+
+struct _runtime_t
+{
+    size_t num_workers;
+    worker_t workers[RUNTIME_MAX_WORKERS];
+    inject_t inject;
+    runtime_task_t tasks[RUNTIME_MAX_TASKS];
+    _Atomic size_t num_tasks;
+    _Atomic uint32_t epoch;
+    _Atomic int sleepers;
+    _Atomic bool stop;
+};
+
+static _Thread_local worker_t *current_worker;
+
+static void deque_push(deque_t *d, runtime_task_t *task)
+{
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+
+    log_assert((b - t) < RUNTIME_QUEUE_LEN);
+    atomic_store_explicit(&d->buf[b % RUNTIME_QUEUE_LEN], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+}
+
+static runtime_task_t *deque_take(deque_t *d)
+{
+    runtime_task_t *task = NULL;
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    if (t <= b)
+    {
+        task = atomic_load_explicit(&d->buf[b % RUNTIME_QUEUE_LEN], memory_order_relaxed);
+        if (t == b)
+        {
+            // last element, race against the thieves
+            if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                         memory_order_seq_cst,
+                                                         memory_order_relaxed))
+            {
+                task = NULL;
+            }
+            atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        }
+    }
+    else
+    {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+
+    return task;
+}
+
+static runtime_task_t *deque_steal(deque_t *d)
+{
+    runtime_task_t *task = NULL;
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+
+    if (t < b)
+    {
+        task = atomic_load_explicit(&d->buf[t % RUNTIME_QUEUE_LEN], memory_order_relaxed);
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                     memory_order_seq_cst,
+                                                     memory_order_relaxed))
+        {
+            task = NULL;
+        }
+    }
+
+    return task;
+}
+
+static void inject_init(inject_t *q)
+{
+    for (size_t i = 0; i < RUNTIME_QUEUE_LEN; i++)
+    {
+        atomic_init(&q->cells[i].seq, i);
+        q->cells[i].task = NULL;
+    }
+    atomic_init(&q->enq, 0);
+    atomic_init(&q->deq, 0);
+}
+
+static void inject_push(inject_t *q, runtime_task_t *task)
+{
+    cell_t *cell;
+    size_t pos = atomic_load_explicit(&q->enq, memory_order_relaxed);
+
+    while (true)
+    {
+        cell = &q->cells[pos % RUNTIME_QUEUE_LEN];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+
+        if (dif == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&q->enq, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else
+        {
+            // a task is queued at most once, so the queue cannot be full
+            log_assert(dif > 0);
+            pos = atomic_load_explicit(&q->enq, memory_order_relaxed);
+        }
+    }
+
+    cell->task = task;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+}
+
+static runtime_task_t *inject_pop(inject_t *q)
+{
+    cell_t *cell;
+    size_t pos = atomic_load_explicit(&q->deq, memory_order_relaxed);
+
+    while (true)
+    {
+        cell = &q->cells[pos % RUNTIME_QUEUE_LEN];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (dif == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&q->deq, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (dif < 0)
+        {
+            return NULL;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&q->deq, memory_order_relaxed);
+        }
+    }
+
+    runtime_task_t *task = cell->task;
+    atomic_store_explicit(&cell->seq, pos + RUNTIME_QUEUE_LEN, memory_order_release);
+
+    return task;
+}
+
+static void runtime_wake(runtime_t *self)
+{
+    atomic_fetch_add(&self->epoch, 1);
+    if (atomic_load(&self->sleepers) > 0)
+    {
+        syscall(SYS_futex, &self->epoch, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+static void runtime_enqueue(runtime_task_t *task, bool fair)
+{
+    runtime_t *self = task->rt;
+
+    // tasks woken from a worker stay on it, the data they need is hot in its cache
+    if (!fair && current_worker && (current_worker->rt == self))
+    {
+        deque_push(&current_worker->deque, task);
+    }
+    else
+    {
+        inject_push(&self->inject, task);
+    }
+    runtime_wake(self);
+}
+
+static runtime_task_t *runtime_find_task(worker_t *w)
+{
+    runtime_t *self = w->rt;
+    runtime_task_t *task = deque_take(&w->deque);
+
+    if (!task)
+    {
+        task = inject_pop(&self->inject);
+    }
+
+    for (size_t i = 1; !task && (i < self->num_workers); i++)
+    {
+        task = deque_steal(&self->workers[(w->id + i) % self->num_workers].deque);
+    }
+
+    return task;
+}
+
+static void runtime_run_task(runtime_task_t *task)
+{
+    int state = TASK_QUEUED;
+
+    if (!atomic_compare_exchange_strong(&task->state, &state, TASK_RUNNING))
+    {
+        // stopped while queued
+        return;
+    }
+
+    task->fn(task->arg);
+
+    state = TASK_RUNNING;
+    if (!atomic_compare_exchange_strong(&task->state, &state, TASK_IDLE))
+    {
+        // scheduled while running, requeue at the back so others get their turn
+        log_assert(state == TASK_NOTIFIED);
+        atomic_store(&task->state, TASK_QUEUED);
+        runtime_enqueue(task, true);
+    }
+}
+
+static void *runtime_worker(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    runtime_t *self = w->rt;
+    char name[16];
+
+    snprintf(name, sizeof(name), "dsp/%lu", w->id);
+    pthread_setname_np(pthread_self(), name);
+    current_worker = w;
+    realtime_thread(REALTIME_WORKER);
+
+    LOG(DEBUG, "Worker %lu started", w->id);
+
+    while (!atomic_load(&self->stop))
+    {
+        uint32_t epoch = atomic_load(&self->epoch);
+        runtime_task_t *task = runtime_find_task(w);
+
+        if (task)
+        {
+            runtime_run_task(task);
+        }
+        else
+        {
+            atomic_fetch_add(&self->sleepers, 1);
+            if (!atomic_load(&self->stop) && (atomic_load(&self->epoch) == epoch))
+            {
+                syscall(SYS_futex, &self->epoch, FUTEX_WAIT_PRIVATE, epoch, NULL, NULL, 0);
+            }
+            atomic_fetch_sub(&self->sleepers, 1);
+        }
+    }
+
+    LOG(DEBUG, "Worker %lu stopped", w->id);
+
+    return NULL;
+}
+
+runtime_t *runtime_create(size_t num_workers)
+{
+    int ret;
+
+    log_assert(num_workers > 0);
+    log_assert(num_workers <= RUNTIME_MAX_WORKERS);
+
+    runtime_t *self = (runtime_t *)calloc(1, sizeof(runtime_t));
+    log_assert(self);
+
+    self->num_workers = num_workers;
+    inject_init(&self->inject);
+    atomic_init(&self->num_tasks, 0);
+    atomic_init(&self->epoch, 0);
+    atomic_init(&self->sleepers, 0);
+    atomic_init(&self->stop, false);
+
+    for (size_t i = 0; i < num_workers; i++)
+    {
+        worker_t *w = &self->workers[i];
+        w->rt = self;
+        w->id = i;
+        atomic_init(&w->deque.top, 0);
+        atomic_init(&w->deque.bottom, 0);
+    }
+
+    for (size_t i = 0; i < num_workers; i++)
+    {
+        ret = pthread_create(&self->workers[i].thread, NULL, runtime_worker, &self->workers[i]);
+        log_assert(ret == 0);
+    }
+
+    LOG(INFO, "Runtime started with %lu worker threads", num_workers);
+
+    return self;
+}
+
+runtime_task_t *runtime_task_create(runtime_t *self, void (*fn)(void *), void *arg)
+{
+    size_t i = atomic_fetch_add(&self->num_tasks, 1);
+    log_assert(i < RUNTIME_MAX_TASKS);
+
+    runtime_task_t *task = &self->tasks[i];
+    task->rt = self;
+    task->fn = fn;
+    task->arg = arg;
+    atomic_store(&task->state, TASK_PARKED);
+
+    return task;
+}
+
+void runtime_task_start(runtime_task_t *task)
+{
+    int state = TASK_PARKED;
+
+    if (atomic_compare_exchange_strong(&task->state, &state, TASK_QUEUED))
+    {
+        // run once to pick up anything that arrived before the start
+        runtime_enqueue(task, false);
+    }
+}
+
+bool runtime_task_schedule(runtime_task_t *task)
+{
+    while (true)
+    {
+        int state = atomic_load(&task->state);
+
+        switch (state)
+        {
+        case TASK_IDLE:
+            if (atomic_compare_exchange_weak(&task->state, &state, TASK_QUEUED))
+            {
+                runtime_enqueue(task, false);
+                return true;
+            }
+            break;
+
+        case TASK_RUNNING:
+            if (atomic_compare_exchange_weak(&task->state, &state, TASK_NOTIFIED))
+            {
+                return true;
+            }
+            break;
+
+        case TASK_QUEUED:
+        case TASK_NOTIFIED:
+            return true;
+
+        default:
+            return false;
+        }
+    }
+}
+
+void runtime_task_stop(runtime_task_t *task)
+{
+    while (true)
+    {
+        int state = atomic_load(&task->state);
+
+        if ((state == TASK_RUNNING) || (state == TASK_NOTIFIED))
+        {
+            // let the current run finish
+            sched_yield();
+        }
+        else if (state == TASK_STOPPED)
+        {
+            break;
+        }
+        else if (atomic_compare_exchange_weak(&task->state, &state, TASK_STOPPED))
+        {
+            break;
+        }
+    }
+}
+
+void runtime_destroy(runtime_t **self_p)
+{
+    LOG(DEBUG, "Destroying");
+    log_assert(self_p);
+    if (*self_p)
+    {
+        int ret;
+        runtime_t *self = *self_p;
+
+        atomic_store(&self->stop, true);
+        atomic_fetch_add(&self->epoch, 1);
+        syscall(SYS_futex, &self->epoch, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+
+        for (size_t i = 0; i < self->num_workers; i++)
+        {
+            ret = pthread_join(self->workers[i].thread, NULL);
+            log_assert(ret == 0);
+        }
+
+        free(self);
+        *self_p = NULL;
+    }
+    LOG(DEBUG, "Destroyed");
+}
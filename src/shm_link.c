@@ -0,0 +1,293 @@
+#include "shm_link.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include <libdill.h>
+
+#include "logging.h"
+#include "stack_pool.h"
+
+#define SHM_MAGIC (0x64737031U)
+
+// Follows the ring state in the shared object. 'msgs' has a slot per block
+// of the ring, 'published' is the ring position up to which the slots are
+// written, 'seq' is the futex word the readers sleep on.
+typedef struct
+{
+    uint32_t magic;
+    int fmt;
+    size_t bs;
+    size_t sz;
+    size_t nb;
+    _Atomic uint64_t published;
+    _Atomic uint32_t seq;
+    _Atomic uint32_t waiters;
+    _Atomic bool closed;
+    link_msg_t msgs[];
+} shm_header_t;
+
+struct _shm_link_t
+{
+    link_t *in;
+    shm_header_t *hdr;
+    int handle;
+    void *stack;
+};
+
+struct _shm_reader_t
+{
+    ring_t *ring;
+    shm_header_t *hdr;
+    // ring position expected next and the one of the block in hand
+    size_t next;
+    size_t pos;
+    size_t dropped;
+};
+
+static void shm_name(char *dest, const char *name)
+{
+    int n = snprintf(dest, RING_SHM_NAME_LEN, "/dsp_%s", name);
+    log_assert((n > 0) && (n < RING_SHM_NAME_LEN));
+}
+
+static void shm_wake(shm_header_t *hdr)
+{
+    atomic_fetch_add(&hdr->seq, 1);
+    if (atomic_load(&hdr->waiters))
+    {
+        syscall(SYS_futex, &hdr->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+static coroutine void shm_link_runner(shm_link_t *self)
+{
+    link_msg_t msg;
+    link_t *in = self->in;
+    shm_header_t *hdr = self->hdr;
+
+    while (link_recv(in, &msg, -1) == 0)
+    {
+        dlg_assertm(msg.len == in->in_bs, "Published blocks are whole, got %lu of %lu", msg.len, in->in_bs);
+
+        // nothing to hold on to, the readers keep their own positions
+        size_t pos = ring_get_tail(in->in_buf);
+        hdr->msgs[(pos / hdr->bs) % hdr->nb] = msg;
+        link_consume(in, NULL, msg.len);
+        atomic_store_explicit(&hdr->published, pos + msg.len, memory_order_release);
+        shm_wake(hdr);
+    }
+
+    atomic_store(&hdr->closed, true);
+    shm_wake(hdr);
+    link_close(in);
+    LOG(DEBUG, "Exiting");
+}
+
+shm_link_t *shm_link_publish(const char *name, link_t *src, size_t nb)
+{
+    char path[RING_SHM_NAME_LEN];
+    void *extra;
+
+    shm_name(path, name);
+    size_t bs = src->out_bs;
+    ring_t *ring = ring_create_shm(path, src->out_sz, nb * bs, bs,
+                                   sizeof(shm_header_t) + (nb * sizeof(link_msg_t)), &extra);
+    if (!ring)
+    {
+        return NULL;
+    }
+
+    shm_link_t *self = (shm_link_t *)link_alloc(sizeof(shm_link_t));
+    log_assert(self);
+
+    self->hdr = (shm_header_t *)extra;
+    self->hdr->fmt = src->out_fmt;
+    self->hdr->bs = bs;
+    self->hdr->sz = src->out_sz;
+    self->hdr->nb = nb;
+    atomic_init(&self->hdr->published, 0);
+    atomic_init(&self->hdr->seq, 0);
+    atomic_init(&self->hdr->waiters, 0);
+    atomic_init(&self->hdr->closed, false);
+    atomic_thread_fence(memory_order_release);
+    self->hdr->magic = SHM_MAGIC;
+
+    self->in = link_connect_ring("shm_link", src, ring, bs);
+    log_assert(self->in);
+
+    self->stack = stack_pool_get("shm_link", STACK_SIZE_RUNNER);
+    self->handle = go_mem(shm_link_runner(self), self->stack, STACK_SIZE_RUNNER);
+    log_assert(self->handle >= 0);
+
+    LOG(INFO, "Publishing '%s' as %s, %lu blocks of %lu", src->name, path, nb, bs);
+    return self;
+}
+
+void shm_link_destroy(shm_link_t **self_p)
+{
+    LOG(DEBUG, "Destroying");
+    log_assert(self_p);
+    if (*self_p)
+    {
+        shm_link_t *self = *self_p;
+
+        int ret = hclose(self->handle);
+        log_assert(ret == 0);
+        stack_pool_put(&self->stack);
+        if (!self->in->closed)
+        {
+            atomic_store(&self->hdr->closed, true);
+            shm_wake(self->hdr);
+            link_close(self->in);
+        }
+
+        link_free(self);
+        *self_p = NULL;
+    }
+    LOG(DEBUG, "Destroyed");
+}
+
+shm_reader_t *shm_reader_open(const char *name)
+{
+    char path[RING_SHM_NAME_LEN];
+    void *extra;
+
+    shm_name(path, name);
+    ring_t *ring = ring_open_shm(path, &extra);
+    if (!ring)
+    {
+        return NULL;
+    }
+    shm_header_t *hdr = (shm_header_t *)extra;
+    if (hdr->magic != SHM_MAGIC)
+    {
+        LOG(ERROR, "%s is not a published link", path);
+        ring_destroy(&ring);
+        return NULL;
+    }
+
+    // the tail starts at the head, which the source may have left in the
+    // middle of a block, the last published position is on a boundary
+    size_t tail, published;
+    do
+    {
+        tail = ring_get_tail(ring);
+        published = atomic_load_explicit(&hdr->published, memory_order_acquire);
+    } while (!ring_try_seek(ring, tail, published));
+
+    shm_reader_t *self = (shm_reader_t *)malloc(sizeof(shm_reader_t));
+    log_assert(self);
+    self->ring = ring;
+    self->hdr = hdr;
+    self->next = published;
+    self->pos = self->next;
+    self->dropped = 0;
+
+    LOG(INFO, "Reading %s, %lu blocks of %lu", path, hdr->nb, hdr->bs);
+    return self;
+}
+
+int shm_reader_acquire(shm_reader_t *self, const void **buf, link_msg_t *msg, int timeout_ms)
+{
+    shm_header_t *hdr = self->hdr;
+    struct timespec ts;
+    // spurious wakeups and blocks for others must not restart the wait
+    uint64_t deadline = latency_now_ns() + ((uint64_t)timeout_ms * 1000000ULL);
+
+    while (true)
+    {
+        uint32_t seq = atomic_load(&hdr->seq);
+        size_t pos = ring_get_tail(self->ring);
+
+        if ((pos + hdr->bs) <= atomic_load_explicit(&hdr->published, memory_order_acquire))
+        {
+            *msg = hdr->msgs[(pos / hdr->bs) % hdr->nb];
+            *buf = ring_get_read_ptr(self->ring);
+            if (pos != self->next)
+            {
+                // the publisher dropped our oldest blocks
+                self->dropped += pos - self->next;
+                msg->flags |= LINK_MSG_GAP;
+            }
+            self->pos = pos;
+            return 0;
+        }
+        if (atomic_load(&hdr->closed))
+        {
+            errno = EPIPE;
+            return -1;
+        }
+
+        if (timeout_ms >= 0)
+        {
+            uint64_t now = latency_now_ns();
+            if (now >= deadline)
+            {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            ts.tv_sec = (deadline - now) / 1000000000ULL;
+            ts.tv_nsec = (deadline - now) % 1000000000ULL;
+        }
+
+        atomic_fetch_add(&hdr->waiters, 1);
+        long ret = syscall(SYS_futex, &hdr->seq, FUTEX_WAIT, seq, (timeout_ms < 0) ? NULL : &ts, NULL, 0);
+        atomic_fetch_sub(&hdr->waiters, 1);
+        if ((ret != 0) && (errno == ETIMEDOUT))
+        {
+            return -1;
+        }
+    }
+}
+
+bool shm_reader_release(shm_reader_t *self)
+{
+    size_t bs = self->hdr->bs;
+    bool ok = ring_try_release(self->ring, self->pos, bs);
+
+    if (!ok)
+    {
+        self->dropped += bs;
+    }
+    self->next = self->pos + bs;
+
+    return ok;
+}
+
+link_format_e shm_reader_get_format(shm_reader_t *self)
+{
+    return (link_format_e)self->hdr->fmt;
+}
+
+size_t shm_reader_get_block_size(shm_reader_t *self)
+{
+    return self->hdr->bs;
+}
+
+size_t shm_reader_get_dropped(shm_reader_t *self)
+{
+    return self->dropped;
+}
+
+void shm_reader_close(shm_reader_t **self_p)
+{
+    log_assert(self_p);
+    if (*self_p)
+    {
+        shm_reader_t *self = *self_p;
+
+        LOG(INFO, "Dropped %lu elements", self->dropped);
+        ring_destroy(&self->ring);
+        free(self);
+        *self_p = NULL;
+    }
+}
@@ -1,56 +1,281 @@
 #include "soapy_source.h"
 
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <complex.h>
 #include <math.h>
 
 #include <libdill.h>
 #include <SoapySDR/Device.h>
+#include <SoapySDR/Errors.h>
 #include <SoapySDR/Formats.h>
 
 #include "logging.h"
+#include "metrics.h"
+#include "trace.h"
+#include "stack_pool.h"
 #include "util.h"
 
+// samples thrown away after a retune while the tuner settles
+#define SETTLE_NS (2000000LL)
+// transfers the driver is assumed to queue when it cannot be drained,
+// what the RTL-SDR driver allocates by default
+#define DRIVER_BUFFERS (15)
+// reads of a drain before giving up on emptying the driver queue
+#define DRAIN_MAX_READS (4 * DRIVER_BUFFERS)
+
 struct _soapy_source_t
 {
     link_t *out;
     SoapySDRDevice *sdr;
     SoapySDRStream *rxStream;
     int handle;
+    void *stack;
+    double samplerate;
+    // driver overflows, the lost samples go to the output link 'dropped'
+    size_t overflows;
+
+    // retunes are applied by the runner between two blocks, samples are
+    // skipped until 'settle_ns' in hardware time or for 'settle' samples
+    double frequency;
+    bool retune;
+    long long settle_ns;
+    size_t settle;
+    // what the driver still has queued gets read into 'scratch', a
+    // transfer of 'mtu' samples at a time
+    size_t mtu;
+    void *scratch;
 };
 
+// Number of samples missing between the expected and the actual timestamp
+static size_t soapy_source_missing(soapy_source_t *self, long long expected_ns, long long time_ns)
+{
+    double missing = (time_ns - expected_ns) * self->samplerate / 1e9;
+    // jitter of less than a sample is not a loss
+    return (missing >= 1.0) ? (size_t)llround(missing) : 0;
+}
+
+// Reads what the driver queued until it has nothing left, returns false
+// if it keeps delivering or fails
+static bool soapy_source_drain(soapy_source_t *self, size_t *drained)
+{
+    int flags;
+    long long time_ns;
+    void *buffs[1] = {self->scratch};
+
+    *drained = 0;
+    for (int i = 0; i < DRAIN_MAX_READS; i++)
+    {
+        int read = SoapySDRDevice_readStream(self->sdr, self->rxStream, buffs, self->mtu, &flags, &time_ns, 0);
+        if (read == SOAPY_SDR_TIMEOUT)
+        {
+            return true;
+        }
+        else if (read == SOAPY_SDR_OVERFLOW)
+        {
+            continue;
+        }
+        else if (read < 0)
+        {
+            return false;
+        }
+        *drained += read;
+    }
+
+    return false;
+}
+
+static void soapy_source_retune(soapy_source_t *self)
+{
+    int ret = SoapySDRDevice_setFrequency(self->sdr, SOAPY_SDR_RX, 0, self->frequency, NULL);
+    log_assert(ret == 0);
+    self->retune = false;
+
+    self->settle_ns = -1;
+    self->settle = llround(self->samplerate * SETTLE_NS / 1e9);
+    if (SoapySDRDevice_hasHardwareTime(self->sdr, NULL))
+    {
+        self->settle_ns = SoapySDRDevice_getHardwareTime(self->sdr, NULL) + SETTLE_NS;
+    }
+    else
+    {
+        // without hardware time the samples of the old frequency the driver
+        // still has queued cannot be told apart, they are read and thrown
+        // away, a transfer that was in flight meanwhile gets skipped too
+        size_t drained;
+        if (soapy_source_drain(self, &drained))
+        {
+            self->settle += self->mtu;
+        }
+        else
+        {
+            // the whole driver queue then
+            self->settle += self->mtu * DRIVER_BUFFERS;
+        }
+        LOG(DEBUG, "Drained %lu samples, skipping %lu more", drained, self->settle);
+    }
+    LOG(DEBUG, "Retuned to %lf Hz", self->frequency);
+}
+
+// Number of samples at the start of a read that predate the end of a retune
+static size_t soapy_source_skip(soapy_source_t *self, size_t read, int flags, long long time_ns)
+{
+    size_t n;
+
+    if (self->settle == 0)
+    {
+        return 0;
+    }
+
+    if ((self->settle_ns >= 0) && (flags & SOAPY_SDR_HAS_TIME))
+    {
+        double early = (self->settle_ns - time_ns) * self->samplerate / 1e9;
+        n = (early > 0.0) ? (size_t)ceil(early) : 0;
+        if (n >= read)
+        {
+            return read;
+        }
+        self->settle = 0;
+    }
+    else
+    {
+        n = (read < self->settle) ? read : self->settle;
+        self->settle -= n;
+    }
+
+    return n;
+}
+
 static coroutine void soapy_source_runner(soapy_source_t *self)
 {
     int ret, flags;
     int read;
-    size_t n;
     size_t to_read = self->out->out_bs;
     long long timeNs;
+    // timestamp the next sample should have, if the driver gives any
+    long long expected_ns = 0;
+    bool has_expected = false;
+    size_t missing = 0;
+    // the current block goes to the drop buffer of the output link
+    bool dropping = false;
+    void *buffs[1];
     link_msg_t msg = {
         .len = 0,
         .id = 0
     };
 
-    complex float *buffp = malloc(to_read * sizeof(complex float));
-    log_assert(buffp);
-    void *buffs[] = {buffp};
-
     while (true)
     {
+        // samples are read straight into the output ring, wait for the
+        // consumers to make room
+        ret = link_wait_send(self->out, to_read, -1);
+        if ((ret != 0) && (errno != ENOBUFS))
+        {
+            break;
+        }
+        if (to_read == self->out->out_bs)
+        {
+            // a consumer dropping the newest blocks has no room, the driver
+            // still has to be drained
+            dropping = (ret != 0);
+            if (self->retune)
+            {
+                // the next block is the first one from the new frequency
+                soapy_source_retune(self);
+                msg.flags |= LINK_MSG_RETUNE;
+            }
+        }
+        if (dropping)
+        {
+            buffs[0] = (uint8_t *)self->out->drop_buf + ((self->out->out_bs - to_read) * self->out->out_sz);
+        }
+        else
+        {
+            buffs[0] = ring_get_write_ptr(self->out->out_buf);
+        }
+        flags = 0;
+        uint64_t span = trace_begin();
         read = SoapySDRDevice_readStream(self->sdr, self->rxStream, buffs, to_read, &flags, &timeNs, 200000);
-        if (read > 0)
+        trace_complete("soapy_source", "read", span);
+        // the block is as old as its last samples
+        msg.origin_ns = link_now_ns();
+        if (read == SOAPY_SDR_OVERFLOW)
+        {
+            // the driver or the USB link lost samples, the next timestamp
+            // tells how many
+            LOG(WARN, "SDR overflow");
+            self->overflows++;
+            trace_instant("soapy_source", "overflow", self->overflows);
+            msg.flags |= LINK_MSG_GAP;
+            continue;
+        }
+        else if (read > 0)
         {
             dlg_assertm(read <= to_read, "read = %d", read);
             LOG(DEBUG, "Sending %d samples (%p)", read, self->out->out_buf);
 
-            n = lws_ring_insert(self->out->out_buf, buffp, read);
-            log_assert(n == read);
-            
+            if (flags & SOAPY_SDR_HAS_TIME)
+            {
+                if (has_expected)
+                {
+                    missing += soapy_source_missing(self, expected_ns, timeNs);
+                }
+                expected_ns = timeNs + llround(read * 1e9 / self->samplerate);
+                has_expected = true;
+            }
+
+            size_t skip = soapy_source_skip(self, read, flags, timeNs);
+            if (skip)
+            {
+                // still the old frequency, the block starts after it
+                size_t sz = self->out->out_sz;
+                memmove(buffs[0], (uint8_t *)buffs[0] + (skip * sz), (read - skip) * sz);
+                timeNs += llround(skip * 1e9 / self->samplerate);
+                read -= skip;
+                if (read == 0)
+                {
+                    continue;
+                }
+            }
+
+            if ((flags & SOAPY_SDR_HAS_TIME) && (to_read == self->out->out_bs))
+            {
+                msg.time_ns = timeNs;
+                msg.flags |= LINK_MSG_HAS_TIME;
+            }
+
+            // a loss before the block moves its index, one in the
+            // middle of it shows up on the next one
+            if (missing && (to_read == self->out->out_bs))
+            {
+                LOG(WARN, "SDR lost %lu samples", missing);
+                self->out->dropped += missing;
+                self->out->out_index += missing;
+                msg.flags |= LINK_MSG_GAP;
+                missing = 0;
+            }
+
             to_read -= read;
+            if (dropping)
+            {
+                if (to_read == 0)
+                {
+                    // the tags stay for the next block that gets through
+                    to_read = self->out->out_bs;
+                    link_discard(self->out, to_read);
+                }
+                continue;
+            }
+
+            ring_bump_head(self->out->out_buf, read);
+
             if (to_read == 0)
             {
                 to_read = self->out->out_bs;
                 msg.len = to_read;
-                ret = chsend(self->out->out_ch_s, &msg, sizeof(link_msg_t), -1);
+                ret = link_send(self->out, &msg);
+                msg.flags = 0;
                 if (ret == 0)
                 {
                     ret = yield();
@@ -64,18 +289,17 @@ static coroutine void soapy_source_runner(soapy_source_t *self)
         }
         else
         {
-            LOG(WARN, "No samples read");
+            LOG(WARN, "No samples read (%d)", read);
             ret = chsend(cancel_ch, NULL, 0, -1);
             log_assert(ret == 0);
             break;
         }
     }
-    ret = chdone(self->out->in_ch_s);
-    log_assert(ret == 0);
-
-    ret = hclose(self->out->in_ch_s);
-    log_assert(ret == 0);
-    lws_ring_destroy(self->out->in_buf);
+    if (self->overflows)
+    {
+        LOG(INFO, "SDR overflowed %lu times", self->overflows);
+    }
+    link_close(self->out);
     LOG(DEBUG, "Exiting");
 }
 
@@ -105,10 +329,17 @@ soapy_source_t *soapy_source_create(double samplerate, double frequency,
     {
         LOG(INFO, "Using %s device", driver_name);
         
-        self = (soapy_source_t *)malloc(sizeof(soapy_source_t));
+        self = (soapy_source_t *)link_alloc(sizeof(soapy_source_t));
         log_assert(self);
 
         self->out = output;
+        self->samplerate = samplerate;
+        self->overflows = 0;
+        metrics_add_counter("dsp_sdr_overflows_total", "Overflows reported by the SDR driver", &self->overflows);
+        self->frequency = frequency;
+        self->retune = false;
+        self->settle_ns = -1;
+        self->settle = 0;
 
         SoapySDRKwargs args = {};
         SoapySDRKwargs_set(&args, "driver", driver_name);
@@ -130,8 +361,33 @@ soapy_source_t *soapy_source_create(double samplerate, double frequency,
         log_assert(ret == 0);
         ret = SoapySDRDevice_setFrequency(self->sdr, SOAPY_SDR_RX, 0, frequency, NULL);
         log_assert(ret == 0);
-        ret = SoapySDRDevice_setupStream(self->sdr, &self->rxStream, SOAPY_SDR_RX, SOAPY_SDR_CF32, NULL, 0, NULL);
+        // stream in the format of the output link, compact formats save
+        // ring memory and bandwidth up to the first block
+        const char *format;
+        switch (output->out_fmt)
+        {
+        case LINK_FMT_CS16:
+            format = SOAPY_SDR_CS16;
+            break;
+        case LINK_FMT_CS8:
+            format = SOAPY_SDR_CS8;
+            break;
+        default:
+            log_assert(output->out_sz == sizeof(complex float));
+            format = SOAPY_SDR_CF32;
+            break;
+        }
+
+        double full_scale;
+        char *native = SoapySDRDevice_getNativeStreamFormat(self->sdr, SOAPY_SDR_RX, 0, &full_scale);
+        LOG(INFO, "Native stream format %s (full scale %g), streaming %s", native, full_scale, format);
+        free(native);
+
+        ret = SoapySDRDevice_setupStream(self->sdr, &self->rxStream, SOAPY_SDR_RX, format, NULL, 0, NULL);
         log_assert(ret == 0);
+        self->mtu = SoapySDRDevice_getStreamMTU(self->sdr, self->rxStream);
+        self->scratch = link_alloc(self->mtu * output->out_sz);
+        log_assert(self->scratch);
         ret = SoapySDRDevice_activateStream(self->sdr, self->rxStream, 0, 0, 0);
         log_assert(ret == 0);
     }
@@ -146,14 +402,16 @@ soapy_source_t *soapy_source_create(double samplerate, double frequency,
 
 void soapy_source_start(soapy_source_t *self)
 {
-    self->handle = go(soapy_source_runner(self));
+    self->stack = stack_pool_get("soapy_source", STACK_SIZE_RUNNER);
+    self->handle = go_mem(soapy_source_runner(self), self->stack, STACK_SIZE_RUNNER);
     log_assert(self->handle >= 0);
 }
 
 void soapy_source_set_frequency(soapy_source_t *self, double frequency)
 {
-    int ret = SoapySDRDevice_setFrequency(self->sdr, SOAPY_SDR_RX, 0, frequency, NULL);
-    log_assert(ret == 0);
+    // picked up by the runner at the next block boundary
+    self->frequency = frequency;
+    self->retune = true;
 }
 
 void soapy_source_destroy(soapy_source_t **self_p)
@@ -167,6 +425,7 @@ void soapy_source_destroy(soapy_source_t **self_p)
 
         ret = hclose(self->handle);
         log_assert(ret == 0);
+        stack_pool_put(&self->stack);
 
         ret = SoapySDRDevice_deactivateStream(self->sdr, self->rxStream, 0, 0);
         log_assert(ret == 0);
@@ -175,7 +434,9 @@ void soapy_source_destroy(soapy_source_t **self_p)
 
         SoapySDRDevice_unmake(self->sdr);
 
-        free(self);
+        link_free(self->scratch);
+        metrics_remove(&self->overflows);
+        link_free(self);
         *self_p = NULL;
     }
     LOG(DEBUG, "Destroyed");
@@ -0,0 +1,108 @@
+#include "stack_pool.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "link.h"
+#include "logging.h"
+
+#define STACK_POOL_MAX (32)
+#define STACK_PAINT (0xa5)
+
+typedef struct
+{
+    const char *name;
+    uint8_t *mem;
+    size_t size;
+    bool used;
+} stack_slot_t;
+
+static stack_slot_t slots[STACK_POOL_MAX];
+
+// stacks grow down, whatever is still painted at the bottom was never touched
+static size_t stack_pool_high_water(const stack_slot_t *slot)
+{
+    size_t i = 0;
+
+    while ((i < slot->size) && (slot->mem[i] == STACK_PAINT))
+    {
+        i++;
+    }
+
+    return slot->size - i;
+}
+
+void *stack_pool_get(const char *name, size_t size)
+{
+    stack_slot_t *slot = NULL;
+
+    // reuse a returned stack that is big enough before carving a new one
+    for (size_t i = 0; i < STACK_POOL_MAX; i++)
+    {
+        if (slots[i].mem && !slots[i].used && (slots[i].size >= size))
+        {
+            slot = &slots[i];
+            break;
+        }
+    }
+
+    if (!slot)
+    {
+        for (size_t i = 0; i < STACK_POOL_MAX; i++)
+        {
+            if (!slots[i].mem)
+            {
+                slot = &slots[i];
+                slot->mem = (uint8_t *)link_alloc(size);
+                slot->size = size;
+                break;
+            }
+        }
+    }
+    dlg_assertm(slot, "No free coroutine stack for '%s'", name);
+
+    slot->name = name;
+    slot->used = true;
+    memset(slot->mem, STACK_PAINT, slot->size);
+
+    return slot->mem;
+}
+
+void stack_pool_put(void **stack_p)
+{
+    log_assert(stack_p);
+    if (*stack_p)
+    {
+        for (size_t i = 0; i < STACK_POOL_MAX; i++)
+        {
+            stack_slot_t *slot = &slots[i];
+
+            if (slot->used && (slot->mem == *stack_p))
+            {
+                size_t hw = stack_pool_high_water(slot);
+                if (hw == slot->size)
+                {
+                    LOG(ERROR, "Stack of '%s' overflowed (%lu bytes)", slot->name, slot->size);
+                }
+                LOG(INFO, "Stack of '%s': %lu of %lu bytes used", slot->name, hw, slot->size);
+                slot->used = false;
+                *stack_p = NULL;
+                return;
+            }
+        }
+        dlg_assertm(false, "Unknown coroutine stack %p", *stack_p);
+    }
+}
+
+void stack_pool_report(void)
+{
+    for (size_t i = 0; i < STACK_POOL_MAX; i++)
+    {
+        if (slots[i].used)
+        {
+            LOG(INFO, "Stack of '%s': %lu of %lu bytes used", slots[i].name,
+                stack_pool_high_water(&slots[i]), slots[i].size);
+        }
+    }
+}
@@ -1,59 +1,143 @@
 #include "tflite_runner.h"
 
+#include <stdio.h>
+#include <string.h>
+
+#include <memory>
+#include <vector>
+
 #include "logging.h"
+#include "latency.h"
 
-#include "tensorflow/lite/c/c_api.h"
+#include "tensorflow/lite/interpreter.h"
+#include "tensorflow/lite/kernels/register.h"
+#include "tensorflow/lite/model.h"
+#include "tensorflow/lite/core/api/profiler.h"
 
 #define LABEL_COUNT (17)
+#define NUM_THREADS (2)
 
 static const char *labels[LABEL_COUNT] = {"zero", "one", "two", "three",
                                           "four", "five", "six", "seven",
                                           "eight", "nine", "yes", "no",
                                           "left", "right", "up", "down", "go"};
 
+// Time and runs of every node, fed by the operator events of the interpreter
+class OpProfiler : public tflite::Profiler
+{
+public:
+    typedef struct
+    {
+        const char *name;
+        size_t count;
+        uint64_t total_ns;
+    } op_stats_t;
+
+    uint32_t BeginEvent(const char *tag, EventType event_type,
+                        int64_t event_metadata1, int64_t event_metadata2) override
+    {
+        (void)event_metadata2;
+        if ((event_type != EventType::OPERATOR_INVOKE_EVENT) &&
+            (event_type != EventType::DELEGATE_OPERATOR_INVOKE_EVENT))
+        {
+            return 0;
+        }
+
+        // 'event_metadata1' is the node index
+        size_t node = (event_metadata1 >= 0) ? (size_t)event_metadata1 : 0;
+        if (node >= ops.size())
+        {
+            ops.resize(node + 1, op_stats_t{nullptr, 0, 0});
+        }
+        ops[node].name = tag;
+        open.push_back({node, latency_now_ns()});
+
+        return open.size();
+    }
+
+    void EndEvent(uint32_t event_handle) override
+    {
+        // operator events do not overlap, the last one opened ends first
+        if ((event_handle == 0) || (event_handle != open.size()))
+        {
+            return;
+        }
+
+        op_stats_t &op = ops[open.back().node];
+        op.count++;
+        op.total_ns += latency_now_ns() - open.back().start_ns;
+        open.pop_back();
+    }
+
+    std::vector<op_stats_t> ops;
+
+private:
+    typedef struct
+    {
+        size_t node;
+        uint64_t start_ns;
+    } open_event_t;
+
+    std::vector<open_event_t> open;
+};
+
 struct _tflite_runner_t
 {
-    TfLiteInterpreter* interpreter;
+    std::unique_ptr<tflite::FlatBufferModel> model;
+    std::unique_ptr<tflite::Interpreter> interpreter;
+    std::unique_ptr<OpProfiler> profiler;
+    // time of every invoke, profiled or not
+    latency_hist_t invoke;
 };
 
-static tflite_runner_t *tflite_runner_create(TfLiteModel *model)
+static tflite_runner_t *tflite_runner_create(std::unique_ptr<tflite::FlatBufferModel> model)
 {
     TfLiteStatus s;
 
-    tflite_runner_t *self = (tflite_runner_t *)malloc(sizeof(tflite_runner_t));
+    log_assert(model != nullptr);
+    tflite_runner_t *self = new tflite_runner_t();
     log_assert(self);
 
-    TfLiteInterpreterOptions *options = TfLiteInterpreterOptionsCreate();
-    self->interpreter = TfLiteInterpreterCreate(model, options);
-    log_assert(self->interpreter != nullptr);
-    TfLiteInterpreterOptionsSetNumThreads(options, 2);
+    // the interpreter points into the model, which has to outlive it
+    self->model = std::move(model);
+    tflite::ops::builtin::BuiltinOpResolver resolver;
+    s = tflite::InterpreterBuilder(*self->model, resolver)(&self->interpreter);
+    log_assert((s == kTfLiteOk) && (self->interpreter != nullptr));
+    self->interpreter->SetNumThreads(NUM_THREADS);
 
-    s = TfLiteInterpreterAllocateTensors(self->interpreter);
+    s = self->interpreter->AllocateTensors();
     log_assert(s == kTfLiteOk);
 
-    log_assert(TfLiteInterpreterGetInputTensorCount(self->interpreter) == 1);
-    log_assert(TfLiteInterpreterGetOutputTensorCount(self->interpreter) == 1);
+    log_assert(self->interpreter->inputs().size() == 1);
+    log_assert(self->interpreter->outputs().size() == 1);
 
-    TfLiteModelDelete(model);
-    TfLiteInterpreterOptionsDelete(options);
+    latency_init(&self->invoke);
 
     return self;
 }
 
 tflite_runner_t *tflite_runner_create_from_file(const char *model_file_name)
 {
-    TfLiteModel *model =
-        TfLiteModelCreateFromFile(model_file_name);
-    log_assert(model != nullptr);
-    return tflite_runner_create(model);
+    return tflite_runner_create(tflite::FlatBufferModel::BuildFromFile(model_file_name));
 }
 
 tflite_runner_t *tflite_runner_create_from_mem(const void *model_data, size_t model_size)
 {
-    TfLiteModel *model =
-        TfLiteModelCreate(model_data, model_size);
-    log_assert(model != nullptr);
-    return tflite_runner_create(model);
+    return tflite_runner_create(tflite::FlatBufferModel::BuildFromBuffer((const char *)model_data, model_size));
+}
+
+void tflite_runner_set_profiling(tflite_runner_t *self, bool enabled)
+{
+    if (enabled && !self->profiler)
+    {
+        self->profiler.reset(new OpProfiler());
+        self->interpreter->SetProfiler(self->profiler.get());
+    }
+    else if (!enabled && self->profiler)
+    {
+        self->interpreter->SetProfiler(nullptr);
+        self->profiler.reset();
+    }
 }
 
 int tflite_runner_run(tflite_runner_t *self,
@@ -62,25 +146,21 @@ int tflite_runner_run(tflite_runner_t *self,
 {
     TfLiteStatus s;
     int argmax = -1;
-    float output[sizeof(labels)];
 
-    TfLiteTensor* input_tensor = TfLiteInterpreterGetInputTensor(self->interpreter, 0);
+    TfLiteTensor *input_tensor = self->interpreter->input_tensor(0);
     log_assert(input_tensor != nullptr);
-    log_assert(TfLiteTensorType(input_tensor) == kTfLiteFloat32);
-    log_assert(TfLiteTensorByteSize(input_tensor) == input_size * sizeof(float));
-    s = TfLiteTensorCopyFromBuffer(input_tensor, input, input_size * sizeof(float));
-    log_assert(s == kTfLiteOk);
+    log_assert(input_tensor->type == kTfLiteFloat32);
+    log_assert(input_tensor->bytes == input_size * sizeof(float));
+    memcpy(input_tensor->data.f, input, input_size * sizeof(float));
 
-    s = TfLiteInterpreterInvoke(self->interpreter);
+    uint64_t start = latency_now_ns();
+    s = self->interpreter->Invoke();
+    latency_add(&self->invoke, latency_now_ns() - start);
     log_assert(s == kTfLiteOk);
 
-    const TfLiteTensor *output_tensor =
-        TfLiteInterpreterGetOutputTensor(self->interpreter, 0);
-    log_assert(TfLiteTensorByteSize(output_tensor) == LABEL_COUNT * sizeof(float));
-
-    s = TfLiteTensorCopyToBuffer(output_tensor, output,
-                                 LABEL_COUNT * sizeof(float));
-    log_assert(s == kTfLiteOk);
+    const TfLiteTensor *output_tensor = self->interpreter->output_tensor(0);
+    log_assert(output_tensor->bytes == LABEL_COUNT * sizeof(float));
+    const float *output = output_tensor->data.f;
 
     *score = 0.001f;
     for (int i = 0; i < (int)LABEL_COUNT; ++i)
@@ -94,9 +174,43 @@ int tflite_runner_run(tflite_runner_t *self,
     return argmax;
 }
 
+void tflite_runner_report(const tflite_runner_t *self)
+{
+    latency_log(&self->invoke, "of the model invoke");
+
+    if (!self->profiler)
+    {
+        return;
+    }
+
+    uint64_t total = 0;
+    for (const OpProfiler::op_stats_t &op : self->profiler->ops)
+    {
+        total += op.total_ns;
+    }
+    if (total == 0)
+    {
+        return;
+    }
+
+    // a table, printed in one go after what is queued in the log
+    logging_flush();
+    printf("%5s %-28s %8s %12s %10s %7s\n", "node", "op", "runs", "avg us", "total ms", "%");
+    for (size_t i = 0; i < self->profiler->ops.size(); i++)
+    {
+        const OpProfiler::op_stats_t &op = self->profiler->ops[i];
+        if (op.count == 0)
+        {
+            continue;
+        }
+        printf("%5lu %-28.28s %8lu %12.1f %10.2f %6.1f%%\n", i, op.name ? op.name : "?", op.count,
+               (op.total_ns / 1e3) / op.count, op.total_ns / 1e6, (100.0 * op.total_ns) / total);
+    }
+}
+
 const char *tflite_get_label(int id)
 {
-    if ((id < 0) || (id > LABEL_COUNT))
+    if ((id < 0) || (id >= LABEL_COUNT))
     {
         return NULL;
     }
@@ -106,6 +220,11 @@ const char *tflite_get_label(int id)
     }
 }
 
+size_t tflite_get_label_count(void)
+{
+    return LABEL_COUNT;
+}
+
 void tflite_runner_destroy(tflite_runner_t **self_p)
 {
     LOG(DEBUG, "Destroying");
@@ -113,9 +232,10 @@ void tflite_runner_destroy(tflite_runner_t **self_p)
     if (*self_p)
     {
         tflite_runner_t *self = *self_p;
-        TfLiteInterpreterDelete(self->interpreter);
-        free(self);
+        // the interpreter goes before the profiler and the model it uses
+        self->interpreter.reset();
+        delete self;
         *self_p = NULL;
     }
     LOG(DEBUG, "Destroyed");
-}
\ No newline at end of file
+}
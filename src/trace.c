@@ -0,0 +1,235 @@
+#define _GNU_SOURCE
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "latency.h"
+#include "logging.h"
+#include "profile.h"
+
+#define MAX_THREADS (16)
+#define DEFAULT_EVENTS (32768UL)
+#define THREAD_NAME_SIZE (16)
+// instants keep their value in 'arg' with this bit set, spans their duration
+#define INSTANT ((uint64_t)1 << 63)
+
+typedef struct
+{
+    uint64_t ts;
+    uint64_t arg;
+    const char *name;
+    const char *cat;
+} trace_event_t;
+
+typedef struct
+{
+    trace_event_t *events;
+    // only written by the owner thread, read by trace_stop
+    _Atomic uint64_t count;
+    pid_t tid;
+    char thread_name[THREAD_NAME_SIZE];
+} trace_buffer_t;
+
+static _Atomic bool trace_on;
+static const char *trace_path;
+static size_t trace_size;
+static trace_buffer_t buffers[MAX_THREADS];
+static _Atomic size_t claimed;
+static _Atomic size_t lost;
+static _Thread_local trace_buffer_t *local;
+static _Thread_local bool unclaimed;
+static pid_t pid;
+
+bool trace_start(const char *path)
+{
+    trace_size = profile_get("trace.events", DEFAULT_EVENTS);
+    for (size_t i = 0; i < MAX_THREADS; i++)
+    {
+        // touched here, so that nothing faults in while recording
+        buffers[i].events = (trace_event_t *)malloc(trace_size * sizeof(trace_event_t));
+        if (!buffers[i].events)
+        {
+            LOG(ERROR, "No memory for the trace buffers");
+            for (size_t j = 0; j < i; j++)
+            {
+                free(buffers[j].events);
+                buffers[j].events = NULL;
+            }
+            return false;
+        }
+        memset(buffers[i].events, 0, trace_size * sizeof(trace_event_t));
+        atomic_init(&buffers[i].count, 0);
+    }
+    trace_path = path;
+    pid = getpid();
+    atomic_store(&trace_on, true);
+    LOG(INFO, "Tracing into %s, %lu events per thread", path, trace_size);
+
+    return true;
+}
+
+// The first event of a thread takes the next free buffer
+static trace_buffer_t *trace_buffer(void)
+{
+    if (local || unclaimed)
+    {
+        return local;
+    }
+
+    size_t i = atomic_fetch_add(&claimed, 1);
+    if (i >= MAX_THREADS)
+    {
+        unclaimed = true;
+        return NULL;
+    }
+    local = &buffers[i];
+    local->tid = syscall(SYS_gettid);
+    pthread_getname_np(pthread_self(), local->thread_name, sizeof(local->thread_name));
+
+    return local;
+}
+
+static void trace_record(const char *name, const char *cat, uint64_t ts, uint64_t arg)
+{
+    trace_buffer_t *b = trace_buffer();
+    if (!b)
+    {
+        atomic_fetch_add_explicit(&lost, 1, memory_order_relaxed);
+        return;
+    }
+
+    uint64_t n = atomic_load_explicit(&b->count, memory_order_relaxed);
+    trace_event_t *e = &b->events[n % trace_size];
+    e->ts = ts;
+    e->arg = arg;
+    e->name = name;
+    e->cat = cat;
+    atomic_store_explicit(&b->count, n + 1, memory_order_release);
+}
+
+uint64_t trace_begin(void)
+{
+    if (!atomic_load_explicit(&trace_on, memory_order_relaxed))
+    {
+        return 0;
+    }
+
+    return latency_now_ns();
+}
+
+void trace_complete(const char *name, const char *cat, uint64_t start)
+{
+    if (start == 0)
+    {
+        return;
+    }
+
+    trace_record(name, cat, start, latency_now_ns() - start);
+}
+
+void trace_instant(const char *name, const char *cat, uint64_t value)
+{
+    if (!atomic_load_explicit(&trace_on, memory_order_relaxed))
+    {
+        return;
+    }
+
+    trace_record(name, cat, latency_now_ns(), value | INSTANT);
+}
+
+static void trace_write_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++)
+    {
+        if ((*s == '"') || (*s == '\\'))
+        {
+            fputc('\\', f);
+        }
+        fputc(((unsigned char)*s < 0x20) ? ' ' : *s, f);
+    }
+    fputc('"', f);
+}
+
+static void trace_write_event(FILE *f, const trace_buffer_t *b, const trace_event_t *e)
+{
+    fprintf(f, ",\n{\"name\":");
+    trace_write_string(f, e->name);
+    fprintf(f, ",\"cat\":");
+    trace_write_string(f, e->cat);
+    if (e->arg & INSTANT)
+    {
+        fprintf(f, ",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"n\":%lu}}",
+                e->ts / 1e3, pid, b->tid, e->arg & ~INSTANT);
+    }
+    else
+    {
+        fprintf(f, ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+                e->ts / 1e3, e->arg / 1e3, pid, b->tid);
+    }
+}
+
+void trace_stop(void)
+{
+    if (!atomic_exchange(&trace_on, false))
+    {
+        return;
+    }
+
+    FILE *f = fopen(trace_path, "w");
+    if (!f)
+    {
+        LOG(ERROR, "Failed to open %s", trace_path);
+    }
+
+    size_t used = atomic_load(&claimed);
+    used = (used < MAX_THREADS) ? used : MAX_THREADS;
+    size_t written = 0, overwritten = 0;
+
+    if (f)
+    {
+        fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"dsp\"}}", pid);
+    }
+    for (size_t i = 0; i < used; i++)
+    {
+        const trace_buffer_t *b = &buffers[i];
+        uint64_t count = atomic_load_explicit(&b->count, memory_order_acquire);
+        uint64_t first = (count > trace_size) ? count - trace_size : 0;
+
+        overwritten += first;
+        if (f)
+        {
+            fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+                    pid, b->tid);
+            trace_write_string(f, b->thread_name[0] ? b->thread_name : "thread");
+            fprintf(f, "}}");
+            for (uint64_t n = first; n < count; n++)
+            {
+                trace_write_event(f, b, &b->events[n % trace_size]);
+            }
+        }
+        written += count - first;
+    }
+    if (f)
+    {
+        fprintf(f, "\n]}\n");
+        fclose(f);
+        LOG(INFO, "Trace of %lu events written to %s (%lu overwritten, %lu from threads beyond %d)",
+            written, trace_path, overwritten, atomic_load(&lost), MAX_THREADS);
+    }
+
+    for (size_t i = 0; i < MAX_THREADS; i++)
+    {
+        free(buffers[i].events);
+        buffers[i].events = NULL;
+    }
+}
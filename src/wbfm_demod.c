@@ -3,6 +3,8 @@
 #include <liquid/liquid.h>
 
 #include "logging.h"
+#include "profile.h"
+#include "stack_pool.h"
 
 struct _wbfm_demod_t
 {
@@ -11,14 +13,27 @@ struct _wbfm_demod_t
     freqdem fmdemod;
     link_t *output;
     int handle;
+    void *stack;
     unsigned int decim;
+    // demodulated samples of one input block
+    float *tmp;
+    size_t bs;
 };
 
-static bool wbfm_demod_handler(void *ctx, void *in_buf, const link_msg_t *in_msg,
-                               void *out_buf, link_msg_t *out_msg)
+bool wbfm_demod_handler(void *ctx, void *in_buf, const link_msg_t *in_msg,
+                        void *out_buf, link_msg_t *out_msg)
 {
     wbfm_demod_t *self = (wbfm_demod_t*)ctx;
-    float tmp[in_msg->len];
+    float *tmp = self->tmp;
+
+    log_assert(in_msg->len <= self->bs);
+
+    if (in_msg->flags & LINK_MSG_RETUNE)
+    {
+        freqdem_reset(self->fmdemod);
+        iirfilt_rrrf_reset(self->iir_deemph);
+        firdecim_rrrf_reset(self->fir_decim);
+    }
 
     freqdem_demodulate_block(self->fmdemod, (float complex *)in_buf, in_msg->len, tmp);
     iirfilt_rrrf_execute_block(self->iir_deemph, tmp, in_msg->len, tmp);
@@ -30,7 +45,7 @@ static bool wbfm_demod_handler(void *ctx, void *in_buf, const link_msg_t *in_msg
     return true;
 }
 
-wbfm_demod_t *wbfm_demod_create(unsigned int rate, unsigned int decim, link_t *input)
+wbfm_demod_t *wbfm_demod_create_stage(unsigned int rate, unsigned int decim, size_t bs)
 {
     log_assert((rate % decim) == 0);
     firdecim_rrrf firdecim = firdecim_rrrf_create_kaiser(decim, 10, 60.0);
@@ -48,20 +63,34 @@ wbfm_demod_t *wbfm_demod_create(unsigned int rate, unsigned int decim, link_t *i
     log_assert(fmdemod);
     //freqdem_print(fmdemod);
 
-    wbfm_demod_t *self = (wbfm_demod_t *)malloc(sizeof(wbfm_demod_t));
+    wbfm_demod_t *self = (wbfm_demod_t *)link_alloc(sizeof(wbfm_demod_t));
     log_assert(self);
 
-    self->output = link_connect("wbfm_demod", input, 2,
-                                input->out_bs, sizeof(complex float),
-                                (input->out_bs / decim), sizeof(float));
-    log_assert(self->output);
-
     self->fir_decim = firdecim;
     self->iir_deemph = iir_deemph;
     self->fmdemod = fmdemod;
     self->decim = decim;
+    self->bs = bs;
+    self->tmp = (float *)link_alloc(self->bs * sizeof(float));
+    self->output = NULL;
+    self->handle = -1;
+    self->stack = NULL;
+
+    return self;
+}
+
+wbfm_demod_t *wbfm_demod_create(unsigned int rate, unsigned int decim, link_t *input)
+{
+    wbfm_demod_t *self = wbfm_demod_create_stage(rate, decim, input->out_bs);
+    log_assert(self);
+
+    self->output = link_connect("wbfm_demod", input, profile_get("wbfm_demod.in_nb", 2),
+                                input->out_bs, sizeof(complex float),
+                                (input->out_bs / decim), sizeof(float));
+    log_assert(self->output);
 
-    self->handle = go(link_run(self->output, self, wbfm_demod_handler));
+    self->stack = stack_pool_get("wbfm_demod", STACK_SIZE_HANDLER);
+    self->handle = go_mem(link_run(self->output, self, wbfm_demod_handler), self->stack, STACK_SIZE_HANDLER);
     log_assert(self->handle >= 0);
 
     return self;
@@ -79,12 +108,17 @@ void wbfm_demod_destroy(wbfm_demod_t **self_p)
     if (*self_p)
     {
         wbfm_demod_t *self = *self_p;
-        int ret = hclose(self->handle);
-        log_assert(ret == 0);
+        if (self->handle >= 0)
+        {
+            int ret = hclose(self->handle);
+            log_assert(ret == 0);
+            stack_pool_put(&self->stack);
+        }
         freqdem_destroy(self->fmdemod);
         iirfilt_rrrf_destroy(self->iir_deemph);
         firdecim_rrrf_destroy(self->fir_decim);
-        free(self);
+        link_free(self->tmp);
+        link_free(self);
         *self_p = NULL;
     }
     LOG(DEBUG, "Destroyed");
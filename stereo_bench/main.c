@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <complex.h>
+#include <math.h>
+
+#include <libdill.h>
+
+#include "logging.h"
+#include "link.h"
+#include "runtime.h"
+
+#include "fm_source.h"
+#include "resampler.h"
+#include "fms_demod.h"
+
+// same rates and block size as wbfm_demod
+#define RATE (1000000UL)
+#define RRATE (192000UL)
+#define DECIM (4UL)
+#define AUDIO_RATE (RRATE / DECIM)
+#define BLOCK_SIZE (10 * 1000UL)
+#define DEFAULT_TOTAL (1UL << 23)
+// whole Hz, so that every second of audio holds whole periods of both
+#define LEFT_HZ (1000UL)
+#define RIGHT_HZ (1500UL)
+#define AMPLITUDE (0.8f)
+// left for the pilot PLL to lock and the filters to settle
+#define SETTLE_MS (250UL)
+#define DEFAULT_MIN_SEPARATION_DB (20.0)
+#define DEFAULT_MIN_SNR_DB (30.0)
+
+typedef struct
+{
+    double tone;
+    double crosstalk;
+    double noise;
+} channel_stats_t;
+
+static size_t num_workers = 0;
+static size_t total = DEFAULT_TOTAL;
+static float cnr_db = INFINITY;
+static float offset_hz = 0.0f;
+static double min_separation = DEFAULT_MIN_SEPARATION_DB;
+static double min_snr = DEFAULT_MIN_SNR_DB;
+
+static const char help_msg[] =
+    "stereo_bench, synthetic FM stereo station through resampler and fms_demod\n"
+    "prints the throughput, the stereo separation and the SNR of both channels\n\n"
+    "Use:\tstereo_bench [-n <samples>] [-c <dB>] [-o <Hz>] [-s <dB>] [-r <dB>] [-j <threads>]\n"
+    "\t-n number of SDR samples pushed through\n"
+    "\t-c carrier to noise ratio of the station, no noise by default\n"
+    "\t-o carrier offset\n"
+    "\t-s minimum stereo separation (default 20 dB)\n"
+    "\t-r minimum SNR (default 30 dB)\n"
+    "\t-j run the blocks on a pool of worker threads\n";
+
+static bool parse_args(int argc, char *argv[])
+{
+    int opt;
+    bool ret = true;
+
+    while (ret && (opt = getopt(argc, argv, "n:c:o:s:r:j:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            total = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'c':
+            cnr_db = strtof(optarg, NULL);
+            break;
+
+        case 'o':
+            offset_hz = strtof(optarg, NULL);
+            break;
+
+        case 's':
+            min_separation = strtod(optarg, NULL);
+            break;
+
+        case 'r':
+            min_snr = strtod(optarg, NULL);
+            break;
+
+        case 'j':
+            num_workers = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'h':
+            fprintf(stderr, help_msg);
+            ret = false;
+            break;
+
+        default:
+            fprintf(stderr, "\n");
+            fprintf(stderr, help_msg);
+            ret = false;
+            break;
+        }
+    }
+
+    return ret;
+}
+
+// Keeps the first 'frames' stereo frames
+static coroutine void sink(link_t *in, float *out, size_t frames, int done_ch)
+{
+    link_msg_t msg;
+    size_t samples = 2 * frames;
+
+    while (samples > 0)
+    {
+        if (link_recv(in, &msg, -1) != 0)
+        {
+            return;
+        }
+
+        size_t n;
+        while ((samples > 0) && ((n = link_consume(in, out, samples)) > 0))
+        {
+            out += n;
+            samples -= n;
+        }
+    }
+
+    link_close(in);
+    int ret = chsend(done_ch, NULL, 0, -1);
+    log_assert(ret == 0);
+}
+
+// Power of the tone at 'hz' in 'n' interleaved samples holding whole periods of it
+static double tone_power(const float *x, size_t n, double hz)
+{
+    double re = 0.0, im = 0.0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        double w = 2 * M_PI * hz * i / AUDIO_RATE;
+        re += x[2 * i] * cos(w);
+        im += x[2 * i] * sin(w);
+    }
+    re *= 2.0 / n;
+    im *= 2.0 / n;
+
+    return ((re * re) + (im * im)) / 2.0;
+}
+
+// Wanted and the other channel's tone, the rest of the AC power is noise
+// and distortion, the tones are orthogonal over whole seconds
+static void analyze(const float *x, size_t n, double wanted_hz, double other_hz, channel_stats_t *stats)
+{
+    double mean = 0.0, power = 0.0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        mean += x[2 * i];
+    }
+    mean /= n;
+    for (size_t i = 0; i < n; i++)
+    {
+        double v = x[2 * i] - mean;
+        power += v * v;
+    }
+    power /= n;
+
+    stats->tone = tone_power(x, n, wanted_hz);
+    stats->crosstalk = tone_power(x, n, other_hz);
+    stats->noise = power - stats->tone - stats->crosstalk;
+    if (stats->noise <= 0.0)
+    {
+        stats->noise = 1e-20;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int ret;
+    int done[2];
+    int h;
+    runtime_t *rt = NULL;
+    channel_stats_t left, right;
+
+    logging_init();
+
+    ret = parse_args(argc, argv);
+    if (!ret)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    if (num_workers > 0)
+    {
+        rt = runtime_create(num_workers);
+        log_assert(rt);
+        link_set_runtime(rt);
+    }
+
+    // output of 'total' input samples, leaving out what is still in the filters
+    size_t frames = ((total / BLOCK_SIZE) - 2) * ((BLOCK_SIZE * RRATE) / RATE / DECIM);
+    size_t skip = (SETTLE_MS * AUDIO_RATE) / 1000;
+    if ((total < (3 * BLOCK_SIZE)) || (frames < (skip + AUDIO_RATE)))
+    {
+        fprintf(stderr, "At least %lu samples\n",
+                (((skip + AUDIO_RATE) * DECIM * RATE) / RRATE) + (3 * BLOCK_SIZE));
+        exit(EXIT_FAILURE);
+    }
+
+    float *audio = (float *)malloc(2 * frames * sizeof(float));
+    log_assert(audio);
+
+    ret = chmake(done);
+    log_assert(ret == 0);
+
+    link_t *src = link_connect("fm_source", NULL, 0, BLOCK_SIZE, sizeof(complex float),
+                               BLOCK_SIZE, sizeof(complex float));
+    log_assert(src);
+    link_set_format(src, LINK_FMT_CF32);
+    fm_source_t *station = fm_source_create(RATE, src);
+    log_assert(station);
+    fm_source_set_program(station, LEFT_HZ, RIGHT_HZ, AMPLITUDE);
+    fm_source_set_noise(station, cnr_db);
+    fm_source_set_offset(station, offset_hz);
+    fm_source_set_length(station, total);
+
+    resampler_t *resamp = resampler_create(RATE, RRATE, 0, src);
+    log_assert(resamp);
+    fms_demod_t *demod = fms_demod_create(RRATE, DECIM, resampler_get_output(resamp));
+    log_assert(demod);
+    link_t *out = fms_demod_get_output(demod);
+    link_t *snk = link_connect("sink", out, 2, out->out_bs, sizeof(float), out->out_bs, sizeof(float));
+    log_assert(snk);
+
+    int64_t start = latency_now_ns();
+    h = go(sink(snk, audio, frames, done[0]));
+    log_assert(h >= 0);
+    fm_source_start(station);
+
+    ret = chrecv(done[1], NULL, 0, -1);
+    log_assert(ret == 0);
+    double msps = (frames * DECIM * RATE / RRATE) / ((latency_now_ns() - start) / 1e3);
+
+    // the worker threads must be done with the blocks before they get destroyed
+    link_stop_tasks();
+    ret = hclose(h);
+    log_assert(ret == 0);
+    fm_source_destroy(&station);
+    fms_demod_destroy(&demod);
+    resampler_destroy(&resamp);
+    ret = hclose(done[0]);
+    log_assert(ret == 0);
+    ret = hclose(done[1]);
+    log_assert(ret == 0);
+
+    // whole seconds after the settling time
+    size_t n = ((frames - skip) / AUDIO_RATE) * AUDIO_RATE;
+    analyze(&audio[2 * skip], n, LEFT_HZ, RIGHT_HZ, &left);
+    analyze(&audio[(2 * skip) + 1], n, RIGHT_HZ, LEFT_HZ, &right);
+
+    double sep_l = 10 * log10(left.tone / left.crosstalk);
+    double sep_r = 10 * log10(right.tone / right.crosstalk);
+    double snr_l = 10 * log10(left.tone / left.noise);
+    double snr_r = 10 * log10(right.tone / right.noise);
+
+    printf("throughput %.2f Msamples/s (%.1fx real time)\n", msps, msps * 1e6 / RATE);
+    printf("%8s %16s %10s\n", "channel", "separation dB", "SNR dB");
+    printf("%8s %16.1f %10.1f\n", "left", sep_l, snr_l);
+    printf("%8s %16.1f %10.1f\n", "right", sep_r, snr_r);
+
+    bool ok = (sep_l >= min_separation) && (sep_r >= min_separation) &&
+              (snr_l >= min_snr) && (snr_r >= min_snr);
+    if (!ok)
+    {
+        printf("below %.1f dB separation or %.1f dB SNR\n", min_separation, min_snr);
+    }
+
+    if (rt)
+    {
+        runtime_destroy(&rt);
+    }
+    free(audio);
+
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
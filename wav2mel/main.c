@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include <ctype.h>
+#include <unistd.h>
 
 #include <complex.h>
 #include <math.h>
@@ -63,15 +64,27 @@ static void normalize(float *data, size_t size)
 
 int main(int argc, char *argv[])
 {
+    int opt;
+    bool profile_model = false;
+
     logging_init();
 
-    if (argc < 2)
+    // -p times every operator of the model
+    while ((opt = getopt(argc, argv, "p")) != -1)
+    {
+        if (opt == 'p')
+        {
+            profile_model = true;
+        }
+    }
+
+    if (optind >= argc)
     {
         LOG(ERROR, "Please provide WAV file to process");
         exit(EXIT_FAILURE);
     }
 
-    char *wav_file_name = argv[1];
+    char *wav_file_name = argv[optind];
 
     ctx_t ctx;
     size_t i;
@@ -135,6 +148,7 @@ int main(int argc, char *argv[])
     log_assert(ctx.n == NUM_OUTPUT_BINS);
 
     tflite_runner_t *tfr = tflite_runner_create_from_file(MODEL_FILE);
+    tflite_runner_set_profiling(tfr, profile_model);
     float score;
     int id = tflite_runner_run(tfr, ctx.output, OUTPUT_SIZE, &score);
     if (id >= 0)
@@ -145,6 +159,7 @@ int main(int argc, char *argv[])
     {
         LOG(ERROR, "Failed to predict keyword");
     }
+    tflite_runner_report(tfr);
     tflite_runner_destroy(&tfr);
 
     normalize(ctx.output, OUTPUT_SIZE);
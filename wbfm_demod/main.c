@@ -4,17 +4,27 @@
 
 #include <ctype.h>
 #include <termios.h>
+#include <unistd.h>
+#include <getopt.h>
 
 #include <complex.h>
 #include <math.h>
 
 #include <libdill.h>
-#include <libwebsockets.h>
 #include <liquid/liquid.h>
 
 #include "logging.h"
 #include "link.h"
 #include "util.h"
+#include "runtime.h"
+#include "arena.h"
+#include "stack_pool.h"
+#include "fuse.h"
+#include "profile.h"
+#include "realtime.h"
+#include "shm_link.h"
+#include "metrics.h"
+#include "trace.h"
 
 #include "resampler.h"
 #include "wbfm_demod.h"
@@ -31,29 +41,129 @@
 #define SDR_RESAMPLERATE (DECIMATION_FACTOR * AUDIO_SAMPLERATE)
 
 #define CFG_FILE_NAME ("stations.txt")
+// SDR blocks other processes can fall behind before they lose some
+#define SHM_BLOCKS (32UL)
+
+// pull mode: the SDR ring is the deep buffer, the resampler keeps up to
+// the latency bound and skips the rest
+#define SDR_PULL_BLOCKS (16UL)
+#define SDR_PULL_LATENCY_MS (30)
+
+// rings, link and block state of the whole pipeline, with huge pages
+// every ring takes at least one 2MB page
+#define ARENA_SIZE (4UL * 1024 * 1024)
+#define ARENA_SIZE_HUGEPAGES (32UL * 1024 * 1024)
 
 static double *frequencies;
 static size_t freq_n;
 static bool stereo = false;
+static size_t num_workers = 0;
+static bool hugepages = false;
+static link_format_e sdr_format = LINK_FMT_CF32;
+static bool fused = false;
+static bool pull = false;
+static size_t sdr_bs = SDR_NUM_SAMPLES;
+static bool realtime = false;
+static const char *realtime_cpus = NULL;
+static const char *publish_name = NULL;
+static int metrics_port = -1;
+static const char *trace_file = NULL;
+static bool probe = false;
 
 static const char help_msg[] =
     "wbfm_demod, a simple wide band FM demodulator application\n\n"
-    "Use:\twbfm_demod [-s]\n"
-    "\t-s use stereo mode instead of mono\n";
+    "Use:\twbfm_demod [-s] [-F] [-P] [-j <threads>] [-H] [-f <format>] [-S <name>]\n"
+    "\t[--realtime[=<dsp>,<audio>]] [--metrics[=<port>]] [--trace <file>] [--probe]\n"
+    "\t-s use stereo mode instead of mono\n"
+    "\t-F run resampler and mono demodulator as one fused block\n"
+    "\t-P let the audio device pull the samples through the pipeline\n"
+    "\t-j run the DSP blocks on a pool of worker threads\n"
+    "\t-H back the pipeline memory with huge pages\n"
+    "\t-f SDR sample format: cf32 (default), cs16 or cs8\n"
+    "\t-S publish the SDR samples to other processes (shm_monitor) under <name>\n"
+    "\t--realtime lock memory, real time scheduling, DSP and audio threads on\n"
+    "\t  the given cores (the last two by default)\n"
+    "\t--metrics serve Prometheus metrics on 127.0.0.1 (port 9101 by default)\n"
+    "\t--trace record the handlers and link events, written to <file> on exit\n"
+    "\t--probe measure the latency from the source to every block, logged on exit\n";
 
 static bool parse_args(int argc, char *argv[])
 {
     int opt;
     bool ret = true;
-
-    while (ret && (opt = getopt(argc, argv, "sh")) != -1)
+    static const struct option long_opts[] = {
+        {"realtime", optional_argument, NULL, 'R'},
+        {"metrics", optional_argument, NULL, 'M'},
+        {"trace", required_argument, NULL, 'T'},
+        {"probe", no_argument, NULL, 'L'},
+        {NULL, 0, NULL, 0}};
+
+    while (ret && (opt = getopt_long(argc, argv, "sFPj:Hf:S:h", long_opts, NULL)) != -1)
     {
         switch (opt)
         {
+        case 'R':
+            realtime = true;
+            realtime_cpus = optarg;
+            break;
+
+        case 'M':
+            metrics_port = optarg ? atoi(optarg) : METRICS_DEFAULT_PORT;
+            break;
+
+        case 'T':
+            trace_file = optarg;
+            break;
+
+        case 'L':
+            probe = true;
+            break;
+
         case 's':
             stereo = true;
             break;
 
+        case 'F':
+            fused = true;
+            break;
+
+        case 'P':
+            pull = true;
+            break;
+
+        case 'j':
+            num_workers = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'H':
+            hugepages = true;
+            break;
+
+        case 'S':
+            publish_name = optarg;
+            break;
+
+        case 'f':
+            if (strcmp(optarg, "cf32") == 0)
+            {
+                sdr_format = LINK_FMT_CF32;
+            }
+            else if (strcmp(optarg, "cs16") == 0)
+            {
+                sdr_format = LINK_FMT_CS16;
+            }
+            else if (strcmp(optarg, "cs8") == 0)
+            {
+                sdr_format = LINK_FMT_CS8;
+            }
+            else
+            {
+                fprintf(stderr, "Unknown sample format %s\n\n", optarg);
+                fprintf(stderr, help_msg);
+                ret = false;
+            }
+            break;
+
         case 'h':
             fprintf(stderr, help_msg);
             ret = false;
@@ -70,6 +180,17 @@ static bool parse_args(int argc, char *argv[])
     return ret;
 }
 
+static audio_sink_t *create_sink(unsigned int num_channels, link_t *input)
+{
+    if (pull)
+    {
+        LOG(INFO, "Audio device pulls the samples");
+        return audio_sink_create_pull(AUDIO_SAMPLERATE, num_channels, input);
+    }
+
+    return audio_sink_create(AUDIO_SAMPLERATE, num_channels, input);
+}
+
 static coroutine void key_press_handler(int out_ch)
 {
     int ret;
@@ -103,12 +224,20 @@ static coroutine void key_press_handler(int out_ch)
     tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
 }
 
+// Resampler and mono demodulator back to back, without a ring in between
+LINK_FUSE(resampler_wbfm_handler, resampler_handler, wbfm_demod_handler)
+
 static bool agc_handler(void *ctx, void *in_buf, const link_msg_t *in_msg,
                         void *out_buf, link_msg_t *out_msg)
 {
     float complex y;
     float rssi_sum = 0.0;
 
+    if (in_msg->flags & LINK_MSG_RETUNE)
+    {
+        agc_crcf_reset((agc_crcf)ctx);
+    }
+
     for (size_t i = 0; i < in_msg->len; i++)
     {
         agc_crcf_execute((agc_crcf)ctx, ((float complex *)in_buf)[i], &y);
@@ -121,27 +250,38 @@ static bool agc_handler(void *ctx, void *in_buf, const link_msg_t *in_msg,
     return true;
 }
 
-static void coroutine timeout(int out_ch, size_t delay)
+static coroutine void rssi_monitor(link_t *input, float *rssi)
 {
-    msleep(now() + delay);
-    chsend(out_ch, NULL, 0, -1);
+    link_msg_t msg;
+    float v;
+    bool fresh = true;
+
+    while (link_recv(input, &msg, -1) == 0)
+    {
+        if (msg.flags & LINK_MSG_RETUNE)
+        {
+            // the average starts over with the new station
+            link_flush(input);
+            fresh = true;
+        }
+        while (link_consume(input, &v, 1) == 1)
+        {
+            *rssi = fresh ? v : (0.9f * *rssi) + (0.1f * v);
+            fresh = false;
+        }
+    }
+    link_close(input);
 }
 
 static void scan(FILE *ofile, soapy_source_t *source, link_t *signal)
 {
     int ret;
     bool detected = false;
-    int tch[2], th;
     link_msg_t msg;
     float noise_floor;
     agc_crcf agc = agc_crcf_create();
     log_assert(agc);
 
-    ret = chmake(tch);
-    log_assert(ret == 0);
-    log_assert(tch[0] >= 0);
-    log_assert(tch[1] >= 0);
-
     link_t *agc_link = link_connect("agc", signal, 2,
                                     signal->out_bs, sizeof(complex float),
                                     1, sizeof(float));
@@ -151,48 +291,62 @@ static void scan(FILE *ofile, soapy_source_t *source, link_t *signal)
                                     agc_link->out_bs, sizeof(float),
                                     agc_link->out_bs, sizeof(float));
     log_assert(out_link);
+    // single RSSI values, pick up as many as are there per wakeup
+    link_set_coalesce(out_link, true);
 
-    struct chclause clauses[] = {
-        {CHRECV, out_link->in_ch_r, &msg, sizeof(link_msg_t)},
-        {CHRECV, tch[1], NULL, 0}};
-
-    int agc_handle = go(link_run(agc_link, agc, agc_handler));
+    void *agc_stack = stack_pool_get("agc", STACK_SIZE_HANDLER);
+    int agc_handle = go_mem(link_run(agc_link, agc, agc_handler), agc_stack, STACK_SIZE_HANDLER);
     log_assert(agc_handle >= 0);
+
+    soapy_source_start(source);
+
     // 20MHz between 88-108, scanning every 100kHz
     for (int i = -1; i < 201; i++)
     {
         double f = i < 0 ? 87.0e6 : 88.0e6 + (100.0e3 * i);
         float rssi, max_rssi, rssi_sum = 0.0;
         double freq;
-        size_t n, rssi_n = 0;
+        size_t rssi_n = 0;
+        bool retuned = false;
 
         LOG(DEBUG, "Scanning frequency [%d] %lf", i, f);
+        // the AGC gets reset by the retune tag, only what comes after it counts
         soapy_source_set_frequency(source, f);
-        agc_crcf_reset(agc);
-        th = go(timeout(tch[0], 500));
+        int64_t deadline = now() + 500;
 
         while (true)
         {
-            ret = choose(clauses, 2, -1);
-            if (ret < 0)
+            ret = link_recv(out_link, &msg, deadline);
+            if (ret == 0)
             {
-                goto exit;
+                if (msg.flags & LINK_MSG_RETUNE)
+                {
+                    link_flush(out_link);
+                    retuned = true;
+                }
+                while (link_consume(out_link, &rssi, 1) == 1)
+                {
+                    if (retuned)
+                    {
+                        rssi_sum += rssi;
+                        rssi_n++;
+                    }
+                }
             }
-            else if (ret == 0)
+            else if (errno == ETIMEDOUT)
             {
-                log_assert(msg.len == 1);
-                n = lws_ring_consume(out_link->in_buf, NULL, &rssi, 1);
-                log_assert(n == msg.len);
-                rssi_sum += rssi;
-                rssi_n++;
+                break;
             }
             else
             {
-                ret = hclose(th);
-                log_assert(ret == 0);
-                break;
+                goto exit;
             }
         }
+        if (rssi_n == 0)
+        {
+            LOG(WARN, "No samples at frequency %lf Hz", f);
+            continue;
+        }
         rssi = rssi_sum / rssi_n;
         LOG(DEBUG, "RSSI = %f dBm, frequency = %lf Hz", rssi, f);
         if(i < 0)
@@ -232,6 +386,7 @@ static void scan(FILE *ofile, soapy_source_t *source, link_t *signal)
 exit:
     ret = hclose(agc_handle);
     log_assert(ret == 0);
+    stack_pool_put(&agc_stack);
     agc_crcf_destroy(agc);
 }
 
@@ -239,6 +394,8 @@ int main(int argc, char *argv[])
 {
     int ret;
     link_t *src_link = NULL;
+    runtime_t *rt = NULL;
+    arena_t *arena = NULL;
 
     logging_init();
 
@@ -248,22 +405,58 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    src_link = link_connect("soapy_source", NULL, 0, SDR_NUM_SAMPLES, sizeof(complex float),
-                            SDR_NUM_SAMPLES, sizeof(complex float));
+    // before anything is mapped, so all of it gets locked
+    if (realtime)
+    {
+        realtime_init(realtime_cpus);
+    }
+
+    profile_load(PROFILE_FILE_NAME);
+    if (trace_file)
+    {
+        trace_start(trace_file);
+    }
+    link_set_probe(probe);
+    sdr_bs = profile_get("wbfm_demod.sdr_block", SDR_NUM_SAMPLES);
+    if ((((sdr_bs * SDR_RESAMPLERATE) % SDR_SAMPLERATE) != 0) ||
+        ((((sdr_bs * SDR_RESAMPLERATE) / SDR_SAMPLERATE) % DECIMATION_FACTOR) != 0))
+    {
+        LOG(WARN, "SDR block of %lu samples does not resample to whole audio blocks, using %lu",
+            sdr_bs, SDR_NUM_SAMPLES);
+        sdr_bs = SDR_NUM_SAMPLES;
+    }
+
+    if (num_workers > 0)
+    {
+        rt = runtime_create(num_workers);
+        log_assert(rt);
+        link_set_runtime(rt);
+    }
+
+    // everything the pipeline needs is carved out of one prefaulted block
+    // larger tuned blocks take proportionally more ring memory
+    size_t scale = (sdr_bs + SDR_NUM_SAMPLES - 1) / SDR_NUM_SAMPLES;
+    arena = arena_create(scale * (hugepages ? ARENA_SIZE_HUGEPAGES : ARENA_SIZE), hugepages);
+    log_assert(arena);
+    link_set_arena(arena);
+
+    src_link = link_connect("soapy_source", NULL, 0, sdr_bs, link_format_size(sdr_format),
+                            sdr_bs, link_format_size(sdr_format));
     log_assert(src_link);
+    link_set_format(src_link, sdr_format);
     soapy_source_t *iq_source = soapy_source_create(SDR_SAMPLERATE, 88.0e6, src_link);
     if (iq_source)
     {
         fms_demod_t *fms_demod;
         wbfm_demod_t *wbfm_demod;
         audio_sink_t *sink;
+        resampler_t *resamp = NULL;
         link_t *rsmp_link = NULL;
-
-        resampler_t *resamp = resampler_create(SDR_SAMPLERATE, SDR_RESAMPLERATE,
-                                               SDR_OFFSET_FREQ_HZ, src_link);
-        log_assert(resamp);
-        rsmp_link = resampler_get_output(resamp);
-        log_assert(rsmp_link);
+        link_fused_t *fusion = NULL;
+        link_t *fused_link = NULL;
+        void *fused_stack = NULL;
+        int fused_handle = -1;
+        shm_link_t *shm = NULL;
 
         log_assert((SDR_RESAMPLERATE % AUDIO_SAMPLERATE) == 0);
 
@@ -313,14 +506,16 @@ int main(int argc, char *argv[])
             LOG(INFO, "Loaded %lu frequencies from file", freq_n);
         }
 
-        soapy_source_start(iq_source);
-        
         if (freq_n == 0)
         {
             LOG(INFO, "Scanning for stations. Please wait...");
             cfg = fopen(CFG_FILE_NAME, "w");
 
             log_assert(cfg);
+            resamp = resampler_create(SDR_SAMPLERATE, SDR_RESAMPLERATE, SDR_OFFSET_FREQ_HZ, src_link);
+            log_assert(resamp);
+            rsmp_link = resampler_get_output(resamp);
+            log_assert(rsmp_link);
             scan(cfg, iq_source, rsmp_link);
 
             ret = fclose(cfg);
@@ -328,19 +523,106 @@ int main(int argc, char *argv[])
         }
         else
         {
-            if (stereo)
+            if (publish_name)
             {
-                LOG(INFO, "Stereo mode");
-                fms_demod = fms_demod_create(SDR_RESAMPLERATE, DECIMATION_FACTOR, rsmp_link);
-                link_t *demod_link = fms_demod_get_output(fms_demod);
-                sink = audio_sink_create(AUDIO_SAMPLERATE, 2, demod_link);
+                // first consumer of the SDR, the blocks below share its ring
+                shm = shm_link_publish(publish_name, src_link, SHM_BLOCKS);
+                log_assert(shm);
+            }
+
+            if (fused && !stereo)
+            {
+                // same handlers and block sizes as the unfused chain, the
+                // resampled block never leaves the cache
+                size_t mid_bs = (sdr_bs * SDR_RESAMPLERATE) / SDR_SAMPLERATE;
+
+                LOG(INFO, "Mono mode, fused resampler and demodulator");
+                resamp = resampler_create_stage(SDR_SAMPLERATE, SDR_RESAMPLERATE, SDR_OFFSET_FREQ_HZ,
+                                                sdr_format, sdr_bs);
+                log_assert(resamp);
+                wbfm_demod = wbfm_demod_create_stage(SDR_RESAMPLERATE, DECIMATION_FACTOR, mid_bs);
+                log_assert(wbfm_demod);
+                fusion = link_fused_create(resamp, wbfm_demod, mid_bs, sizeof(complex float));
+                log_assert(fusion);
+
+                fused_link = link_connect("resampler+wbfm_demod", src_link,
+                                          pull ? SDR_PULL_BLOCKS : profile_get("resampler.in_nb", 2),
+                                          src_link->out_bs, src_link->out_sz,
+                                          mid_bs / DECIMATION_FACTOR, sizeof(float));
+                log_assert(fused_link);
+                link_set_format(fused_link, LINK_FMT_F32);
+                if (pull)
+                {
+                    link_set_max_latency(fused_link, SDR_SAMPLERATE, SDR_PULL_LATENCY_MS);
+                }
+                fused_stack = stack_pool_get("resampler+wbfm_demod", STACK_SIZE_HANDLER);
+                fused_handle = go_mem(link_run(fused_link, fusion, resampler_wbfm_handler),
+                                      fused_stack, STACK_SIZE_HANDLER);
+                log_assert(fused_handle >= 0);
+                sink = create_sink(1, fused_link);
             }
             else
             {
-                LOG(INFO, "Mono mode");
-                wbfm_demod = wbfm_demod_create(SDR_RESAMPLERATE, DECIMATION_FACTOR, rsmp_link);
-                link_t *demod_link = wbfm_demod_get_output(wbfm_demod);
-                sink = audio_sink_create(AUDIO_SAMPLERATE, 1, demod_link);
+                resamp = resampler_create_bounded(SDR_SAMPLERATE, SDR_RESAMPLERATE, SDR_OFFSET_FREQ_HZ, src_link,
+                                                  pull ? SDR_PULL_BLOCKS : profile_get("resampler.in_nb", 2),
+                                                  pull ? SDR_PULL_LATENCY_MS : 0);
+                log_assert(resamp);
+                rsmp_link = resampler_get_output(resamp);
+                log_assert(rsmp_link);
+
+                if (stereo)
+                {
+                    LOG(INFO, "Stereo mode");
+                    fms_demod = fms_demod_create(SDR_RESAMPLERATE, DECIMATION_FACTOR, rsmp_link);
+                    link_t *demod_link = fms_demod_get_output(fms_demod);
+                    sink = create_sink(2, demod_link);
+                }
+                else
+                {
+                    LOG(INFO, "Mono mode");
+                    wbfm_demod = wbfm_demod_create(SDR_RESAMPLERATE, DECIMATION_FACTOR, rsmp_link);
+                    link_t *demod_link = wbfm_demod_get_output(wbfm_demod);
+                    sink = create_sink(1, demod_link);
+                }
+            }
+
+            // the RSSI probe shares the resampled stream with the demodulator,
+            // it drops blocks when it falls behind instead of holding it back,
+            // a fused chain has no resampled stream to share
+            float rssi = NAN;
+            agc_crcf agc = NULL;
+            void *probe_stack = NULL;
+            int probe_handle = -1;
+            void *rssi_stack = NULL;
+            int rssi_handle = -1;
+            if (rsmp_link)
+            {
+                agc = agc_crcf_create();
+                log_assert(agc);
+                link_t *probe_link = link_connect("rssi_probe", rsmp_link, 2,
+                                                  rsmp_link->out_bs, sizeof(complex float),
+                                                  1, sizeof(float));
+                log_assert(probe_link);
+                link_set_policy(probe_link, LINK_POLICY_DROP_OLDEST);
+                link_t *rssi_link = link_connect("rssi", probe_link, 2,
+                                                 1, sizeof(float),
+                                                 1, sizeof(float));
+                log_assert(rssi_link);
+                link_set_coalesce(rssi_link, true);
+                probe_stack = stack_pool_get("rssi_probe", STACK_SIZE_HANDLER);
+                probe_handle = go_mem(link_run(probe_link, agc, agc_handler), probe_stack, STACK_SIZE_HANDLER);
+                log_assert(probe_handle >= 0);
+                rssi_stack = stack_pool_get("rssi", STACK_SIZE_RUNNER);
+                rssi_handle = go_mem(rssi_monitor(rssi_link, &rssi), rssi_stack, STACK_SIZE_RUNNER);
+                log_assert(rssi_handle >= 0);
+            }
+
+            LOG(INFO, "Pipeline arena: %lu bytes used", arena_get_used(arena));
+
+            soapy_source_start(iq_source);
+            if (metrics_port >= 0)
+            {
+                metrics_start(metrics_port);
             }
 
             {
@@ -358,7 +640,8 @@ int main(int argc, char *argv[])
 
                 int cc = install_sigint_handler();
 
-                int kh = go(key_press_handler(key_ch[0]));
+                void *kh_stack = stack_pool_get("key_press_handler", STACK_SIZE_RUNNER);
+                int kh = go_mem(key_press_handler(key_ch[0]), kh_stack, STACK_SIZE_RUNNER);
                 log_assert(kh >= 0);
 
                 struct chclause clauses[] = {
@@ -371,6 +654,7 @@ int main(int argc, char *argv[])
                     switch (ret)
                     {
                     case 0:
+                        LOG(INFO, "RSSI = %f dBm, frequency = %lf Hz", rssi, frequencies[curr_f]);
                         curr_f++;
 
                         if (curr_f >= freq_n)
@@ -390,14 +674,27 @@ exit:
                 clean_sigint_handler();
                 ret = hclose(kh);
                 log_assert(ret == 0);
+                stack_pool_put(&kh_stack);
                 ret = hclose(key_ch[0]);
                 log_assert(ret == 0);
                 ret = hclose(key_ch[1]);
                 log_assert(ret == 0);
             }
             LOG(INFO, "Exiting application");
+            metrics_stop();
 
+            // the worker threads still run handlers that hand out credits
+            // and send to links the teardown is about to close
+            link_stop_tasks();
             soapy_source_destroy(&iq_source);
+            shm_link_destroy(&shm);
+            if (fusion)
+            {
+                ret = hclose(fused_handle);
+                log_assert(ret == 0);
+                stack_pool_put(&fused_stack);
+                link_fused_destroy(&fusion);
+            }
             resampler_destroy(&resamp);
             if (stereo)
             {
@@ -408,10 +705,28 @@ exit:
                 wbfm_demod_destroy(&wbfm_demod);
             }
             audio_sink_destroy(&sink);
+            if (agc)
+            {
+                ret = hclose(probe_handle);
+                log_assert(ret == 0);
+                stack_pool_put(&probe_stack);
+                ret = hclose(rssi_handle);
+                log_assert(ret == 0);
+                stack_pool_put(&rssi_stack);
+                agc_crcf_destroy(agc);
+            }
         }
 
     }
 
+    if (rt)
+    {
+        runtime_destroy(&rt);
+    }
+    trace_stop();
+    arena_destroy(&arena);
+    realtime_report();
+
     LOG(INFO, "Exiting");
     exit(EXIT_SUCCESS);
 }